@@ -0,0 +1,274 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: per erase block content index of an MTD device
+*/
+
+#include "block-index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+#include "debug.h"
+#include "exceptions.h"
+
+static constexpr char index_magic[8] = {'M', 'T', 'D', 'I', 'N', 'D', 'E', 'X'};
+static constexpr uint32_t index_version = 2;
+static constexpr size_t index_boot_id_size = 36;
+/* flash whose entries are invalidated on disk with one sync */
+static constexpr size_t index_sync_span = 1024 * 1024;
+
+struct block_index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t dev_size;
+    char boot_id[index_boot_id_size]; // written entries are from this boot
+} __attribute__((packed));
+
+/* the kernel's id of this boot, or all zeros if it cannot be read */
+static void index_boot_id(char* boot_id)
+{
+    std::memset(boot_id, 0, index_boot_id_size);
+    std::ifstream file("/proc/sys/kernel/random/boot_id");
+    file.read(boot_id, index_boot_id_size);
+    if (file.gcount() != static_cast<std::streamsize>(index_boot_id_size))
+        std::memset(boot_id, 0, index_boot_id_size);
+}
+
+block_index::~block_index()
+{
+    if (_fd < 0)
+        return;
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {
+        // the entries stay invalid on disk, which is safe
+        FWERROR("cannot write back the index");
+    }
+    ::close(_fd);
+}
+
+std::string block_index::default_path(const std::string& dev_path)
+{
+    std::string dname = dev_path.substr(dev_path.find_last_of("/") + 1);
+    return MTD_INDEX_DIR + dname + ".idx";
+}
+
+void block_index::open(const std::string& path, size_t dev_size,
+                       size_t block_size)
+{
+    std::error_code ec;
+    std::filesystem::path parent = std::filesystem::path(path).parent_path();
+    if (!parent.empty())
+        std::filesystem::create_directories(parent, ec);
+
+    _fd = ::open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (_fd < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(path));
+    _block_size = block_size;
+    _dev_size = dev_size;
+    _entries.assign(dev_size / block_size, entry{0, 0, 0});
+    _invalid_on_disk.assign(_entries.size(), 0);
+
+    block_index_header hdr{};
+    char boot_id[index_boot_id_size];
+    index_boot_id(boot_id);
+    size_t entries_len = _entries.size() * sizeof(entry);
+    struct stat sb;
+    if (fstat(_fd, &sb) == 0 &&
+        static_cast<size_t>(sb.st_size) == sizeof(hdr) + entries_len &&
+        ::pread(_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        !memcmp(hdr.magic, index_magic, sizeof(index_magic)) &&
+        hdr.version == index_version && hdr.block_size == block_size &&
+        hdr.dev_size == dev_size &&
+        !memcmp(hdr.boot_id, boot_id, sizeof(boot_id)) &&
+        ::pread(_fd, _entries.data(), entries_len, sizeof(hdr)) ==
+            static_cast<ssize_t>(entries_len))
+    {
+        FWDEBUG("loaded index " << path);
+        return;
+    }
+
+    // missing, from another boot or does not describe this device: start
+    // over, all invalid
+    FWINFO("initializing index " << path);
+    _entries.assign(dev_size / block_size, entry{0, 0, 0});
+    memcpy(hdr.magic, index_magic, sizeof(index_magic));
+    hdr.version = index_version;
+    hdr.block_size = block_size;
+    hdr.dev_size = dev_size;
+    memcpy(hdr.boot_id, boot_id, sizeof(boot_id));
+    if (ftruncate(_fd, 0) < 0 ||
+        ::pwrite(_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+        THROW(FileIOError() << boost::errinfo_errno(errno));
+    flush();
+}
+
+block_index::entry block_index::make_entry(const uint8_t* data) const
+{
+    entry e{fast_hash64(data, _block_size), entry_valid, 0};
+    if (is_blank(data, _block_size))
+        e.flags |= entry_erased;
+    return e;
+}
+
+void block_index::persist(size_t first, size_t count, bool sync)
+{
+    if (_fd < 0 || !count)
+        return;
+    std::vector<entry> disk(_entries.begin() + first,
+                            _entries.begin() + first + count);
+    for (size_t b = 0; b < count; b++)
+    {
+        if (_invalid_on_disk[first + b])
+            disk[b].flags = 0;
+    }
+    ssize_t len = count * sizeof(entry);
+    if (::pwrite(_fd, disk.data(), len,
+                 sizeof(block_index_header) + first * sizeof(entry)) != len)
+        THROW(FileIOError() << boost::errinfo_errno(errno));
+    if (sync && fdatasync(_fd) < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno));
+}
+
+std::vector<block_index::entry> block_index::begin(uint32_t addr, size_t len)
+{
+    size_t first = addr / _block_size;
+    size_t last = std::min((addr + len + _block_size - 1) / _block_size,
+                           _entries.size());
+    if (first >= last)
+        return {};
+    std::vector<entry> prior(_entries.begin() + first,
+                             _entries.begin() + last);
+    bool on_disk = true;
+    for (size_t b = first; b < last; b++)
+    {
+        on_disk &= _invalid_on_disk[b] != 0;
+        _entries[b].flags = 0;
+    }
+    // the invalidation must be on disk before the flash is touched; the
+    // blocks that follow are invalidated with it, as writes run forward
+    if (!on_disk)
+    {
+        size_t end = std::min(
+            std::max(last, first + index_sync_span / _block_size),
+            _entries.size());
+        std::fill(_invalid_on_disk.begin() + first,
+                  _invalid_on_disk.begin() + end, 1);
+        persist(first, end - first, true);
+    }
+    return prior;
+}
+
+void block_index::commit_erase(uint32_t addr, size_t len)
+{
+    std::vector<uint8_t> ffs(_block_size, 0xff);
+    entry erased = make_entry(ffs.data());
+    erased.flags |= entry_written;
+    size_t first = (addr + _block_size - 1) / _block_size;
+    size_t last = std::min((addr + len) / _block_size, _entries.size());
+    for (size_t b = first; b < last; b++)
+        _entries[b] = erased;
+}
+
+void block_index::commit_program(uint32_t addr, const cbspan& data,
+                                 const std::vector<entry>& prior)
+{
+    size_t first = addr / _block_size;
+    std::vector<uint8_t> block(_block_size);
+    for (size_t idx = 0; idx < prior.size(); idx++)
+    {
+        size_t b = first + idx;
+        // programming only clears bits, so the result is only known
+        // when the block was erased beforehand
+        if ((prior[idx].flags & (entry_valid | entry_erased)) !=
+            (entry_valid | entry_erased))
+            continue;
+        size_t block_addr = b * _block_size;
+        size_t from = std::max<size_t>(block_addr, addr);
+        size_t to = std::min(block_addr + _block_size, addr + data.size());
+        std::fill(block.begin(), block.end(), 0xff);
+        std::copy(data.begin() + (from - addr), data.begin() + (to - addr),
+                  block.begin() + (from - block_addr));
+        _entries[b] = make_entry(block.data());
+        _entries[b].flags |= entry_written;
+    }
+}
+
+void block_index::update(size_t block, const cbspan& contents)
+{
+    _entries.at(block) = make_entry(contents.data());
+    persist(block, 1, false);
+}
+
+bool block_index::all_flags(uint32_t addr, size_t len, uint32_t flags) const
+{
+    size_t first = addr / _block_size;
+    size_t last = (addr + len + _block_size - 1) / _block_size;
+    if (!len || last > _entries.size())
+        return false;
+    for (size_t b = first; b < last; b++)
+    {
+        if ((_entries[b].flags & flags) != flags)
+            return false;
+    }
+    return true;
+}
+
+bool block_index::is_erased(uint32_t addr, size_t len) const
+{
+    return all_flags(addr, len, entry_valid | entry_erased);
+}
+
+bool block_index::is_valid(uint32_t addr, size_t len) const
+{
+    return all_flags(addr, len, entry_valid);
+}
+
+bool block_index::is_written(uint32_t addr, size_t len) const
+{
+    return all_flags(addr, len, entry_valid | entry_written);
+}
+
+bool block_index::matches(uint32_t addr, const cbspan& contents) const
+{
+    if ((addr % _block_size) || (contents.size() % _block_size) ||
+        !is_valid(addr, contents.size()))
+        return false;
+    size_t first = addr / _block_size;
+    for (size_t off = 0; off < contents.size(); off += _block_size)
+    {
+        if (_entries[first + off / _block_size].hash !=
+            fast_hash64(contents.data() + off, _block_size))
+            return false;
+    }
+    return true;
+}
+
+void block_index::flush()
+{
+    std::fill(_invalid_on_disk.begin(), _invalid_on_disk.end(), 0);
+    persist(0, _entries.size(), true);
+}
@@ -0,0 +1,134 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: per erase block content index of an MTD device
+*/
+
+#ifndef __BLOCK_INDEX_H__
+#define __BLOCK_INDEX_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.h" // cbspan type
+
+/* in /run, so an index never outlives a boot, during which the flash may
+ * be rewritten by something other than mtd-util */
+#ifdef MTD_EMULATION
+#define MTD_INDEX_DIR "run/mtd-util/"
+#else /* !MTD_EMULATION */
+#define MTD_INDEX_DIR "/run/mtd-util/"
+#endif /* MTD_EMULATION */
+
+/*
+ * The index keeps a fast hash and an erased flag for every block of a
+ * device in a sidecar file, so write engines can tell "already identical"
+ * and "already erased" without reading the flash back.
+ *
+ * Updates are two-phase: the entries of a range are invalidated on disk
+ * (and synced) before the device is modified, and only marked valid again
+ * once the modification has completed. An interrupted operation therefore
+ * leaves invalid entries, never stale valid ones. To save syncs, the
+ * entries of up to 1MB of flash are invalidated on disk at once, and
+ * completed entries are only written back with the next invalidation or
+ * flush, so a long write syncs once per 1MB instead of twice per block.
+ *
+ * Entries that mtd-util set by erasing or programming the block itself are
+ * marked written. The header holds the boot id the index was made in, and
+ * an index from another boot is reset, so a written entry always describes
+ * what mtd-util put on the flash during this boot. Only those entries are
+ * trusted without reading the flash back; entries taken from a read are
+ * hints, as anything else may have written the flash since.
+ */
+class block_index
+{
+  public:
+    static constexpr uint32_t entry_valid = 0x1;
+    static constexpr uint32_t entry_erased = 0x2;
+    static constexpr uint32_t entry_written = 0x4;
+
+    struct entry
+    {
+        uint64_t hash;
+        uint32_t flags;
+        uint32_t rsvd;
+    } __attribute__((packed));
+
+    block_index(const block_index&) = delete;
+    block_index& operator=(const block_index&) = delete;
+
+    block_index() : _fd(-1), _block_size(0), _dev_size(0)
+    {
+    }
+    /* writes back the entries held back by batched invalidation */
+    ~block_index();
+
+    /* default index file for an mtd device path */
+    static std::string default_path(const std::string& dev_path);
+
+    /* open or create the index; entries of a mismatched index are reset */
+    void open(const std::string& path, size_t dev_size, size_t block_size);
+
+    size_t block_size() const
+    {
+        return _block_size;
+    }
+    size_t blocks() const
+    {
+        return _entries.size();
+    }
+    const entry& at(size_t block) const
+    {
+        return _entries.at(block);
+    }
+
+    /* invalidate the blocks covering [addr, addr + len) before a change;
+     * returns the previous entries of those blocks */
+    std::vector<entry> begin(uint32_t addr, size_t len);
+    /* [addr, addr + len) was erased */
+    void commit_erase(uint32_t addr, size_t len);
+    /* data was programmed at addr; prior is what begin returned */
+    void commit_program(uint32_t addr, const cbspan& data,
+                        const std::vector<entry>& prior);
+    /* set a block from its full contents (scan or read-back verify) */
+    void update(size_t block, const cbspan& contents);
+
+    /* true if every block covering [addr, addr + len) is known erased */
+    bool is_erased(uint32_t addr, size_t len) const;
+    /* true if the block-aligned range at addr is known to hold contents */
+    bool matches(uint32_t addr, const cbspan& contents) const;
+    /* true if every block covering [addr, addr + len) has a valid entry */
+    bool is_valid(uint32_t addr, size_t len) const;
+    /* true if every block covering [addr, addr + len) has a valid entry
+     * that mtd-util wrote this boot */
+    bool is_written(uint32_t addr, size_t len) const;
+
+    /* write all entries to disk */
+    void flush();
+
+  private:
+    entry make_entry(const uint8_t* data) const;
+    bool all_flags(uint32_t addr, size_t len, uint32_t flags) const;
+    void persist(size_t first, size_t count, bool sync);
+
+    int _fd;
+    size_t _block_size;
+    size_t _dev_size;
+    std::vector<entry> _entries;
+    /* blocks whose entry is invalid on disk, whatever it is in memory */
+    std::vector<uint8_t> _invalid_on_disk;
+};
+
+#endif /* __BLOCK_INDEX_H__ */
@@ -17,59 +17,228 @@
 
 #include "debug.h"
 
-#include <cctype>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
-#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
 
-static dbg_level __dbg_level = PRINT_ERROR;
-dbg_level fw_update_get_dbg_level(void)
-{
-    return __dbg_level;
-}
+#include "hexdump.h"
 
-void fw_update_set_dbg_level(dbg_level l)
+/* messages are collected and written out in blocks of up to this size */
+static constexpr size_t log_buffer_size = 16 * 1024;
+/* and are not held back much longer than this */
+static constexpr std::chrono::milliseconds log_flush_interval{200};
+
+/* write len bytes of data to stderr; only async-signal-safe calls */
+static void write_stderr(const char* data, size_t len)
 {
-    __dbg_level = l;
+    while (len)
+    {
+        // straight to the fd, which also works during static destruction
+        ssize_t ret = ::write(STDERR_FILENO, data, len);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret <= 0)
+        {
+            break;
+        }
+        data += ret;
+        len -= ret;
+    }
 }
 
-void _dump(dbg_level lvl, const char* fn, int lineno, const char* bname,
-           const std::span<const uint8_t>& buf)
+/*
+ * Collects formatted messages from all threads, so verbose output costs one
+ * write per block instead of a flush per line. Only debug messages are held
+ * back; anything more severe writes out the buffer right away. Held back
+ * messages are written out by a flusher thread, started with the first of
+ * them, and on exit, std::terminate and crash signals.
+ *
+ * The buffer is a fixed array whose length is only published once a message
+ * is in it, so a signal handler can write it out without taking the lock.
+ */
+class log_sink
 {
-    unsigned int i = 0, l;
-    std::stringstream hex, ascii;
-    auto cb = buf.begin();
+  public:
+    void add(std::string_view msg, bool urgent)
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        size_t len = _len.load(std::memory_order_relaxed);
+        if (len + msg.size() + 1 > sizeof(_buf))
+        {
+            write_out();
+            len = 0;
+        }
+        if (msg.size() + 1 > sizeof(_buf))
+        {
+            // too long to hold back at all
+            write_stderr(msg.data(), msg.size());
+            write_stderr("\n", 1);
+            return;
+        }
+        std::memcpy(_buf + len, msg.data(), msg.size());
+        _buf[len + msg.size()] = '\n';
+        _len.store(len + msg.size() + 1, std::memory_order_release);
+        if (urgent)
+        {
+            write_out();
+        }
+        else if (!_flusher_started)
+        {
+            // never joined; the sink outlives it
+            std::thread([this] { flush_periodically(); }).detach();
+            _flusher_started = true;
+        }
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        write_out();
+    }
 
-    /*  0         1         2         3         4         5         6
-     *  0123456789012345678901234567890123456789012345678901234567890123456789
-     *  0000000: 0000 0000 0000 0000 0000 0000 0000 0000  ................
+    /* for signal handlers: takes no lock and makes only async-signal-safe
+     * calls; a message another thread is adding at the time may be lost
      */
+    void crash_flush()
+    {
+        write_stderr(_buf, _len.exchange(0, std::memory_order_acquire));
+    }
 
-    std::cerr << '<' << lvl << '>' << fn << ":" << lineno << ": dumping "
-              << buf.size() << " bytes from " << (void*)buf.data() << " ("
-              << bname << ")" << std::endl;
-    hex << std::hex << std::setfill('0');
-    while (cb != buf.end())
+  private:
+    void flush_periodically()
+    {
+        for (;;)
+        {
+            std::this_thread::sleep_for(log_flush_interval);
+            flush();
+        }
+    }
+
+    void write_out()
+    {
+        write_stderr(_buf, _len.load(std::memory_order_relaxed));
+        _len.store(0, std::memory_order_relaxed);
+    }
+
+    std::mutex _lock;
+    char _buf[log_buffer_size];
+    std::atomic<size_t> _len{0};
+    static_assert(std::atomic<size_t>::is_always_lock_free);
+    bool _flusher_started = false;
+};
+
+static std::terminate_handler prev_terminate;
+
+static void flush_on_signal(int sig)
+{
+    fw_update_log_flush_on_crash();
+    // the handler was reset, so this takes the default action
+    raise(sig);
+}
+
+static void flush_on_terminate(void)
+{
+    fw_update_log_flush();
+    if (prev_terminate)
     {
-        hex.str("");
-        ascii.str("");
-        hex << std::setw(7) << i << ": ";
-        for (l = 0; l < 16 && (cb != buf.end()); l++)
+        prev_terminate();
+    }
+    std::abort();
+}
+
+/* flush from crash signals that are not handled otherwise; SIGINT, SIGTERM
+ * and the like are left alone, as they are the program's to handle
+ */
+static void catch_crash_signals(void)
+{
+    for (int sig : {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV})
+    {
+        struct sigaction old_sa;
+        if (sigaction(sig, nullptr, &old_sa) < 0 ||
+            old_sa.sa_handler != SIG_DFL)
         {
-            hex << std::setw(2) << (unsigned int)*cb;
-            if (l & 1)
-                hex << ' ';
-            if (isprint(*cb))
-                ascii << (char)(*cb);
-            else
-                ascii << '.';
-            cb++;
-            i++;
+            continue;
         }
-        std::cerr << '<' << lvl << '>' << std::left << std::setw(50)
-                  << hex.str() << ascii.str() << std::endl;
+        struct sigaction sa = {};
+        sa.sa_handler = flush_on_signal;
+        sa.sa_flags = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+        sigaction(sig, &sa, nullptr);
     }
-    std::cerr << std::setw(0);
+}
+
+/* never destroyed, so messages logged during static destruction still work */
+static log_sink& sink(void)
+{
+    static log_sink* s = [] {
+        auto s = new log_sink;
+        std::atexit(fw_update_log_flush);
+        prev_terminate = std::set_terminate(flush_on_terminate);
+        catch_crash_signals();
+        return s;
+    }();
+    return *s;
+}
+
+static std::ostringstream& log_stream(void)
+{
+    // reused, so a message does not construct a stringstream
+    static thread_local std::ostringstream ss;
+    return ss;
+}
+
+std::ostream& fw_update_log_stream(void)
+{
+    std::ostringstream& ss = log_stream();
+    ss.str("");
+    ss.clear();
+    ss.flags(std::ios_base::dec | std::ios_base::skipws);
+    ss.fill(' ');
+    return ss;
+}
+
+void fw_update_log_commit(dbg_level lvl)
+{
+    sink().add(log_stream().view(), lvl <= PRINT_INFO);
+}
+
+void fw_update_log_flush(void)
+{
+    sink().flush();
+}
+
+void fw_update_log_flush_on_crash(void)
+{
+    sink().crash_flush();
+}
+
+void _dump(dbg_level lvl, const char* fn, int lineno, const char* bname,
+           const std::span<const uint8_t>& buf)
+{
+    // keep the dump after the messages that lead up to it
+    fw_update_log_flush();
+    std::cerr << '<' << lvl << '>' << fn << ":" << lineno << ": dumping "
+              << buf.size() << " bytes from " << (void*)buf.data() << " ("
+              << bname << ")" << std::endl;
+    hex_dumper dumper(std::cerr, 0, dump_format::classic, false,
+                      "<" + std::to_string(lvl) + ">");
+    dumper.dump(buf.data(), buf.size());
+    dumper.finish();
 }
 
 void _dump(dbg_level lvl, const char* fn, int lineno, const char* bname,
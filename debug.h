@@ -19,6 +19,7 @@
 #ifndef __FW_UPDATE_DEBUG_H__
 #define __FW_UPDATE_DEBUG_H__
 
+#include <atomic>
 #include <cstdint>
 #include <iostream>
 #include <span>
@@ -48,18 +49,50 @@ typedef enum
 
 #ifdef FW_UPDATE_DEBUG
 
-extern dbg_level fw_update_get_dbg_level(void);
-extern void fw_update_set_dbg_level(dbg_level l);
+/*
+ * Messages less severe than the floor are compiled out, so they cost
+ * nothing even in hot loops; -v cannot enable them. Set by the
+ * LOG_LEVEL_FLOOR CMake option.
+ */
+#ifndef FW_UPDATE_LOG_FLOOR
+#define FW_UPDATE_LOG_FLOOR PRINT_ALL
+#endif
+constexpr dbg_level fw_update_log_floor = FW_UPDATE_LOG_FLOOR;
+
+inline std::atomic<dbg_level> __dbg_level{PRINT_ERROR};
+
+inline dbg_level fw_update_get_dbg_level(void)
+{
+    return __dbg_level.load(std::memory_order_relaxed);
+}
+
+inline void fw_update_set_dbg_level(dbg_level l)
+{
+    __dbg_level.store(l, std::memory_order_relaxed);
+}
+
+/* per thread stream a message is formatted into; empty, default format */
+std::ostream& fw_update_log_stream(void);
+/* pass the message in fw_update_log_stream() on to the buffered sink */
+void fw_update_log_commit(dbg_level lvl);
+/* write out buffered messages */
+void fw_update_log_flush(void);
+/* the same without locking, for crash signal handlers; a message being
+ * added at the time may be lost */
+void fw_update_log_flush_on_crash(void);
 
 #define PRINT(LEVEL, MSG)                                                      \
     do                                                                         \
     {                                                                          \
-        if ((LEVEL) <= fw_update_get_dbg_level())                              \
+        if constexpr ((LEVEL) <= fw_update_log_floor)                          \
         {                                                                      \
-            std::stringstream ss;                                              \
-            ss << '<' << LEVEL << '>' << __FUNCTION__ << ":" << __LINE__       \
-               << ": " << MSG;                                                 \
-            std::cerr << ss.str() << std::endl;                                \
+            if ((LEVEL) <= fw_update_get_dbg_level())                          \
+            {                                                                  \
+                std::ostream& __log = fw_update_log_stream();                  \
+                __log << '<' << LEVEL << '>' << __FUNCTION__ << ":"            \
+                      << __LINE__ << ": " << MSG;                              \
+                fw_update_log_commit(LEVEL);                                   \
+            }                                                                  \
         }                                                                      \
     } while (0)
 
@@ -72,9 +105,13 @@ void _dump(dbg_level lvl, const char* fn, int lineno, const char* bname,
 #define DUMP(LEVEL, BUF, ...)                                                  \
     do                                                                         \
     {                                                                          \
-        if ((LEVEL) <= fw_update_get_dbg_level())                              \
+        if constexpr ((LEVEL) <= fw_update_log_floor)                          \
         {                                                                      \
-            _dump(LEVEL, __FUNCTION__, __LINE__, #BUF, BUF, ##__VA_ARGS__);    \
+            if ((LEVEL) <= fw_update_get_dbg_level())                          \
+            {                                                                  \
+                _dump(LEVEL, __FUNCTION__, __LINE__, #BUF, BUF,                \
+                      ##__VA_ARGS__);                                          \
+            }                                                                  \
         }                                                                      \
     } while (0)
 
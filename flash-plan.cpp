@@ -0,0 +1,148 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: erase and program plan collected by a dry run
+*/
+
+#include "flash-plan.h"
+
+#include <algorithm>
+#include <iomanip>
+
+static constexpr size_t plan_block_size = 4 * 1024;
+
+void flash_plan::erase(uint32_t addr, size_t len)
+{
+    _erases.push_back({addr, static_cast<uint32_t>(len)});
+}
+
+void flash_plan::program(uint32_t addr, const cbspan& data)
+{
+    _programs.push_back({addr, static_cast<uint32_t>(data.size())});
+    for (size_t off = 0; off < data.size(); off += plan_block_size)
+    {
+        size_t len = std::min(plan_block_size, data.size() - off);
+        if (is_blank(data.data() + off, len))
+        {
+            _blank_bytes += len;
+        }
+    }
+}
+
+void flash_plan::skip_unsigned(uint32_t addr, size_t len)
+{
+    _skipped.push_back({addr, static_cast<uint32_t>(len)});
+}
+
+std::vector<flash_plan::range> flash_plan::merge(std::vector<range> ranges)
+{
+    std::sort(ranges.begin(), ranges.end(),
+              [](const range& a, const range& b) { return a.addr < b.addr; });
+    std::vector<range> merged;
+    for (const range& r : ranges)
+    {
+        if (!merged.empty() &&
+            r.addr <= uint64_t(merged.back().addr) + merged.back().len)
+        {
+            uint64_t end = std::max(uint64_t(merged.back().addr) +
+                                        merged.back().len,
+                                    uint64_t(r.addr) + r.len);
+            merged.back().len = end - merged.back().addr;
+        }
+        else
+        {
+            merged.push_back(r);
+        }
+    }
+    return merged;
+}
+
+double flash_plan::erase_us(const flash_timing& timing) const
+{
+    double us = 0;
+    for (const range& r : _erases)
+    {
+        us += timing.erase_us(r.addr, r.len);
+    }
+    return us;
+}
+
+void flash_plan::erase_split(size_t& blocks, size_t& sectors) const
+{
+    blocks = sectors = 0;
+    for (const range& r : _erases)
+    {
+        size_t b, s;
+        flash_timing::erase_split(r.addr, r.len, b, s);
+        blocks += b;
+        sectors += s;
+    }
+}
+
+double flash_plan::program_us(const flash_timing& timing) const
+{
+    double us = 0;
+    for (const range& r : _programs)
+    {
+        us += timing.program_us(r.addr, r.len);
+    }
+    return us;
+}
+
+double flash_plan::estimate_us(const flash_timing& timing) const
+{
+    return erase_us(timing) + program_us(timing);
+}
+
+static uint64_t total_len(const std::vector<flash_plan::range>& ranges)
+{
+    uint64_t len = 0;
+    for (const flash_plan::range& r : ranges)
+    {
+        len += r.len;
+    }
+    return len;
+}
+
+void flash_plan::report(std::ostream& out, const flash_timing& timing) const
+{
+    auto runs = [&out](const char* name, const std::vector<range>& ranges) {
+        for (const range& r : merge(ranges))
+        {
+            out << std::left << std::setw(8) << name << std::right << std::hex
+                << std::setfill('0') << std::setw(8) << r.addr << '-'
+                << std::setw(8) << uint64_t(r.addr) + r.len - 1
+                << std::setfill(' ') << std::dec << "  (" << r.len / 1024
+                << "K)\n";
+        }
+    };
+    runs("erase", _erases);
+    runs("program", _programs);
+    runs("skip", _skipped);
+
+    size_t blocks, sectors;
+    erase_split(blocks, sectors);
+    out << std::dec << "erase operations: " << _erases.size() << " ("
+        << total_len(_erases) / 1024 << "K), as " << blocks
+        << " 64K block and " << sectors << " 4K sector erases\n"
+        << "bytes programmed: " << total_len(_programs) << " in "
+        << _programs.size() << " operations (" << _blank_bytes
+        << " in blank 4K blocks)\n"
+        << "unsigned blocks skipped: " << total_len(_skipped) / plan_block_size
+        << " (4K)\n"
+        << std::fixed << std::setprecision(1)
+        << "estimated time: " << estimate_us(timing) / 1e6 << " s (erase "
+        << erase_us(timing) / 1e6 << " s, program "
+        << program_us(timing) / 1e6 << " s)\n";
+}
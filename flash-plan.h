@@ -0,0 +1,86 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: erase and program plan collected by a dry run
+*/
+
+#ifndef __FLASH_PLAN_H__
+#define __FLASH_PLAN_H__
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+#include "flash-timing.h"
+#include "util.h"
+
+/*
+ * The erases and programs an update would issue, in order, plus the
+ * ranges it deliberately left alone, for estimating an update before
+ * running it.
+ */
+class flash_plan
+{
+  public:
+    struct range
+    {
+        uint32_t addr;
+        uint32_t len;
+    };
+
+    void erase(uint32_t addr, size_t len);
+    void program(uint32_t addr, const cbspan& data);
+    /* an erase left out because the blocks are in an unsigned region */
+    void skip_unsigned(uint32_t addr, size_t len);
+
+    const std::vector<range>& erases() const
+    {
+        return _erases;
+    }
+    const std::vector<range>& programs() const
+    {
+        return _programs;
+    }
+    const std::vector<range>& skipped() const
+    {
+        return _skipped;
+    }
+    /* programmed bytes in 4K blocks that were all 0xff */
+    size_t blank_bytes() const
+    {
+        return _blank_bytes;
+    }
+
+    /* sorted, with overlapping and adjacent ranges joined */
+    static std::vector<range> merge(std::vector<range> ranges);
+
+    /* time for every erase, or every program, one after the other */
+    double erase_us(const flash_timing& timing) const;
+    double program_us(const flash_timing& timing) const;
+    /* the 64K block and 4K sector erases of every erase, as timed */
+    void erase_split(size_t& blocks, size_t& sectors) const;
+    /* the two together */
+    double estimate_us(const flash_timing& timing) const;
+
+    /* merged erase and program runs, then totals and the estimate */
+    void report(std::ostream& out, const flash_timing& timing) const;
+
+  private:
+    std::vector<range> _erases;
+    std::vector<range> _programs;
+    std::vector<range> _skipped;
+    size_t _blank_bytes = 0;
+};
+
+#endif /* __FLASH_PLAN_H__ */
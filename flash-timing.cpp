@@ -0,0 +1,114 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: SPI NOR timing model
+*/
+
+#include "flash-timing.h"
+
+#include <boost/exception/errinfo_file_name.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "exceptions.h"
+
+flash_timing flash_timing::load(const std::string& path)
+{
+    flash_timing timing;
+    std::ifstream profile(path);
+    if (!profile)
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("cannot open timing profile"));
+
+    std::string line;
+    while (std::getline(profile, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        std::string key, text, extra;
+        if (!(iss >> key))
+            continue;
+        char* end = nullptr;
+        double value = 0;
+        if (iss >> text && !(iss >> extra))
+            value = strtod(text.c_str(), &end);
+        // pages are counted with page_size, so it has to be whole
+        if (!end || *end || !(value > 0) ||
+            (key == "page_size" &&
+             text.find_first_not_of("0123456789") != std::string::npos))
+            THROW(FileIOError() << boost::errinfo_file_name(path)
+                                << msg_info("bad value for " + key));
+        if (key == "erase_4k_us")
+            timing.erase_4k_us = value;
+        else if (key == "erase_64k_us")
+            timing.erase_64k_us = value;
+        else if (key == "program_page_us")
+            timing.program_page_us = value;
+        else if (key == "page_size")
+            timing.page_size = std::stoul(text);
+        else if (key == "read_mb_s")
+            timing.read_mb_s = value;
+        else if (key == "op_overhead_us")
+            timing.op_overhead_us = value;
+        else
+            THROW(FileIOError() << boost::errinfo_file_name(path)
+                                << msg_info("unknown timing " + key));
+    }
+    return timing;
+}
+
+void flash_timing::erase_split(uint32_t addr, size_t len, size_t& blocks,
+                               size_t& sectors)
+{
+    constexpr size_t sector = 4 * 1024;
+    constexpr size_t block = 64 * 1024;
+    blocks = sectors = 0;
+    uint64_t pos = addr & ~(sector - 1);
+    uint64_t end = uint64_t(addr) + len;
+    while (pos < end)
+    {
+        if (pos % block == 0 && end - pos >= block)
+        {
+            blocks++;
+            pos += block;
+        }
+        else
+        {
+            sectors++;
+            pos += sector;
+        }
+    }
+}
+
+double flash_timing::erase_us(uint32_t addr, size_t len) const
+{
+    size_t blocks, sectors;
+    erase_split(addr, len, blocks, sectors);
+    return op_overhead_us + blocks * erase_64k_us + sectors * erase_4k_us;
+}
+
+double flash_timing::program_us(uint32_t addr, size_t len) const
+{
+    if (!len)
+        return op_overhead_us;
+    uint64_t first = addr / page_size;
+    uint64_t last = (uint64_t(addr) + len - 1) / page_size;
+    return op_overhead_us + (last - first + 1) * program_page_us;
+}
+
+double flash_timing::read_us(size_t len) const
+{
+    return op_overhead_us + len / read_mb_s;
+}
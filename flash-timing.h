@@ -0,0 +1,60 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: SPI NOR timing model
+*/
+
+#ifndef __FLASH_TIMING_H__
+#define __FLASH_TIMING_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * How long a SPI NOR part takes for each kind of operation. The defaults
+ * are typical datasheet figures for a 3V serial NOR behind a BMC SPI
+ * controller; a profile file overrides any of them with lines of
+ *
+ *   <key> <value>
+ *
+ * where key is one of the member names below; '#' starts a comment.
+ */
+struct flash_timing
+{
+    double erase_4k_us = 45000;
+    double erase_64k_us = 250000;
+    double program_page_us = 700;
+    size_t page_size = 256;
+    double read_mb_s = 25;
+    /* driver and syscall cost of every operation */
+    double op_overhead_us = 10;
+
+    /* throws FileIOError if the profile cannot be read or parsed, or a
+     * value is not positive; page_size has to be a whole number */
+    static flash_timing load(const std::string& path);
+
+    /* count the 64K block erases (where aligned) and 4K sector erases
+     * (elsewhere) that erasing [addr, addr + len) takes, as a SPI NOR
+     * driver would erase it */
+    static void erase_split(uint32_t addr, size_t len, size_t& blocks,
+                            size_t& sectors);
+    /* the erases of erase_split */
+    double erase_us(uint32_t addr, size_t len) const;
+    /* every page touched is programmed, blank or not */
+    double program_us(uint32_t addr, size_t len) const;
+    double read_us(size_t len) const;
+};
+
+#endif /* __FLASH_TIMING_H__ */
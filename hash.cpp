@@ -0,0 +1,216 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: message digest backends
+*/
+
+#include "hash.hpp"
+
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "exceptions.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+static std::atomic<digest_backend> selected_backend{digest_backend::openssl};
+
+void set_digest_backend(digest_backend backend)
+{
+    selected_backend = backend;
+}
+
+digest_backend get_digest_backend(void)
+{
+    return selected_backend;
+}
+
+/* kernel crypto API name of an OpenSSL digest, or nullptr */
+static const char* kernel_digest_name(const EVP_MD* dgst)
+{
+    switch (EVP_MD_type(dgst))
+    {
+        case NID_sha256:
+            return "sha256";
+        case NID_sha384:
+            return "sha384";
+        case NID_sha512:
+            return "sha512";
+        default:
+            return nullptr;
+    }
+}
+
+class kernel_digest
+{
+  public:
+    kernel_digest(const kernel_digest&) = delete;
+    kernel_digest& operator=(const kernel_digest&) = delete;
+
+    kernel_digest(size_t digest_size) :
+        _tfm(-1), _op(-1), _digest_size(digest_size)
+    {
+    }
+    ~kernel_digest()
+    {
+        for (int fd : {_op, _tfm})
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+    }
+
+    /* bind a hash transform; false if the kernel does not offer it */
+    bool open(const char* name)
+    {
+        struct sockaddr_alg sa = {};
+        sa.salg_family = AF_ALG;
+        strncpy(reinterpret_cast<char*>(sa.salg_type), "hash",
+                sizeof(sa.salg_type) - 1);
+        strncpy(reinterpret_cast<char*>(sa.salg_name), name,
+                sizeof(sa.salg_name) - 1);
+
+        _tfm = ::socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (_tfm < 0)
+        {
+            // no point in asking again for every digest
+            FWINFO("AF_ALG is not available (" << strerror(errno)
+                                               << "), using OpenSSL");
+            selected_backend = digest_backend::openssl;
+            return false;
+        }
+        if (::bind(_tfm, reinterpret_cast<struct sockaddr*>(&sa),
+                   sizeof(sa)) < 0)
+        {
+            FWDEBUG("kernel has no " << name << ": " << strerror(errno));
+            return false;
+        }
+        _op = ::accept4(_tfm, nullptr, nullptr, SOCK_CLOEXEC);
+        if (_op < 0)
+        {
+            FWDEBUG("AF_ALG accept failed: " << strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    void update(const uint8_t* data, size_t len)
+    {
+        while (len)
+        {
+            ssize_t sent = ::send(_op, data, len, MSG_MORE);
+            if (sent < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                THROW(FileIOError() << boost::errinfo_errno(errno));
+            }
+            data += sent;
+            len -= sent;
+        }
+    }
+
+    void final(std::vector<uint8_t>& hash)
+    {
+        // a zero length send without MSG_MORE finalizes the operation
+        if (::send(_op, nullptr, 0, 0) < 0)
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        }
+        hash.resize(_digest_size);
+        ssize_t got = ::read(_op, hash.data(), hash.size());
+        if (got != static_cast<ssize_t>(hash.size()))
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        }
+    }
+
+  private:
+    int _tfm;
+    int _op;
+    size_t _digest_size;
+};
+
+Hash::Hash(const EVP_MD* dgst, const cbspan& expected) :
+    ctx{}, hash(EVP_MAX_MD_SIZE), expected(expected)
+{
+    if (selected_backend == digest_backend::kernel)
+    {
+        const char* name = kernel_digest_name(dgst);
+        if (name)
+        {
+            kernel = std::make_unique<kernel_digest>(EVP_MD_size(dgst));
+            if (kernel->open(name))
+            {
+                return;
+            }
+            kernel.reset();
+        }
+    }
+    ctx = EVP_MD_CTX_new();
+    if (!ctx)
+    {
+        throw std::bad_alloc();
+    }
+    EVP_MD_CTX_init(ctx);
+    EVP_DigestInit_ex(ctx, dgst, nullptr);
+}
+
+Hash::~Hash()
+{
+    EVP_MD_CTX_free(ctx);
+}
+
+void Hash::update(const uint8_t* data, size_t len)
+{
+    if (finalized)
+    {
+        throw std::logic_error("update after finalize");
+    }
+    if (kernel)
+    {
+        kernel->update(data, len);
+        return;
+    }
+    EVP_DigestUpdate(ctx, data, len);
+}
+
+const std::vector<uint8_t>& Hash::digest() const
+{
+    if (finalized)
+    {
+        return hash;
+    }
+    finalized = true;
+    if (kernel)
+    {
+        kernel->final(hash);
+        return hash;
+    }
+    unsigned int len = hash.size();
+    EVP_DigestFinal_ex(ctx, hash.data(), &len);
+    hash.resize(len);
+    return hash;
+}
@@ -0,0 +1,108 @@
+/*
+// Copyright (c) 2020-2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: message digest helpers
+*/
+
+#pragma once
+
+#include <openssl/evp.h>
+
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include "debug.h"
+#include "util.h"
+
+/**
+ * @brief Where message digests are computed
+ *
+ * OpenSSL is the default. The kernel backend hands the data to the Linux
+ * crypto API through an AF_ALG hash socket, which lets a hardware hash
+ * engine do the work; any digest the kernel does not offer falls back to
+ * OpenSSL.
+ */
+enum class digest_backend
+{
+    openssl,
+    kernel,
+};
+
+/**
+ * @brief Select the backend used by Hash objects created from now on
+ *
+ * @param backend digest backend to use
+ */
+void set_digest_backend(digest_backend backend);
+
+/**
+ * @brief The currently selected digest backend
+ */
+digest_backend get_digest_backend(void);
+
+/**
+ * @brief One AF_ALG hash operation (defined in hash.cpp)
+ */
+class kernel_digest;
+
+/**
+ * @brief Class to handle non-consecutive hashing
+ */
+class Hash
+{
+  public:
+    Hash(const Hash&) = delete;
+    Hash& operator=(const Hash&) = delete;
+
+    Hash(const EVP_MD* dgst, const cbspan& expected);
+    ~Hash();
+
+    void update(const uint8_t* data, size_t len);
+    const std::vector<uint8_t>& digest() const;
+    /**
+     * @brief The backend this object hashes with, which is OpenSSL if the
+     * kernel was selected but does not offer the digest
+     */
+    digest_backend backend() const
+    {
+        return kernel ? digest_backend::kernel : digest_backend::openssl;
+    }
+    bool verify() const
+    {
+        digest();
+        bool match = std::equal(hash.begin(), hash.end(), expected.begin(),
+                                expected.end());
+        if (!match)
+        {
+            auto expected_ = &expected[0];
+            auto computed = &hash[0];
+            DUMP(PRINT_ERROR, expected_, expected.size());
+            DUMP(PRINT_ERROR, computed, hash.size());
+        }
+        return match;
+    }
+
+  private:
+    mutable bool finalized = false;
+    EVP_MD_CTX* ctx;
+    std::unique_ptr<kernel_digest> kernel;
+    mutable std::vector<uint8_t> hash;
+    const cbspan expected;
+};
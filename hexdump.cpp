@@ -0,0 +1,209 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: buffered hex dump formatter
+*/
+
+#include "hexdump.h"
+
+#include <algorithm>
+
+static constexpr size_t bytes_per_line = 16;
+/* output is collected in a buffer of this size before it is written */
+static constexpr size_t dump_buffer_size = 256 * 1024;
+/* longest line without the prefix: 16 address digits, ": ", the hex
+ * column, padding, the ascii column and a newline */
+static constexpr size_t max_line_size = 16 + 2 + 41 + 16 + 1;
+
+static constexpr char hex_digits[] = "0123456789abcdef";
+
+struct dump_tables
+{
+    char hex[256][2];
+    char ascii[256];
+
+    constexpr dump_tables() : hex{}, ascii{}
+    {
+        for (int c = 0; c < 256; c++)
+        {
+            hex[c][0] = hex_digits[c >> 4];
+            hex[c][1] = hex_digits[c & 0xf];
+            // isprint() in the C locale
+            ascii[c] = (c >= 0x20 && c < 0x7f) ? c : '.';
+        }
+    }
+};
+
+static constexpr dump_tables tables;
+
+hex_dumper::hex_dumper(std::ostream& out, size_t addr, dump_format format,
+                       bool squeeze, const std::string& prefix) :
+    _out(out), _addr(addr), _format(format), _squeeze(squeeze),
+    _prefix(prefix), _buf(dump_buffer_size), _used(0), _have_last(false),
+    _skipping(false), _finished(false)
+{
+    _pending.reserve(bytes_per_line);
+    _last.reserve(bytes_per_line);
+}
+
+hex_dumper::~hex_dumper()
+{
+    finish();
+}
+
+void hex_dumper::flush()
+{
+    if (_used)
+    {
+        _out.write(_buf.data(), _used);
+        _used = 0;
+    }
+    _out.flush();
+}
+
+void hex_dumper::emit(const char* data, size_t len)
+{
+    while (len)
+    {
+        if (_used == _buf.size())
+        {
+            _out.write(_buf.data(), _used);
+            _used = 0;
+        }
+        size_t n = std::min(len, _buf.size() - _used);
+        std::copy_n(data, n, _buf.data() + _used);
+        _used += n;
+        data += n;
+        len -= n;
+    }
+}
+
+void hex_dumper::line(const uint8_t* data, size_t len)
+{
+    if (_squeeze && len == bytes_per_line && _have_last &&
+        std::equal(data, data + len, _last.begin()))
+    {
+        if (!_skipping)
+        {
+            emit(_prefix.data(), _prefix.size());
+            emit("*\n", 2);
+            _skipping = true;
+        }
+        _addr += len;
+        return;
+    }
+    _skipping = false;
+    _last.assign(data, data + len);
+    _have_last = true;
+
+    char text[max_line_size];
+    char* p = text;
+    size_t width = _format == dump_format::xxd ? 8 : 7;
+    char digits[16];
+    size_t count = 0;
+    size_t addr = _addr;
+    do
+    {
+        digits[count++] = hex_digits[addr & 0xf];
+        addr >>= 4;
+    } while (addr);
+    for (size_t i = count; i < width; i++)
+    {
+        *p++ = '0';
+    }
+    while (count)
+    {
+        *p++ = digits[--count];
+    }
+    *p++ = ':';
+    *p++ = ' ';
+    const char* hex_start = p;
+    for (size_t i = 0; i < len; i++)
+    {
+        *p++ = tables.hex[data[i]][0];
+        *p++ = tables.hex[data[i]][1];
+        if (i & 1)
+        {
+            *p++ = ' ';
+        }
+    }
+    // the ascii column starts at column 50 (classic) or after the widest
+    // hex column (xxd)
+    const char* ascii_start = _format == dump_format::xxd
+                                  ? hex_start + 41
+                                  : std::max<const char*>(text + 50, hex_start + 40);
+    while (p < ascii_start)
+    {
+        *p++ = ' ';
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        *p++ = tables.ascii[data[i]];
+    }
+    *p++ = '\n';
+    emit(_prefix.data(), _prefix.size());
+    emit(text, p - text);
+    _addr += len;
+}
+
+void hex_dumper::dump(const uint8_t* data, size_t len)
+{
+    if (_format == dump_format::raw)
+    {
+        emit(reinterpret_cast<const char*>(data), len);
+        _addr += len;
+        return;
+    }
+    if (!_pending.empty())
+    {
+        size_t n = std::min(len, bytes_per_line - _pending.size());
+        _pending.insert(_pending.end(), data, data + n);
+        data += n;
+        len -= n;
+        if (_pending.size() < bytes_per_line)
+        {
+            return;
+        }
+        line(_pending.data(), _pending.size());
+        _pending.clear();
+    }
+    for (; len >= bytes_per_line; data += bytes_per_line, len -= bytes_per_line)
+    {
+        line(data, bytes_per_line);
+    }
+    _pending.assign(data, data + len);
+}
+
+void hex_dumper::finish()
+{
+    if (_finished)
+    {
+        return;
+    }
+    _finished = true;
+    if (!_pending.empty())
+    {
+        line(_pending.data(), _pending.size());
+        _pending.clear();
+    }
+    else if (_skipping)
+    {
+        // show where the run of identical lines ends
+        _addr -= bytes_per_line;
+        _squeeze = false;
+        std::vector<uint8_t> last = _last;
+        line(last.data(), last.size());
+    }
+    flush();
+}
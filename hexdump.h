@@ -0,0 +1,79 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: buffered hex dump formatter
+*/
+
+#ifndef __HEXDUMP_H__
+#define __HEXDUMP_H__
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class dump_format
+{
+    classic, /* 0000000: 0000 0000 ...  ................ */
+    xxd,     /* same as xxd: 8 digit addresses */
+    raw,     /* the bytes themselves */
+};
+
+/*
+ * Formats lines with lookup tables into a large buffer that is written to
+ * the stream only when it fills up (and at the end), instead of building
+ * and flushing every line through stream manipulators.
+ *
+ * dump() can be called repeatedly with consecutive chunks; a line split
+ * across chunks is carried over. With squeeze, a run of lines identical to
+ * the line before is printed as a single "*", like hexdump does; the last
+ * line is always printed so the end of the dump is visible.
+ */
+class hex_dumper
+{
+  public:
+    hex_dumper(const hex_dumper&) = delete;
+    hex_dumper& operator=(const hex_dumper&) = delete;
+
+    /* prefix is put in front of every line (not in raw format) */
+    hex_dumper(std::ostream& out, size_t addr,
+               dump_format format = dump_format::classic,
+               bool squeeze = false, const std::string& prefix = "");
+    ~hex_dumper();
+
+    void dump(const uint8_t* data, size_t len);
+    /* print the partial last line and write out the buffer */
+    void finish();
+
+  private:
+    void line(const uint8_t* data, size_t len);
+    void emit(const char* data, size_t len);
+    void flush();
+
+    std::ostream& _out;
+    size_t _addr;
+    dump_format _format;
+    bool _squeeze;
+    std::string _prefix;
+    std::vector<char> _buf;
+    size_t _used;
+    /* bytes of an incomplete line, and the last line printed */
+    std::vector<uint8_t> _pending;
+    std::vector<uint8_t> _last;
+    bool _have_last;
+    bool _skipping;
+    bool _finished;
+};
+
+#endif /* __HEXDUMP_H__ */
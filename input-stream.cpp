@@ -0,0 +1,344 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: streamed (and optionally decompressed) capsule and image input
+*/
+
+#include "input-stream.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#ifdef HAVE_ZSTD
+#include <boost/iostreams/filter/zstd.hpp>
+#endif /* HAVE_ZSTD */
+#include <cerrno>
+#include <cstring>
+
+#include "debug.h"
+#include "exceptions.h"
+
+/* decompressed data is handed to the reader in chunks of this size */
+static constexpr size_t input_chunk_size = 64 * 1024;
+
+static bool has_suffix(const std::string& name, const std::string& suffix)
+{
+    return name.size() >= suffix.size() &&
+           name.compare(name.size() - suffix.size(), suffix.size(),
+                        suffix) == 0;
+}
+
+compression detect_compression(const uint8_t* head, size_t len,
+                               const std::string& filename)
+{
+    if (len >= 2 && head[0] == 0x1f && head[1] == 0x8b)
+    {
+        return compression::gzip;
+    }
+    if (len >= 3 && head[0] == 'B' && head[1] == 'Z' && head[2] == 'h')
+    {
+        return compression::bzip2;
+    }
+    if (len >= 4 && head[0] == 0x28 && head[1] == 0xb5 && head[2] == 0x2f &&
+        head[3] == 0xfd)
+    {
+        return compression::zstd;
+    }
+    // CMF/FLG of a deflate stream with a valid check value
+    if (len >= 2 && (has_suffix(filename, ".zz") ||
+                     has_suffix(filename, ".zlib")))
+    {
+        if ((head[0] & 0x0f) == 8 && ((head[0] << 8) | head[1]) % 31 == 0)
+        {
+            return compression::zlib;
+        }
+    }
+    return compression::none;
+}
+
+const char* compression_name(compression type)
+{
+    switch (type)
+    {
+        case compression::gzip:
+            return "gzip";
+        case compression::zlib:
+            return "zlib";
+        case compression::bzip2:
+            return "bzip2";
+        case compression::zstd:
+            return "zstd";
+        default:
+            return "none";
+    }
+}
+
+size_t read_full(int fd, uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = ::read(fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+std::unique_ptr<input_stream> input_stream::open(const std::string& filename)
+{
+    int src = STDIN_FILENO;
+    if (filename != "-")
+    {
+        src = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (src < 0)
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno)
+                                << boost::errinfo_file_name(filename));
+        }
+    }
+    struct stat sb;
+    bool regular = ::fstat(src, &sb) == 0 && S_ISREG(sb.st_mode);
+    std::vector<uint8_t> head(compression_magic_size);
+    compression type = compression::none;
+    try
+    {
+        if (regular)
+        {
+            // regular files are probed in place and mapped if not compressed
+            ssize_t got = ::pread(src, head.data(), head.size(), 0);
+            head.resize(got > 0 ? got : 0);
+            type = detect_compression(head.data(), head.size(), filename);
+            head.clear();
+        }
+        else
+        {
+            head.resize(read_full(src, head.data(), head.size()));
+            type = detect_compression(head.data(), head.size(), filename);
+        }
+#ifndef HAVE_ZSTD
+        if (type == compression::zstd)
+        {
+            THROW(FileIOError() << msg_info("zstd input is not supported")
+                                << boost::errinfo_file_name(filename));
+        }
+#endif /* !HAVE_ZSTD */
+    }
+    catch (...)
+    {
+        if (src != STDIN_FILENO)
+        {
+            ::close(src);
+        }
+        throw;
+    }
+    if (regular && type == compression::none)
+    {
+        if (src != STDIN_FILENO)
+        {
+            ::close(src);
+        }
+        return nullptr;
+    }
+    FWDEBUG("streaming " << filename << " (compression: "
+                         << compression_name(type) << ")");
+    return std::make_unique<input_stream>(src, src != STDIN_FILENO, type,
+                                          std::move(head));
+}
+
+compression file_compression(const std::string& filename)
+{
+    std::vector<uint8_t> head(compression_magic_size);
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return compression::none;
+    }
+    ssize_t got = ::pread(fd, head.data(), head.size(), 0);
+    ::close(fd);
+    return detect_compression(head.data(), got > 0 ? got : 0, filename);
+}
+
+input_stream::input_stream(int src, bool own_src, compression type,
+                           std::vector<uint8_t> head) :
+    _src(src), _own_src(own_src), _type(type), _sock{-1, -1}, _failed(false)
+{
+    // a socket, unlike a pipe, can be written with MSG_NOSIGNAL, so a
+    // reader that gives up early does not take the process down
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, _sock) < 0)
+    {
+        int err = errno;
+        if (_own_src)
+        {
+            ::close(_src);
+        }
+        THROW(FileIOError() << boost::errinfo_errno(err));
+    }
+    _worker = std::thread(&input_stream::run, this, std::move(head));
+}
+
+input_stream::~input_stream()
+{
+    // closing the read end first unblocks a worker waiting to send
+    if (_sock[0] >= 0)
+    {
+        ::close(_sock[0]);
+    }
+    if (_worker.joinable())
+    {
+        _worker.join();
+    }
+    if (_own_src)
+    {
+        ::close(_src);
+    }
+}
+
+bool input_stream::finish()
+{
+    if (_worker.joinable())
+    {
+        _worker.join();
+    }
+    return !_failed;
+}
+
+/* Boost.Iostreams source that returns the probed bytes before the rest */
+class head_fd_source
+{
+  public:
+    typedef char char_type;
+    typedef boost::iostreams::source_tag category;
+
+    head_fd_source(int fd, const std::vector<uint8_t>& head, int& err) :
+        _fd(fd), _head(&head), _used(0), _err(&err)
+    {
+    }
+
+    std::streamsize read(char* buf, std::streamsize len)
+    {
+        if (_used < _head->size())
+        {
+            size_t n = std::min(static_cast<size_t>(len),
+                                _head->size() - _used);
+            std::copy_n(_head->data() + _used, n, buf);
+            _used += n;
+            return n;
+        }
+        ssize_t ret;
+        do
+        {
+            ret = ::read(_fd, buf, len);
+        } while (ret < 0 && errno == EINTR);
+        if (ret < 0)
+        {
+            *_err = errno;
+            return -1;
+        }
+        return ret ? ret : -1;
+    }
+
+  private:
+    int _fd;
+    const std::vector<uint8_t>* _head;
+    size_t _used;
+    int* _err;
+};
+
+void input_stream::run(std::vector<uint8_t> head)
+{
+    namespace io = boost::iostreams;
+    int err = 0;
+    try
+    {
+        io::filtering_istream in;
+        switch (_type)
+        {
+            case compression::gzip:
+                in.push(io::gzip_decompressor());
+                break;
+            case compression::zlib:
+                in.push(io::zlib_decompressor());
+                break;
+            case compression::bzip2:
+                in.push(io::bzip2_decompressor());
+                break;
+#ifdef HAVE_ZSTD
+            case compression::zstd:
+                in.push(io::zstd_decompressor());
+                break;
+#endif /* HAVE_ZSTD */
+            default:
+                break;
+        }
+        in.push(head_fd_source(_src, head, err));
+        in.exceptions(std::ios_base::badbit);
+
+        std::vector<char> buf(input_chunk_size);
+        while (in)
+        {
+            in.read(buf.data(), buf.size());
+            const char* data = buf.data();
+            size_t len = in.gcount();
+            while (len)
+            {
+                ssize_t sent = ::send(_sock[1], data, len, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (sent < 0)
+                {
+                    // the reader stopped early; not a decompression error
+                    FWDEBUG("input no longer read: " << strerror(errno));
+                    ::close(_sock[1]);
+                    _sock[1] = -1;
+                    return;
+                }
+                data += sent;
+                len -= sent;
+            }
+        }
+    }
+    catch (std::exception& e)
+    {
+        FWERROR("failed to decompress " << compression_name(_type)
+                                        << " input: " << e.what());
+        _failed = true;
+    }
+    if (err)
+    {
+        FWERROR("failed to read input: " << strerror(err));
+        _failed = true;
+    }
+    ::close(_sock[1]);
+    _sock[1] = -1;
+}
@@ -0,0 +1,107 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: streamed (and optionally decompressed) capsule and image input
+*/
+
+#ifndef __INPUT_STREAM_H__
+#define __INPUT_STREAM_H__
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class compression
+{
+    none,
+    gzip,
+    zlib,
+    bzip2,
+    zstd,
+};
+
+/* bytes needed to recognize any of the compression formats */
+constexpr size_t compression_magic_size = 4;
+
+/*
+ * Recognize a compressed file from its first bytes. gzip, bzip2 and zstd
+ * have a magic number; a zlib stream does not have a reliable one, so it is
+ * only recognized by a .zz or .zlib file name.
+ */
+compression detect_compression(const uint8_t* head, size_t len,
+                               const std::string& filename);
+
+const char* compression_name(compression type);
+
+/* compression of a file from its first bytes; none if it cannot be read */
+compression file_compression(const std::string& filename);
+
+/* read up to len bytes, retrying short reads; less than len only at EOF */
+size_t read_full(int fd, uint8_t* buf, size_t len);
+
+/*
+ * Input that is not a plain regular file: stdin ("-"), a pipe or socket,
+ * or a compressed file. A worker thread reads the source, decompresses it
+ * if needed and writes the result into a socket, so fd() can be read
+ * like the uncompressed data while the next chunk is being decompressed.
+ * Nothing is ever written out to a temporary file.
+ */
+class input_stream
+{
+  public:
+    input_stream(const input_stream&) = delete;
+    input_stream& operator=(const input_stream&) = delete;
+
+    /*
+     * returns nullptr for an uncompressed regular file, which callers map
+     * instead; throws if the file cannot be opened
+     */
+    static std::unique_ptr<input_stream> open(const std::string& filename);
+
+    /* src is closed at the end if own_src; head holds bytes already read */
+    input_stream(int src, bool own_src, compression type,
+                 std::vector<uint8_t> head);
+    ~input_stream();
+
+    /* read end of the (decompressed) data */
+    int fd() const
+    {
+        return _sock[0];
+    }
+    compression type() const
+    {
+        return _type;
+    }
+
+    /*
+     * wait for the worker, after the reader has seen EOF on fd(); false if
+     * the source could not be read or did not decompress cleanly
+     */
+    bool finish();
+
+  private:
+    void run(std::vector<uint8_t> head);
+
+    int _src;
+    bool _own_src;
+    compression _type;
+    int _sock[2];
+    std::thread _worker;
+    std::atomic<bool> _failed;
+};
+
+#endif /* __INPUT_STREAM_H__ */
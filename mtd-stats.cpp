@@ -0,0 +1,316 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: flash operation counters and latency histograms
+*/
+
+#include "mtd-stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include "debug.h"
+#include "op-trace.h"
+
+const char* mtd_op_name(mtd_op op)
+{
+    switch (op)
+    {
+        case mtd_op::read:
+            return "read";
+        case mtd_op::program:
+            return "program";
+        case mtd_op::erase:
+            return "erase";
+    }
+    return "unknown";
+}
+
+size_t latency_histogram::bucket(uint64_t value)
+{
+    if (value < sub_buckets)
+    {
+        return value;
+    }
+    size_t group = 63 - __builtin_clzll(value) - sub_bits;
+    return sub_buckets + group * sub_buckets +
+           ((value >> group) & (sub_buckets - 1));
+}
+
+uint64_t latency_histogram::bucket_low(size_t idx)
+{
+    if (idx < sub_buckets)
+    {
+        return idx;
+    }
+    size_t group = (idx - sub_buckets) / sub_buckets;
+    return (sub_buckets + (idx % sub_buckets)) << group;
+}
+
+uint64_t latency_histogram::bucket_high(size_t idx)
+{
+    if (idx < sub_buckets)
+    {
+        return idx;
+    }
+    size_t group = (idx - sub_buckets) / sub_buckets;
+    return bucket_low(idx) + ((uint64_t(1) << group) - 1);
+}
+
+void latency_histogram::record(uint64_t value)
+{
+    _counts[bucket(value)]++;
+    _count++;
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+    _sum += value;
+}
+
+uint64_t latency_histogram::percentile(double fraction) const
+{
+    if (!_count)
+    {
+        return 0;
+    }
+    uint64_t wanted = std::max<uint64_t>(1, std::ceil(fraction * _count));
+    uint64_t seen = 0;
+    for (size_t idx = 0; idx < buckets; idx++)
+    {
+        seen += _counts[idx];
+        if (seen >= wanted)
+        {
+            return std::min(bucket_high(idx), _max);
+        }
+    }
+    return _max;
+}
+
+mtd_stats& mtd_stats::instance()
+{
+    static mtd_stats stats;
+    return stats;
+}
+
+size_t mtd_stats::size_class(size_t len)
+{
+    if (len <= 4 * 1024)
+        return 0;
+    if (len <= 64 * 1024)
+        return 1;
+    if (len <= 1024 * 1024)
+        return 2;
+    return 3;
+}
+
+const char* mtd_stats::size_class_name(size_t size_class)
+{
+    static const char* names[size_classes] = {"<=4K", "<=64K", "<=1M", ">1M"};
+    return names[size_class];
+}
+
+void mtd_stats::record(mtd_op op, uint32_t addr, size_t len,
+                       std::chrono::nanoseconds elapsed, bool failed)
+{
+    uint64_t ns = elapsed.count();
+    std::lock_guard<std::mutex> lock(_lock);
+    entry& e = _entries[static_cast<size_t>(op)][size_class(len)];
+    e.latency.record(ns);
+    e.bytes += len;
+    e.errors += failed;
+
+    // sorted slowest first; an unused slot has ns == 0
+    auto& slowest = _slowest[static_cast<size_t>(op)];
+    if (ns > slowest.back().ns)
+    {
+        slowest.back() = {ns, addr, len};
+        std::sort(slowest.begin(), slowest.end(),
+                  [](const slow_op& a, const slow_op& b) {
+                      return a.ns > b.ns;
+                  });
+    }
+}
+
+void mtd_stats::reset()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    _entries = {};
+    _slowest = {};
+}
+
+void mtd_stats::report(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    auto us = [](uint64_t ns) { return (ns + 500) / 1000; };
+    out << std::dec << std::left << std::setw(8) << "op" << std::setw(7)
+        << "size" << std::right << std::setw(9) << "count" << std::setw(12)
+        << "bytes" << std::setw(7) << "errors" << std::setw(9) << "min"
+        << std::setw(9) << "p50" << std::setw(9) << "p90" << std::setw(9)
+        << "p99" << std::setw(9) << "max" << " (us)\n";
+    for (size_t op = 0; op < mtd_op_count; op++)
+    {
+        for (size_t sc = 0; sc < size_classes; sc++)
+        {
+            const entry& e = _entries[op][sc];
+            const latency_histogram& h = e.latency;
+            if (!h.count())
+            {
+                continue;
+            }
+            out << std::left << std::setw(8)
+                << mtd_op_name(static_cast<mtd_op>(op)) << std::setw(7)
+                << size_class_name(sc) << std::right << std::setw(9)
+                << h.count() << std::setw(12) << e.bytes << std::setw(7)
+                << e.errors << std::setw(9) << us(h.min()) << std::setw(9)
+                << us(h.percentile(0.5)) << std::setw(9)
+                << us(h.percentile(0.9)) << std::setw(9)
+                << us(h.percentile(0.99)) << std::setw(9) << us(h.max())
+                << '\n';
+        }
+    }
+    for (size_t op = 0; op < mtd_op_count; op++)
+    {
+        const auto& slowest = _slowest[op];
+        if (!slowest.front().ns)
+        {
+            continue;
+        }
+        out << "slowest " << mtd_op_name(static_cast<mtd_op>(op)) << ":";
+        for (const slow_op& s : slowest)
+        {
+            if (!s.ns)
+            {
+                break;
+            }
+            out << ' ' << std::hex << s.addr << '+' << s.len << std::dec
+                << '=' << us(s.ns) << "us";
+        }
+        out << '\n';
+    }
+}
+
+void mtd_stats::write_json(std::ostream& out) const
+{
+    std::lock_guard<std::mutex> lock(_lock);
+    out << std::dec << "{\n  \"unit\": \"ns\",\n  \"operations\": [";
+    const char* sep = "\n";
+    for (size_t op = 0; op < mtd_op_count; op++)
+    {
+        for (size_t sc = 0; sc < size_classes; sc++)
+        {
+            const entry& e = _entries[op][sc];
+            const latency_histogram& h = e.latency;
+            if (!h.count())
+            {
+                continue;
+            }
+            out << sep << "    {\"op\": \""
+                << mtd_op_name(static_cast<mtd_op>(op))
+                << "\", \"size_class\": \"" << size_class_name(sc)
+                << "\", \"count\": " << h.count() << ", \"bytes\": "
+                << e.bytes << ", \"errors\": " << e.errors
+                << ",\n     \"min\": " << h.min() << ", \"p50\": "
+                << h.percentile(0.5) << ", \"p90\": " << h.percentile(0.9)
+                << ", \"p99\": " << h.percentile(0.99) << ", \"max\": "
+                << h.max() << ", \"sum\": " << h.sum()
+                << ",\n     \"buckets\": [";
+            // only the buckets in use, as [low, high, count]
+            const char* bsep = "";
+            for (size_t idx = 0; idx < latency_histogram::buckets; idx++)
+            {
+                if (h.counts()[idx])
+                {
+                    out << bsep << '[' << latency_histogram::bucket_low(idx)
+                        << ", " << latency_histogram::bucket_high(idx) << ", "
+                        << h.counts()[idx] << ']';
+                    bsep = ", ";
+                }
+            }
+            out << "]}";
+            sep = ",\n";
+        }
+    }
+    out << "\n  ],\n  \"slowest\": {";
+    sep = "\n";
+    for (size_t op = 0; op < mtd_op_count; op++)
+    {
+        out << sep << "    \"" << mtd_op_name(static_cast<mtd_op>(op))
+            << "\": [";
+        const char* ssep = "";
+        for (const slow_op& s : _slowest[op])
+        {
+            if (!s.ns)
+            {
+                break;
+            }
+            out << ssep << "{\"addr\": " << s.addr << ", \"len\": " << s.len
+                << ", \"ns\": " << s.ns << '}';
+            ssep = ", ";
+        }
+        out << ']';
+        sep = ",\n";
+    }
+    out << "\n  }\n}\n";
+}
+
+void mtd_op_timer::finish()
+{
+    auto end = std::chrono::steady_clock::now();
+    bool failed = std::uncaught_exceptions() > _exceptions;
+    if (_observers & observe_stats)
+    {
+        mtd_stats::instance().record(_op, _addr, _len, end - _start, failed);
+    }
+    if (_observers & observe_trace)
+    {
+        op_trace_append(_op, _addr, _len, _start, end, _data, _data_len,
+                        failed);
+    }
+}
+
+static std::string stats_json_path;
+
+static void report_stats(void)
+{
+    const mtd_stats& stats = mtd_stats::instance();
+    if (stats_json_path.empty())
+    {
+        stats.report(std::cerr);
+        return;
+    }
+    std::ofstream json(stats_json_path);
+    stats.write_json(json);
+    if (!json.flush())
+    {
+        FWERROR("failed to write statistics to " << stats_json_path);
+    }
+}
+
+void mtd_stats_report_at_exit(const std::string& json_path)
+{
+    stats_json_path = json_path;
+    // constructed first, so it outlives the exit handler
+    mtd_stats::instance();
+    mtd_stats::enable();
+    // given twice, the last destination wins and the report is printed once
+    static bool registered = false;
+    if (!registered)
+    {
+        std::atexit(report_stats);
+        registered = true;
+    }
+}
@@ -0,0 +1,220 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: flash operation counters and latency histograms
+*/
+
+#ifndef __MTD_STATS_H__
+#define __MTD_STATS_H__
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <string>
+
+enum class mtd_op
+{
+    read,
+    program,
+    erase,
+};
+constexpr size_t mtd_op_count = 3;
+
+const char* mtd_op_name(mtd_op op);
+
+/*
+ * What wants device operations observed: statistics (below) and the
+ * operation trace (op-trace.h). With neither, an operation costs a load.
+ */
+enum mtd_op_observer : unsigned
+{
+    observe_stats = 1 << 0,
+    observe_trace = 1 << 1,
+};
+inline std::atomic<unsigned> __mtd_op_observers{0};
+
+inline void mtd_op_observe(mtd_op_observer observer, bool on)
+{
+    if (on)
+        __mtd_op_observers.fetch_or(observer, std::memory_order_relaxed);
+    else
+        __mtd_op_observers.fetch_and(~observer, std::memory_order_relaxed);
+}
+
+/*
+ * Log-linear histogram, like HdrHistogram: values below 8 have a bucket
+ * each and every power of two above that is split into 8 buckets, so a
+ * bucket is never wider than an eighth of the values in it.
+ */
+class latency_histogram
+{
+  public:
+    static constexpr size_t sub_bits = 3;
+    static constexpr size_t sub_buckets = 1 << sub_bits;
+    static constexpr size_t buckets = sub_buckets * (64 - sub_bits + 1);
+
+    static size_t bucket(uint64_t value);
+    /* smallest and largest value that fall into a bucket */
+    static uint64_t bucket_low(size_t idx);
+    static uint64_t bucket_high(size_t idx);
+
+    void record(uint64_t value);
+    /* upper bound of the value below which fraction of the values fall */
+    uint64_t percentile(double fraction) const;
+
+    uint64_t count() const
+    {
+        return _count;
+    }
+    uint64_t min() const
+    {
+        return _count ? _min : 0;
+    }
+    uint64_t max() const
+    {
+        return _max;
+    }
+    uint64_t sum() const
+    {
+        return _sum;
+    }
+    const std::array<uint64_t, buckets>& counts() const
+    {
+        return _counts;
+    }
+
+  private:
+    std::array<uint64_t, buckets> _counts{};
+    uint64_t _count = 0;
+    uint64_t _min = UINT64_MAX;
+    uint64_t _max = 0;
+    uint64_t _sum = 0;
+};
+
+/*
+ * Counts, bytes and latency (in ns) of every flash operation, by operation
+ * and size class, plus the slowest operations with their address. Shared
+ * by all devices and threads of the process; recording is off unless
+ * enabled.
+ */
+class mtd_stats
+{
+  public:
+    /* up to 4K, 64K, 1M, and larger */
+    static constexpr size_t size_classes = 4;
+    /* slowest operations remembered per operation type */
+    static constexpr size_t slowest_kept = 8;
+
+    struct entry
+    {
+        uint64_t bytes = 0;
+        uint64_t errors = 0;
+        latency_histogram latency;
+    };
+    struct slow_op
+    {
+        uint64_t ns;
+        uint32_t addr;
+        size_t len;
+    };
+
+    static mtd_stats& instance();
+    static size_t size_class(size_t len);
+    static const char* size_class_name(size_t size_class);
+
+    static bool enabled()
+    {
+        return __mtd_op_observers.load(std::memory_order_relaxed) &
+               observe_stats;
+    }
+    static void enable(bool on = true)
+    {
+        mtd_op_observe(observe_stats, on);
+    }
+
+    void record(mtd_op op, uint32_t addr, size_t len,
+                std::chrono::nanoseconds elapsed, bool failed);
+    void reset();
+
+    /* table for people */
+    void report(std::ostream& out) const;
+    /* everything, including the histogram buckets, for tools */
+    void write_json(std::ostream& out) const;
+
+  private:
+    mtd_stats() = default;
+
+    mutable std::mutex _lock;
+    std::array<std::array<entry, size_classes>, mtd_op_count> _entries;
+    std::array<std::array<slow_op, slowest_kept>, mtd_op_count> _slowest{};
+};
+
+/*
+ * Enable statistics and print them when the process exits: the table to
+ * stderr, or JSON to json_path if it is not empty. A later call only
+ * changes the destination.
+ */
+void mtd_stats_report_at_exit(const std::string& json_path);
+
+/* times one operation for the lifetime of the object, for whichever
+ * observers were enabled when it started */
+class mtd_op_timer
+{
+  public:
+    mtd_op_timer(const mtd_op_timer&) = delete;
+    mtd_op_timer& operator=(const mtd_op_timer&) = delete;
+
+    mtd_op_timer(mtd_op op, uint32_t addr, size_t len) :
+        _op(op), _addr(addr), _len(len),
+        _observers(__mtd_op_observers.load(std::memory_order_relaxed))
+    {
+        if (_observers)
+        {
+            _exceptions = std::uncaught_exceptions();
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+    ~mtd_op_timer()
+    {
+        if (_observers)
+        {
+            finish();
+        }
+    }
+
+    /* the bytes read or programmed, hashed into the operation trace */
+    void data(const uint8_t* buf, size_t len)
+    {
+        _data = buf;
+        _data_len = len;
+    }
+
+  private:
+    void finish();
+
+    mtd_op _op;
+    uint32_t _addr;
+    size_t _len;
+    unsigned _observers;
+    int _exceptions = 0;
+    const uint8_t* _data = nullptr;
+    size_t _data_len = 0;
+    std::chrono::steady_clock::time_point _start;
+};
+
+#endif /* __MTD_STATS_H__ */
@@ -17,19 +17,35 @@
 
 #include "pfr.hpp"
 
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <boost/iostreams/device/mapped_file.hpp>
+#include <chrono>
 #include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "debug.h"
 #include "exceptions.h"
+#include "flash-timing.h"
+#include "hexdump.h"
+#include "input-stream.h"
+#include "mtd-stats.h"
 #include "mtd.h"
+#include "op-trace.h"
+#include "pbc-encoder.h"
+#include "snapshot.hpp"
 
 #ifdef DEVELOPER_OPTIONS
 template <typename deviceClassT>
@@ -65,84 +81,172 @@ int buf_to_flash(mtd<deviceClassT>& dev, const uint8_t* fbuf, size_t start,
 }
 #endif /* DEVELOPER_OPTIONS */
 
+template <typename deviceClassT>
+int cp_to_flash(mtd<deviceClassT>& dev, const cbspan& contents, size_t start)
+{
+    dev.write(start, contents);
+
+    return 0;
+}
+
 template <typename deviceClassT>
 int cp_to_flash(mtd<deviceClassT>& dev, std::string& filename, size_t start)
 {
     boost::iostreams::mapped_file file(filename,
                                        boost::iostreams::mapped_file::readonly);
 
-    std::vector<uint8_t> contents(file.const_data(),
-                                  file.const_data() + file.size());
+    cbspan contents(reinterpret_cast<const uint8_t*>(file.const_data()),
+                    file.size());
 
-    dev.write(start, contents);
+    return cp_to_flash(dev, contents, start);
+}
 
+/* streamed images are written in chunks of this size, aligned to big blocks */
+constexpr size_t cp_stream_chunk_size = 16 * BIG_BLOCK_SIZE;
+
+template <typename deviceClassT>
+int cp_to_flash(mtd<deviceClassT>& dev, input_stream& input, size_t start)
+{
+    std::vector<uint8_t> buf(cp_stream_chunk_size);
+    size_t offset = start;
+    while (true)
+    {
+        // end each chunk on a big block boundary so no block is written twice
+        size_t want = cp_stream_chunk_size - (offset & BIG_BLOCK_MASK);
+        size_t got = read_full(input.fd(), buf.data(), want);
+        if (!got)
+        {
+            break;
+        }
+        if (offset + got > dev.size())
+        {
+            std::cerr << "not enough space to write at offset (" << std::hex
+                      << start << " + more than " << (offset + got - start)
+                      << " > " << dev.size() << ")" << std::endl;
+            return 3;
+        }
+        dev.write(offset, cbspan(buf.data(), got));
+        offset += got;
+        if (got < want)
+        {
+            break;
+        }
+    }
+    if (!input.finish())
+    {
+        std::cerr << "input ended early, flash holds a partial image"
+                  << std::endl;
+        return 1;
+    }
+    FWINFO("copied " << std::hex << (offset - start) << " bytes");
     return 0;
 }
 
+/* dumps are read in chunks of this size, with a few chunks in flight */
+constexpr size_t cp_read_chunk_size = 128 * 1024;
+constexpr size_t cp_read_depth = 3;
+
+typedef std::function<void(size_t done, size_t total)> progress_callback;
+
+static void write_all(int fd, const uint8_t* data, size_t len)
+{
+    while (len)
+    {
+        ssize_t ret = ::write(fd, data, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        data += ret;
+        len -= ret;
+    }
+}
+
+/* flash reads of the next chunks overlap with writing out the current one */
 template <typename deviceClassT>
-int cp_to_file(mtd<deviceClassT>& dev, std::string& filename, size_t start,
-               size_t len)
+int cp_to_file(mtd<deviceClassT>& dev, int fd, size_t start, size_t len,
+               const progress_callback& progress)
 {
     if ((start + len) > dev.size())
     {
         std::cerr << "access beyond end of flash (" << std::hex << start
                   << " + " << len << " > " << dev.size() << ")" << std::endl;
+        return 3;
     }
 
-    boost::iostreams::mapped_file_params params(filename);
-    params.new_file_size = len;
-    params.flags = boost::iostreams::mapped_file::readwrite;
-    boost::iostreams::mapped_file file(params);
-
-    std::vector<uint8_t> contents(file.size());
-    dev.read(start, contents);
-    std::copy(contents.begin(), contents.end(), file.data());
+    size_t chunks = (len + cp_read_chunk_size - 1) / cp_read_chunk_size;
+    pipeline(
+        chunks, cp_read_depth,
+        [&](size_t idx, std::vector<uint8_t>& buf) {
+            size_t offset = idx * cp_read_chunk_size;
+            buf.resize(std::min(cp_read_chunk_size, len - offset));
+            if (dev.read(start + offset, buf) != static_cast<int>(buf.size()))
+                THROW(FileIOError() << msg_info("short read"));
+        },
+        [&](size_t idx, std::vector<uint8_t>& buf) {
+            write_all(fd, buf.data(), buf.size());
+            if (progress)
+                progress(idx * cp_read_chunk_size + buf.size(), len);
+        });
 
     return 0;
 }
 
-void dump_buf(size_t flash_addr, const std::span<const uint8_t>& buf)
+template <typename deviceClassT>
+int cp_to_file(mtd<deviceClassT>& dev, std::string& filename, size_t start,
+               size_t len)
 {
-    unsigned int i = 0, l;
-    std::stringstream hex, ascii;
-    auto cb = buf.begin();
-
-    /*  0         1         2         3         4         5         6
-     *  0123456789012345678901234567890123456789012345678901234567890123456789
-     *  0000000: 0000 0000 0000 0000 0000 0000 0000 0000  ................
-     */
-
-    std::cout << "dumping " << buf.size() << " bytes from " << std::hex
-              << flash_addr << '\n';
-    hex << std::hex << std::setfill('0');
-    while (cb != buf.end())
-    {
-        hex.str("");
-        ascii.str("");
-        hex << std::setw(7) << (flash_addr + i) << ": ";
-        for (l = 0; l < 16 && (cb != buf.end()); l++)
-        {
-            hex << std::setw(2) << (unsigned int)*cb;
-            if (l & 1)
-                hex << ' ';
-            if (isprint(*cb))
-                ascii << (char)(*cb);
-            else
-                ascii << '.';
-            cb++;
-            i++;
-        }
-        std::cout << std::left << std::setw(50) << hex.str() << ascii.str()
-                  << std::endl;
+    int fd = STDOUT_FILENO;
+    if (filename != "-")
+    {
+        fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+        if (fd < 0)
+            THROW(FileIOError() << boost::errinfo_errno(errno)
+                                << boost::errinfo_file_name(filename));
+    }
+
+    // only draw progress for a person watching
+    progress_callback progress;
+    int shown = -1;
+    if (isatty(STDERR_FILENO))
+    {
+        progress = [&shown](size_t done, size_t total) {
+            int percent = total ? done * 100 / total : 100;
+            if (percent == shown)
+                return;
+            shown = percent;
+            std::cerr << "\rcopied " << std::dec << (done >> 10) << " of "
+                      << (total >> 10) << " KiB (" << percent << "%)"
+                      << std::flush;
+        };
     }
-    std::cout << std::setw(0);
+
+    int ret;
+    try
+    {
+        ret = cp_to_file(dev, fd, start, len, progress);
+    }
+    catch (...)
+    {
+        if (fd != STDOUT_FILENO)
+            close(fd);
+        throw;
+    }
+    if (shown >= 0)
+        std::cerr << std::endl;
+    if (fd != STDOUT_FILENO && close(fd) < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(filename));
+
+    return ret;
 }
 
+/* flash reads of the next chunks overlap with formatting the current one */
 template <typename deviceClassT>
-int dump_flash(mtd<deviceClassT>& dev, size_t start, size_t len)
+int dump_flash(mtd<deviceClassT>& dev, size_t start, size_t len,
+               dump_format format, bool squeeze)
 {
-    int ret = 0;
-
     if ((start + len) > dev.size())
     {
         std::cerr << "access beyond end of flash (" << std::hex << start
@@ -150,11 +254,85 @@ int dump_flash(mtd<deviceClassT>& dev, size_t start, size_t len)
         return 3;
     }
 
-    std::vector<uint8_t> mbuf(len);
-    dev.read(start, mbuf);
-    dump_buf(start, mbuf);
+    // xxd and raw output stay comparable with other tools
+    if (format == dump_format::classic)
+        std::cout << "dumping " << std::dec << len << " bytes from "
+                  << std::hex << start << '\n';
+    hex_dumper dumper(std::cout, start, format, squeeze);
+    size_t chunks = (len + cp_read_chunk_size - 1) / cp_read_chunk_size;
+    pipeline(
+        chunks, cp_read_depth,
+        [&](size_t idx, std::vector<uint8_t>& buf) {
+            size_t offset = idx * cp_read_chunk_size;
+            buf.resize(std::min(cp_read_chunk_size, len - offset));
+            if (dev.read(start + offset, buf) != static_cast<int>(buf.size()))
+                THROW(FileIOError() << msg_info("short read"));
+        },
+        [&](size_t, std::vector<uint8_t>& buf) {
+            dumper.dump(buf.data(), buf.size());
+        });
+    dumper.finish();
 
-    return ret;
+    return 0;
+}
+
+template <typename deviceClassT>
+int index_flash(mtd<deviceClassT>& dev, size_t workers)
+{
+    dev.rebuild_index(workers);
+
+    size_t erased = 0;
+    const block_index* index = dev.index();
+    for (size_t b = 0; b < index->blocks(); b++)
+    {
+        if (index->at(b).flags & block_index::entry_erased)
+            erased++;
+    }
+    std::cout << std::dec << index->blocks() << " blocks of " << std::hex
+              << index->block_size() << " bytes, " << std::dec << erased
+              << " erased" << std::endl;
+
+    return 0;
+}
+
+template <typename deviceClassT>
+int snapshot_flash(mtd<deviceClassT>& dev, const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(filename));
+    size_t stored;
+    try
+    {
+        stored = snapshot_write(dev, fd);
+    }
+    catch (...)
+    {
+        close(fd);
+        unlink(filename.c_str());
+        throw;
+    }
+    if (close(fd) < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(filename));
+    std::cout << std::dec << stored << " of " << dev.size() / dev.erase_size()
+              << " blocks of " << std::hex << dev.erase_size()
+              << " bytes stored" << std::endl;
+
+    return 0;
+}
+
+template <typename deviceClassT>
+int restore_flash(mtd<deviceClassT>& dev, const std::string& filename)
+{
+    boost::iostreams::mapped_file file(filename,
+                                       boost::iostreams::mapped_file::readonly);
+    cbspan snap(reinterpret_cast<const uint8_t*>(file.const_data()),
+                file.size());
+
+    return !snapshot_restore(dev, snap);
 }
 
 std::string locate_active_device()
@@ -180,10 +358,390 @@ typedef enum
     ACTION_PFR_AUTH,
     ACTION_PFR_STAGE,
     ACTION_PFR_WRITE,
+    ACTION_PFR_VERIFY,
+    ACTION_PFR_PLAN,
+    ACTION_PFR_ENCODE,
+    ACTION_PFR_DELTA,
+    ACTION_INDEX,
+    ACTION_SNAPSHOT,
+    ACTION_RESTORE,
     ACTION_SECURE_BOOT_IMAGE_WRITE,
+    ACTION_REPLAY,
     ACTION_MAX,
 } ACTION;
 
+/**
+ * Run one cp-to-flash or pfr write against several devices at once.
+ * The file is authenticated and mapped once and shared by one worker
+ * per device; progress and failures are reported per device.
+ */
+int multi_target_update(const std::vector<std::string>& flash_devs,
+                        ACTION action, const std::string& filename,
+                        size_t start, bool recovery_reset, bool verify,
+                        bool use_index, const update_plan* plan)
+{
+    if (action != ACTION_CP_TO_FLASH && action != ACTION_PFR_WRITE)
+    {
+        std::cerr << "multiple devices are only supported for cp to flash "
+                     "and pfr write"
+                  << std::endl;
+        return 1;
+    }
+    // two workers on one device would interleave their erases and writes;
+    // device nodes are compared by device number, other files by inode
+    std::set<std::pair<dev_t, ino_t>> seen;
+    for (const std::string& flash_dev : flash_devs)
+    {
+        struct stat sb;
+        if (stat(flash_dev.c_str(), &sb) < 0)
+        {
+            continue; // reported when it is opened
+        }
+        auto key = S_ISCHR(sb.st_mode) ? std::make_pair(sb.st_rdev, ino_t(0))
+                                       : std::make_pair(sb.st_dev, sb.st_ino);
+        if (!seen.insert(key).second)
+        {
+            std::cerr << flash_dev << " is given more than once" << std::endl;
+            return 1;
+        }
+    }
+    try
+    {
+        pfr_image image(filename);
+        if (action == ACTION_PFR_WRITE && !image.authenticate(!recovery_reset))
+        {
+            return 1;
+        }
+
+        std::mutex report_lock;
+        auto report = [&report_lock](const std::string& flash_dev,
+                                     const std::string& msg) {
+            std::lock_guard<std::mutex> guard(report_lock);
+            std::cerr << flash_dev << ": " << msg << std::endl;
+        };
+
+        std::vector<int> results(flash_devs.size(), 1);
+        std::vector<std::thread> workers;
+        for (size_t idx = 0; idx < flash_devs.size(); idx++)
+        {
+            workers.emplace_back([&, idx]() {
+                const std::string& flash_dev = flash_devs[idx];
+                auto begin = std::chrono::steady_clock::now();
+                report(flash_dev, "started");
+                try
+                {
+                    mtd_type dev;
+                    dev.open(flash_dev);
+                    if (use_index)
+                        dev.open_index(block_index::default_path(flash_dev));
+                    if (action == ACTION_PFR_WRITE)
+                    {
+                        results[idx] = !pfr_write(dev, image, start,
+                                                  recovery_reset, plan);
+                        if (!results[idx] && verify)
+                        {
+                            report(flash_dev, "verifying");
+                            results[idx] = !pfr_verify(dev, image, start);
+                        }
+                    }
+                    else
+                    {
+                        results[idx] = cp_to_flash(dev, image.data(), start);
+                    }
+                }
+                catch (boost::exception& e)
+                {
+                    report(flash_dev, diagnostic_information(e));
+                    results[idx] = 1;
+                }
+                catch (std::exception& e)
+                {
+                    report(flash_dev, e.what());
+                    results[idx] = 1;
+                }
+                std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - begin;
+                std::stringstream msg;
+                msg << (results[idx] ? "FAILED" : "done") << " after "
+                    << std::fixed << std::setprecision(1) << elapsed.count()
+                    << "s";
+                report(flash_dev, msg.str());
+            });
+        }
+        for (auto& worker : workers)
+        {
+            worker.join();
+        }
+        return std::any_of(results.begin(), results.end(),
+                           [](int ret) { return ret != 0; });
+    }
+    catch (boost::exception& e)
+    {
+        std::cerr << diagnostic_information(e) << std::endl;
+    }
+    return 1;
+}
+
+/**
+ * Authenticate several capsules concurrently, one per worker thread, and
+ * print one result line per capsule in the order they were given.
+ */
+int batch_authenticate(const std::vector<std::string>& filenames,
+                       bool check_root_key, bool quick)
+{
+    std::vector<std::string> results(filenames.size());
+    std::vector<char> failed(filenames.size(), 1);
+    parallel_for(filenames.size(), default_worker_count(), [&](size_t idx) {
+        auto begin = std::chrono::steady_clock::now();
+        std::string result;
+        try
+        {
+            auto input = input_stream::open(filenames[idx]);
+            if (input)
+            {
+                failed[idx] =
+                    !pfr_authenticate_stream(input->fd(), check_root_key,
+                                             nullptr, quick) ||
+                    !input->finish();
+            }
+            else
+            {
+                failed[idx] =
+                    !pfr_authenticate(filenames[idx], check_root_key, quick);
+            }
+            result = failed[idx] ? "FAILED" : "ok";
+        }
+        catch (boost::exception& e)
+        {
+            const int* err = boost::get_error_info<boost::errinfo_errno>(e);
+            result = "FAILED: " +
+                     (err ? std::string(strerror(*err))
+                          : diagnostic_information(e));
+        }
+        catch (std::exception& e)
+        {
+            result = std::string("FAILED: ") + e.what();
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - begin;
+        std::stringstream msg;
+        msg << result << " after " << std::fixed << std::setprecision(1)
+            << elapsed.count() << "s";
+        results[idx] = msg.str();
+    });
+    for (size_t idx = 0; idx < filenames.size(); idx++)
+    {
+        std::cout << filenames[idx] << ": " << results[idx] << std::endl;
+    }
+    return std::any_of(failed.begin(), failed.end(),
+                       [](char ret) { return ret != 0; });
+}
+
+/**
+ * Replay an operation trace against an emulated device image, or against
+ * memory when image is empty, and report the recorded, replayed and
+ * modelled times; with print, only list the operations.
+ */
+int replay_trace(const std::string& trace, const std::string& image,
+                 const std::string& timing_profile, bool print)
+{
+    try
+    {
+        std::vector<op_trace_record> records = op_trace_load(trace);
+        if (print)
+        {
+            op_trace_print(records, std::cout);
+            return 0;
+        }
+        flash_timing timing;
+        if (!timing_profile.empty())
+        {
+            timing = flash_timing::load(timing_profile);
+        }
+
+        uint64_t extent = op_trace_extent(records);
+        op_trace_summary summary;
+        if (image.empty())
+        {
+            ram_mtd dev((extent + BIG_BLOCK_MASK) & ~uint64_t(BIG_BLOCK_MASK));
+            summary = op_trace_replay(dev, records, timing);
+        }
+        else
+        {
+            file_mtd_emulation dev;
+            dev.open(image);
+            if (extent > dev.size())
+            {
+                std::cerr << "trace reaches " << std::hex << extent
+                          << ", beyond the end of " << image << std::endl;
+                return 1;
+            }
+            summary = op_trace_replay(dev, records, timing);
+        }
+        summary.report(std::cout);
+        return 0;
+    }
+    catch (boost::exception& e)
+    {
+        std::cerr << diagnostic_information(e) << std::endl;
+    }
+    return 1;
+}
+
+/**
+ * Run a pfr write or secure boot image update against a dry_run device,
+ * which erases and programs nothing, and print what it would have done:
+ * the merged erase and program runs, the totals, and the time they take
+ * under the flash timing model.
+ */
+int dry_run_update(const std::string& flash_dev, ACTION action,
+                   const std::string& filename, size_t start,
+                   bool recovery_reset, const std::string& timing_profile,
+                   const update_plan* plan)
+{
+    if (action != ACTION_PFR_WRITE &&
+        action != ACTION_SECURE_BOOT_IMAGE_WRITE)
+    {
+        std::cerr << "--dry-run is only supported for pfr write and "
+                     "secure_boot"
+                  << std::endl;
+        return 1;
+    }
+    try
+    {
+        flash_timing timing;
+        if (!timing_profile.empty())
+        {
+            timing = flash_timing::load(timing_profile);
+        }
+        dry_run_mtd_type dev;
+        dev.open(flash_dev);
+        pfr_image image(filename);
+        bool ok;
+        if (action == ACTION_PFR_WRITE)
+        {
+            ok = image.authenticate(!recovery_reset) &&
+                 pfr_write(dev, image, start, recovery_reset, plan);
+        }
+        else
+        {
+            ok = image.authenticate(true) &&
+                 secure_boot_image_update(dev, image, start);
+        }
+        if (!ok)
+        {
+            return 1;
+        }
+        dev.device().plan().report(std::cout, timing);
+        return 0;
+    }
+    catch (boost::exception& e)
+    {
+        std::cerr << diagnostic_information(e) << std::endl;
+    }
+    return 1;
+}
+
+/**
+ * Authenticate a capsule and save the update plan that pfr write would
+ * derive from its pbc, for pfr write --plan on the nodes; the root key is
+ * not checked, as a plan is made offline without an active PFM.
+ */
+int make_update_plan(const std::string& filename, const std::string& plan_file,
+                     bool recovery_reset)
+{
+    try
+    {
+        pfr_image image(filename);
+        update_plan plan;
+        if (!image.authenticate(false) || !plan.build(image, recovery_reset))
+        {
+            return 1;
+        }
+        plan.save(plan_file);
+        uint64_t erased = 0, programmed = 0;
+        for (const update_plan_erase& run : plan.erases())
+        {
+            erased += run.length;
+        }
+        for (const update_plan_program& run : plan.programs())
+        {
+            programmed += run.length;
+        }
+        std::cout << plan.erases().size() << " erase runs (" << erased / 1024
+                  << "K), " << plan.programs().size() << " program runs ("
+                  << programmed / 1024 << "K)" << std::endl;
+        return 0;
+    }
+    catch (boost::exception& e)
+    {
+        std::cerr << diagnostic_information(e) << std::endl;
+    }
+    return 1;
+}
+
+/**
+ * Encode a raw flash image into a pbc (header, bitmaps and payload) for the
+ * regions listed in regions_file, on workers threads, and print what the
+ * pbc erases and copies. With old_filename, only the blocks that changed
+ * from that image are encoded.
+ */
+int encode_pbc(const std::string& filename, const std::string& old_filename,
+               const std::string& regions_file, const std::string& output,
+               size_t workers)
+{
+    try
+    {
+        std::vector<pbc_region> regions = pbc_load_regions(regions_file);
+        boost::iostreams::mapped_file file(
+            filename, boost::iostreams::mapped_file::readonly);
+        cbspan image(reinterpret_cast<const uint8_t*>(file.const_data()),
+                     file.size());
+        pbc_stats stats;
+        std::vector<uint8_t> encoded;
+        if (old_filename.empty())
+        {
+            encoded = pbc_encode(image, regions, workers, stats);
+        }
+        else
+        {
+            boost::iostreams::mapped_file old_file(
+                old_filename, boost::iostreams::mapped_file::readonly);
+            cbspan old_image(
+                reinterpret_cast<const uint8_t*>(old_file.const_data()),
+                old_file.size());
+            encoded =
+                pbc_encode_delta(old_image, image, regions, workers, stats);
+        }
+
+        std::ofstream out(output, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(encoded.data()),
+                  encoded.size());
+        out.close();
+        if (!out)
+        {
+            std::cerr << "failed to write " << output << std::endl;
+            return 1;
+        }
+        std::cout << "pages: " << stats.pages << ", erased: " << stats.erased
+                  << ", copied: " << stats.copied
+                  << ", blank left out: " << stats.blank
+                  << ", unchanged: " << stats.unchanged << std::endl
+                  << "pbc size: " << encoded.size() / 1024 << "K of "
+                  << image.size() / 1024 << "K" << std::endl;
+        return 0;
+    }
+    catch (boost::exception& e)
+    {
+        std::cerr << diagnostic_information(e) << std::endl;
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+    }
+    return 1;
+}
+
 void usage(void)
 {
     std::cerr
@@ -195,24 +753,102 @@ void usage(void)
 #endif /* DEVELOPER_OPTIONS */
            "       mtd-util [-v] [-d <mtd-device>] c[p] file offset\n"
            "       mtd-util [-v] [-d <mtd-device>] [-f] c[p] offset file len\n"
-           "       mtd-util [-v] [-d <mtd-device>] d[ump] offset [len]\n"
-           "       mtd-util [-v] [-d <mtd-device>] p[fr] a[uthenticate] file\n"
+           "       mtd-util [-v] [-d <mtd-device>] d[ump] [--xxd|--raw] "
+           "[--squeeze] offset [len]\n"
+           "       mtd-util [-v] [-d <mtd-device>] p[fr] a[uthenticate] "
+           "[--quick] file [file ...]\n"
            "       mtd-util [-v] [-d <mtd-device>] p[fr] s[tage] file\n"
+           "       mtd-util [-v] [-d <mtd-device>] p[fr] a[uthenticate] -\n"
+           "       mtd-util [-v] [-d <mtd-device>] p[fr] s[tage] -\n"
            "       mtd-util [-v] [-d <mtd-device>] s[ecure_boot] file offset\n"
            "[offset]\n"
-           "       mtd-util [-v] [-d <mtd-device>] [-r] p[fr] w[rite] file "
+           "       mtd-util [-v] [-d <mtd-device>] [--timing=profile] "
+           "--dry-run s[ecure_boot] file [offset]\n"
+           "       mtd-util [-v] [-d <mtd-device>] [-r] [-V] p[fr] w[rite] "
+           "file [offset]\n"
+           "       mtd-util [-v] [-d <mtd-device>] [-r] [--timing=profile] "
+           "--dry-run p[fr] w[rite] file [offset]\n"
+           "       mtd-util [-v] [-d <mtd-device>] [-r] [-V] --plan=plan "
+           "p[fr] w[rite] file [offset]\n"
+           "       mtd-util [-v] [-r] [-f] p[fr] p[lan] file plan\n"
+           "       mtd-util [-v] [-f] p[fr] e[ncode] image regions pbc\n"
+           "       mtd-util [-v] [-f] p[fr] d[elta] old-image image regions "
+           "pbc\n"
+           "       mtd-util [-v] [-k] [-d <mtd-device>] p[fr] v[erify] file "
            "[offset]\n"
+           "       mtd-util [-v] [-d <mtd-device>] i[ndex] [threads]\n"
+           "       mtd-util [-v] [-d <mtd-device>] [-f] snapshot file\n"
+           "       mtd-util [-v] [-d <mtd-device>] [-i] restore file\n"
+           "       mtd-util [--timing=profile] replay [--print] trace "
+           "[image]\n"
+           "       mtd-util [-v] -d <mtd-device> -d <mtd-device> [...] "
+           "c[p] file offset\n"
+           "       mtd-util [-v] -d <mtd-device> -d <mtd-device> [...] "
+           "[-r] [-V] p[fr] w[rite] file [offset]\n"
            "            * for ease of use, commands can be abbreviated\n"
            "              to the first letter of the command: c, d, p, etc.\n"
+           "              (except snapshot, restore and replay)\n"
            "            * -v for verbose, can be used multiple times\n"
            "            * mtd-device defaults to /dev/mtd0\n"
+           "            * with several -d, all devices are written "
+           "concurrently\n"
            "            * all addresses, offsets, and values are in hex\n"
            "            * dump len defaults to 256 bytes\n"
+           "            * --xxd dumps in xxd format, --raw writes the bytes\n"
+           "              as they are; --squeeze prints a run of identical\n"
+           "              lines as a single '*'\n"
            "            * cp to flash does read/erase/cp/write to preserve "
            "flash\n"
+           "            * cp to file streams the range, to stdout for '-'\n"
            "            * erase rounds to nearest 4kB boundaries\n"
            "            * -f allows a forced overwrite of an existing file\n"
-           "            * -r reset erase-only regions for PFR write\n";
+           "            * snapshots leave out erased blocks; restore erases\n"
+           "              in coalesced runs and skips blank pages\n"
+           "            * -r reset erase-only regions for PFR write\n"
+           "            * -V verify signed regions after PFR write\n"
+           "            * pfr authenticate and stage read the capsule from\n"
+           "              stdin for '-' and stream pipes and sockets\n"
+           "            * cp to flash, pfr authenticate and stage accept\n"
+           "              gzip, bzip2, zstd and zlib (.zz) compressed\n"
+           "              input, decompressed as it is read\n"
+           "            * --quick checks capsule headers and signatures but\n"
+           "              not the hash of the content, also when it is\n"
+           "              streamed\n"
+           "            * several capsules are authenticated in parallel\n"
+           "            * -i skip unchanged and already erased blocks using\n"
+           "              the block index, rebuilt with the index command\n"
+           "            * -k hash with the kernel crypto API (AF_ALG), which\n"
+           "              can use a hash engine; falls back to OpenSSL.\n"
+           "              Applies to every command that authenticates a\n"
+           "              capsule or verifies flash, not only pfr verify\n"
+           "            * -a remember successful capsule authentications\n"
+           "              in " PFR_AUTH_CACHE_DIR " so later commands on\n"
+           "              the unchanged file only check the signatures\n"
+           "            * --stats prints counts and latencies of flash\n"
+           "              reads, programs and erases at exit;\n"
+           "              --stats=file writes them to file as JSON\n"
+           "            * --record=file records every flash read, program\n"
+           "              and erase (address, length, data hash, time)\n"
+           "            * replay repeats a recorded trace against an\n"
+           "              emulated device image, or memory without one,\n"
+           "              and compares recorded, replayed and modelled\n"
+           "              times; --print lists the operations instead\n"
+           "            * --dry-run goes through pfr write or secure_boot\n"
+           "              without erasing or programming anything and\n"
+           "              prints the erase and program runs, the number\n"
+           "              of 64K erases, bytes programmed, unsigned blocks\n"
+           "              skipped and the estimated time\n"
+           "            * --timing=profile sets the flash timing model\n"
+           "            * pfr plan saves the erase and program runs pfr\n"
+           "              write derives from the capsule, with -r for\n"
+           "              pfr write -r; --plan=plan makes pfr write follow\n"
+           "              them instead of walking the pbc bitmaps\n"
+           "            * pfr encode writes the pbc (header, bitmaps and\n"
+           "              payload) for a raw flash image; regions holds\n"
+           "              'start end [erase]' lines, blank pages of copy\n"
+           "              regions are only erased\n"
+           "            * pfr delta only erases and copies the 64K blocks\n"
+           "              of copy regions that differ from old-image\n";
     exit(1);
 }
 
@@ -225,27 +861,77 @@ int main(int argc, char* argv[])
     struct stat sb;
     size_t start = 0, len = 0;
     int ret = 0;
+    std::unique_ptr<input_stream> input;
 #ifdef DEVELOPER_OPTIONS
     uint8_t* buf = NULL;
 #endif
     char* endptr;
     std::string flash_dev;
+    std::vector<std::string> flash_devs;
     std::string filename;
+    std::vector<std::string> filenames;
     int optind = 1; /* skip argv[0] */
     bool force_overwrite = false;
     bool recovery_reset = false;
+    bool verify = false;
+    bool quick = false;
+    bool use_index = false;
+    dump_format format = dump_format::classic;
+    bool squeeze = false;
+    bool print = false;
+    bool dry_run = false;
+    std::string timing_profile;
+    std::string plan_file;
+    std::string regions_file;
+    std::string output;
+    std::string old_image;
+    std::string image;
+    size_t workers = default_worker_count();
     ACTION action = ACTION_NONE;
     dbg_level verbosity = PRINT_ERROR;
 
     while (optind < argc && argv[optind][0] == '-')
     {
-        if (argv[optind][1] == 'd')
+        if (!strcmp(argv[optind], "--stats"))
+        {
+            mtd_stats_report_at_exit("");
+        }
+        else if (!strncmp(argv[optind], "--stats=", 8))
+        {
+            mtd_stats_report_at_exit(argv[optind] + 8);
+        }
+        else if (!strncmp(argv[optind], "--record=", 9))
+        {
+            try
+            {
+                op_trace_start(argv[optind] + 9);
+            }
+            catch (boost::exception& e)
+            {
+                std::cerr << diagnostic_information(e) << std::endl;
+                return 1;
+            }
+        }
+        else if (!strncmp(argv[optind], "--timing=", 9))
+        {
+            timing_profile = argv[optind] + 9;
+        }
+        else if (!strncmp(argv[optind], "--plan=", 7))
+        {
+            plan_file = argv[optind] + 7;
+        }
+        else if (!strcmp(argv[optind], "--dry-run"))
+        {
+            dry_run = true;
+        }
+        else if (argv[optind][1] == 'd')
         {
             flash_dev = argv[++optind];
             if (flash_dev == active_device)
                 flash_dev = locate_active_device();
             else if (flash_dev == backup_device)
                 flash_dev = locate_backup_device();
+            flash_devs.push_back(flash_dev);
         }
         else if (argv[optind][1] == 'f')
         {
@@ -255,6 +941,22 @@ int main(int argc, char* argv[])
         {
             recovery_reset = true;
         }
+        else if (argv[optind][1] == 'i')
+        {
+            use_index = true;
+        }
+        else if (argv[optind][1] == 'V')
+        {
+            verify = true;
+        }
+        else if (argv[optind][1] == 'k')
+        {
+            set_digest_backend(digest_backend::kernel);
+        }
+        else if (argv[optind][1] == 'a')
+        {
+            pfr_set_auth_cache(true);
+        }
         else if (argv[optind][1] == 'v')
         {
             verbosity = static_cast<dbg_level>(static_cast<int>(verbosity) + 1);
@@ -264,12 +966,49 @@ int main(int argc, char* argv[])
     if (flash_dev.length() == 0)
         flash_dev = default_device;
 
-    if ((optind + 2) > argc)
+    /* index is the only command that takes no arguments */
+    if (optind >= argc || ((optind + 2) > argc && argv[optind][0] != 'i'))
         usage();
 
     fw_update_set_dbg_level(verbosity);
 
-    if (argv[optind][0] == 'c')
+    /* snapshot and restore are not abbreviated (s is secure_boot) */
+    if (!strcmp(argv[optind], "snapshot"))
+    {
+        action = ACTION_SNAPSHOT;
+        filename = argv[++optind];
+        if (!force_overwrite && stat(filename.c_str(), &sb) == 0)
+        {
+            std::cerr << filename << " exists, cowardly refusing to overwrite"
+                      << std::endl;
+            return 1;
+        }
+    }
+    else if (!strcmp(argv[optind], "restore"))
+    {
+        action = ACTION_RESTORE;
+        filename = argv[++optind];
+    }
+    else if (!strcmp(argv[optind], "replay"))
+    {
+        action = ACTION_REPLAY;
+        optind++;
+        if (!strcmp(argv[optind], "--print"))
+        {
+            print = true;
+            optind++;
+        }
+        if (optind >= argc)
+        {
+            usage();
+        }
+        filename = argv[optind++];
+        if (optind < argc)
+        {
+            image = argv[optind];
+        }
+    }
+    else if (argv[optind][0] == 'c')
     {
         optind++;
         // printf("cp mode, optind = %d, argc = %d\n", optind, argc);
@@ -307,7 +1046,7 @@ int main(int argc, char* argv[])
             // puts("file to flash");
             /* file to flash mode */
             action = ACTION_CP_TO_FLASH;
-            if (stat(argv[optind], &sb) < 0)
+            if (strcmp(argv[optind], "-") && stat(argv[optind], &sb) < 0)
             {
                 std::cerr << argv[optind] << " does not exist" << std::endl;
                 return 1;
@@ -393,6 +1132,21 @@ int main(int argc, char* argv[])
         action = ACTION_DUMP;
         optind++;
         len = 256;
+        for (; optind < argc && strncmp(argv[optind], "--", 2) == 0; optind++)
+        {
+            if (strcmp(argv[optind], "--xxd") == 0)
+                format = dump_format::xxd;
+            else if (strcmp(argv[optind], "--raw") == 0)
+                format = dump_format::raw;
+            else if (strcmp(argv[optind], "--squeeze") == 0)
+                squeeze = true;
+            else
+                usage();
+        }
+        if (optind >= argc)
+        {
+            usage();
+        }
         start = strtoul(argv[optind], &endptr, 16);
         if (*endptr)
         {
@@ -422,6 +1176,14 @@ int main(int argc, char* argv[])
         if (argv[optind][0] == 'a')
         {
             action = ACTION_PFR_AUTH;
+            if (strcmp(argv[optind + 1], "--quick") == 0)
+            {
+                quick = true;
+                if ((++optind + 2) > argc)
+                {
+                    usage();
+                }
+            }
         }
         else if (argv[optind][0] == 's')
         {
@@ -431,9 +1193,69 @@ int main(int argc, char* argv[])
         {
             action = ACTION_PFR_WRITE;
         }
+        else if (argv[optind][0] == 'v')
+        {
+            action = ACTION_PFR_VERIFY;
+        }
+        else if (argv[optind][0] == 'p')
+        {
+            action = ACTION_PFR_PLAN;
+        }
+        else if (argv[optind][0] == 'e')
+        {
+            action = ACTION_PFR_ENCODE;
+        }
+        else if (argv[optind][0] == 'd')
+        {
+            action = ACTION_PFR_DELTA;
+        }
         optind++;
         filename = argv[optind];
-        if ((optind + 1) < argc)
+        if (action == ACTION_PFR_AUTH)
+        {
+            filenames.assign(argv + optind, argv + argc);
+        }
+        else if (action == ACTION_PFR_PLAN)
+        {
+            if ((optind + 2) != argc)
+            {
+                usage();
+            }
+            plan_file = argv[++optind];
+            if (!force_overwrite && stat(plan_file.c_str(), &sb) == 0)
+            {
+                std::cerr << plan_file
+                          << " exists, cowardly refusing to overwrite"
+                          << std::endl;
+                return 1;
+            }
+        }
+        else if (action == ACTION_PFR_ENCODE || action == ACTION_PFR_DELTA)
+        {
+            if (action == ACTION_PFR_DELTA)
+            {
+                if ((optind + 4) != argc)
+                {
+                    usage();
+                }
+                old_image = filename;
+                filename = argv[++optind];
+            }
+            else if ((optind + 3) != argc)
+            {
+                usage();
+            }
+            regions_file = argv[++optind];
+            output = argv[++optind];
+            if (!force_overwrite && stat(output.c_str(), &sb) == 0)
+            {
+                std::cerr << output
+                          << " exists, cowardly refusing to overwrite"
+                          << std::endl;
+                return 1;
+            }
+        }
+        else if ((optind + 1) < argc)
         {
             optind++;
             start = strtoul(argv[optind], &endptr, 16);
@@ -454,18 +1276,94 @@ int main(int argc, char* argv[])
             start = strtoul(argv[optind], &endptr, 16);
         }
     }
+    else if (argv[optind][0] == 'i')
+    {
+        action = ACTION_INDEX;
+        use_index = true;
+        optind++;
+        if (optind < argc)
+        {
+            workers = strtoul(argv[optind], &endptr, 10);
+            if (*endptr || !workers)
+            {
+                std::cerr << "failed to parse '" << argv[optind]
+                          << "' as thread count" << std::endl;
+                return 1;
+            }
+        }
+    }
     else
     {
         usage();
     }
-#ifdef MTD_EMULATION
-    mtd<file_mtd_emulation> dev;
-#else
-    mtd<hw_mtd> dev;
-#endif
+    if ((flash_devs.size() > 1 || action == ACTION_PFR_WRITE ||
+         action == ACTION_PFR_VERIFY || action == ACTION_PFR_PLAN ||
+         action == ACTION_PFR_ENCODE || action == ACTION_PFR_DELTA ||
+         action == ACTION_SECURE_BOOT_IMAGE_WRITE) &&
+        (filename == "-" || file_compression(filename) != compression::none))
+    {
+        std::cerr << filename
+                  << ": compressed or piped input is only supported by cp to "
+                     "flash, pfr authenticate and pfr stage"
+                  << std::endl;
+        return 1;
+    }
+    if (action == ACTION_REPLAY)
+    {
+        return replay_trace(filename, image, timing_profile, print);
+    }
+    if (action == ACTION_PFR_PLAN)
+    {
+        return make_update_plan(filename, plan_file, recovery_reset);
+    }
+    if (action == ACTION_PFR_ENCODE || action == ACTION_PFR_DELTA)
+    {
+        return encode_pbc(filename, old_image, regions_file, output, workers);
+    }
+    std::unique_ptr<update_plan> plan;
+    if (!plan_file.empty())
+    {
+        if (action != ACTION_PFR_WRITE)
+        {
+            std::cerr << "--plan is only used by pfr write" << std::endl;
+            return 1;
+        }
+        try
+        {
+            plan = std::make_unique<update_plan>(update_plan::load(plan_file));
+        }
+        catch (boost::exception& e)
+        {
+            std::cerr << diagnostic_information(e) << std::endl;
+            return 1;
+        }
+    }
+    if (dry_run)
+    {
+        if (flash_devs.size() > 1)
+        {
+            std::cerr << "--dry-run takes a single device" << std::endl;
+            return 1;
+        }
+        return dry_run_update(flash_dev, action, filename, start,
+                              recovery_reset, timing_profile, plan.get());
+    }
+    if (filenames.size() > 1)
+    {
+        return batch_authenticate(filenames, !recovery_reset, quick);
+    }
+    if (flash_devs.size() > 1)
+    {
+        return multi_target_update(flash_devs, action, filename, start,
+                                   recovery_reset, verify, use_index,
+                                   plan.get());
+    }
+    mtd_type dev;
     try
     {
         dev.open(flash_dev);
+        if (use_index)
+            dev.open_index(block_index::default_path(flash_dev));
 
         switch (action)
         {
@@ -479,22 +1377,67 @@ int main(int argc, char* argv[])
                 break;
 #endif /* DEVELOPER_OPTIONS */
             case ACTION_CP_TO_FLASH:
-                ret = cp_to_flash(dev, filename, start);
+                if ((input = input_stream::open(filename)))
+                {
+                    ret = cp_to_flash(dev, *input, start);
+                }
+                else
+                {
+                    ret = cp_to_flash(dev, filename, start);
+                }
                 break;
             case ACTION_CP_TO_FILE:
                 ret = cp_to_file(dev, filename, start, len);
                 break;
             case ACTION_DUMP:
-                ret = dump_flash(dev, start, len);
+                ret = dump_flash(dev, start, len, format, squeeze);
                 break;
             case ACTION_PFR_AUTH:
-                ret = !pfr_authenticate(filename, !recovery_reset);
+                if ((input = input_stream::open(filename)))
+                {
+                    ret = !pfr_authenticate_stream(
+                              input->fd(), !recovery_reset, nullptr, quick) ||
+                          !input->finish();
+                }
+                else
+                {
+                    ret = !pfr_authenticate(filename, !recovery_reset, quick);
+                }
                 break;
             case ACTION_PFR_STAGE:
-                ret = !pfr_stage(dev, filename, start);
+                if ((input = input_stream::open(filename)))
+                {
+                    ret = !pfr_stage(dev, input->fd(), start,
+                                     [&] { return input->finish(); });
+                }
+                else
+                {
+                    ret = !pfr_stage(dev, filename, start);
+                }
                 break;
             case ACTION_PFR_WRITE:
-                ret = !pfr_write(dev, filename, start, recovery_reset);
+            {
+                pfr_image image(filename);
+                ret = !image.authenticate(!recovery_reset) ||
+                      !pfr_write(dev, image, start, recovery_reset,
+                                 plan.get());
+                if (!ret && verify)
+                {
+                    ret = !pfr_verify(dev, image, start);
+                }
+                break;
+            }
+            case ACTION_PFR_VERIFY:
+                ret = !pfr_verify(dev, filename, start);
+                break;
+            case ACTION_INDEX:
+                ret = index_flash(dev, workers);
+                break;
+            case ACTION_SNAPSHOT:
+                ret = snapshot_flash(dev, filename);
+                break;
+            case ACTION_RESTORE:
+                ret = restore_flash(dev, filename);
                 break;
             case ACTION_SECURE_BOOT_IMAGE_WRITE:
                 ret = !secure_boot_image_update(dev, filename, start);
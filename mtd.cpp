@@ -33,6 +33,8 @@
 #include "debug.h"
 #include "exceptions.h"
 #include "mtd.h"
+#include "probes.h"
+#include "trace.h"
 #include "util.h"
 
 #define SMALL_PER_BIG_BLOCKS (BIG_BLOCK_SIZE / SMALL_BLOCK_SIZE)
@@ -65,12 +67,23 @@ int hw_mtd::open(const std::string& path)
     return _fd;
 }
 
+int hw_mtd::read(uint32_t addr, uint8_t* out_buf, size_t len)
+{
+    // positional read, so that several threads may read one device
+    int br = ::pread(_fd, out_buf, len, addr);
+    if (br < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno));
+    return br;
+}
+
 void hw_mtd::erase(uint32_t addr, size_t len)
 {
     FWDEBUG2("addr: " << std::hex << addr << ", len: " << len);
     erase_info_t eraser;
     eraser.start = addr;
     eraser.length = len;
+    // an erase can block for seconds; do not hold messages back over it
+    fw_update_log_flush();
     if (ioctl(_fd, MEMERASE, &eraser) < 0)
         THROW(FileIOError() << boost::errinfo_errno(errno));
 }
@@ -118,6 +131,14 @@ int file_mtd_emulation::open(const std::string& path)
     return _fd;
 };
 
+int file_mtd_emulation::read(uint32_t addr, uint8_t* out_buf, size_t len)
+{
+    int br = ::pread(_fd, out_buf, len, addr);
+    if (br < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno));
+    return br;
+}
+
 void file_mtd_emulation::erase(uint32_t addr, size_t len)
 {
     int br;
@@ -156,6 +177,32 @@ int file_mtd_emulation::write_raw(uint32_t addr, const cbspan& in_buf)
     return br;
 }
 
+int ram_mtd::read(uint32_t addr, uint8_t* out_buf, size_t len)
+{
+    if (addr > _data.size())
+        THROW(FileIOError() << boost::errinfo_errno(EINVAL));
+    len = std::min(len, _data.size() - addr);
+    std::copy_n(_data.begin() + addr, len, out_buf);
+    return len;
+}
+
+void ram_mtd::erase(uint32_t addr, size_t len)
+{
+    if (addr > _data.size() || len > _data.size() - addr)
+        THROW(FileIOError() << boost::errinfo_errno(EINVAL));
+    std::fill_n(_data.begin() + addr, len, 0xff);
+}
+
+// programming can only clear bits, like the emulation above
+int ram_mtd::write_raw(uint32_t addr, const cbspan& in_buf)
+{
+    if (addr > _data.size() || in_buf.size() > _data.size() - addr)
+        THROW(FileIOError() << boost::errinfo_errno(EINVAL));
+    std::transform(in_buf.begin(), in_buf.end(), _data.begin() + addr,
+                   _data.begin() + addr, std::bit_and<uint8_t>());
+    return in_buf.size();
+}
+
 template <typename deviceClassT>
 mtd<deviceClassT>::mtd() : _impl(), _path(), _fd(-1)
 {
@@ -179,6 +226,78 @@ void mtd<deviceClassT>::open(const std::string& path)
     FWINFO(_path << ": " << (_impl.size() >> 20) << "MB");
 }
 
+template <typename deviceClassT>
+void mtd<deviceClassT>::open_index(const std::string& index_path)
+{
+    _index = std::make_unique<block_index>();
+    _index->open(index_path, _impl.size(), erase_block_size());
+}
+
+template <typename deviceClassT>
+void mtd<deviceClassT>::rebuild_index(size_t workers)
+{
+    if (!_index)
+        THROW(InvalidMtdDevice() << msg_info("no index"));
+    // read a few blocks at a time, large enough to keep the flash busy
+    size_t block_size = _index->block_size();
+    size_t chunk_blocks = std::max<size_t>(1, BIG_BLOCK_SIZE * 16 / block_size);
+    size_t chunks = (_index->blocks() + chunk_blocks - 1) / chunk_blocks;
+    parallel_for(chunks, workers, [&](size_t chunk) {
+        size_t first = chunk * chunk_blocks;
+        size_t count = std::min(chunk_blocks, _index->blocks() - first);
+        std::vector<uint8_t> buf(count * block_size);
+        if (mtd::read(first * block_size, buf) != static_cast<int>(buf.size()))
+            THROW(FileIOError() << msg_info("short read"));
+        for (size_t b = 0; b < count; b++)
+            _index->update(first + b,
+                           cbspan(buf.data() + b * block_size, block_size));
+    });
+    _index->flush();
+    FWINFO(_path << ": indexed " << _index->blocks() << " blocks");
+}
+
+template <typename deviceClassT>
+bool mtd<deviceClassT>::block_unchanged(uint32_t addr, const cbspan& buf)
+{
+    // what mtd-util wrote this boot is trusted; any other hash match is
+    // only a hint, as the flash may have been written by something else
+    // since, but a mismatch is enough to rewrite the block
+    if (_index->is_written(addr, buf.size()))
+        return _index->matches(addr, buf);
+    if (_index->is_valid(addr, buf.size()) && !_index->matches(addr, buf))
+        return false;
+    size_t block_size = _index->block_size();
+    if ((addr % block_size) || (buf.size() % block_size))
+        return false;
+    std::vector<uint8_t> current(buf.size());
+    if (mtd::read(addr, current) != static_cast<int>(current.size()))
+        return false;
+    for (size_t off = 0; off < current.size(); off += block_size)
+        _index->update((addr + off) / block_size,
+                       cbspan(current.data() + off, block_size));
+    return std::equal(current.begin(), current.end(), buf.begin(), buf.end());
+}
+
+template <typename deviceClassT>
+bool mtd<deviceClassT>::block_erased(uint32_t addr, size_t len)
+{
+    if (!_index->is_erased(addr, len))
+        return false;
+    if (_index->is_written(addr, len))
+        return true;
+    std::vector<uint8_t> current(len);
+    if (mtd::read(addr, current) != static_cast<int>(current.size()))
+        return false;
+    if (is_blank(current.data(), current.size()))
+        return true;
+    FWWARN(_path << ": index is stale at " << std::hex << addr);
+    size_t block_size = _index->block_size();
+    for (size_t off = 0; off < current.size(); off += block_size)
+        _index->update((addr + off) / block_size,
+                       cbspan(current.data() + off, block_size));
+    return false;
+}
+
 template <typename deviceClassT>
 mtd<deviceClassT>::~mtd()
 {
@@ -189,18 +308,24 @@ mtd<deviceClassT>::~mtd()
 template <typename deviceClassT>
 int mtd<deviceClassT>::read(uint32_t addr, std::vector<uint8_t>& out_buf)
 {
-    int br;
-    if (lseek(_fd, addr, SEEK_SET) < 0)
-        THROW(FileIOError() << boost::errinfo_errno(errno));
-    br = ::read(_fd, out_buf.data(), out_buf.size());
-    if (br < 0)
-        THROW(FileIOError() << boost::errinfo_errno(errno));
+    MTD_UTIL_PROBE(read_start, addr, out_buf.size());
+    int br = -1;
+    probe_done done(
+        [&] { MTD_UTIL_PROBE(read_done, addr, out_buf.size(), br); });
+    br = _impl.read(addr, out_buf.data(), out_buf.size());
     return br;
 }
 
 template <typename deviceClassT>
 int mtd<deviceClassT>::write(uint32_t addr, const cbspan& in_buf)
 {
+    TRACE_SPAN("flash", "write", addr, in_buf.size());
+    MTD_UTIL_PROBE(write_start, addr, in_buf.size());
+    [[maybe_unused]] int result = -1;
+    // addr moves on as blocks are written
+    probe_done done([&result, addr, len = in_buf.size()] {
+        MTD_UTIL_PROBE(write_done, addr, len, result);
+    });
     unsigned int buf_idx;
     unsigned int first_block, last_block;
     size_t end, len = in_buf.size();
@@ -215,6 +340,7 @@ int mtd<deviceClassT>::write(uint32_t addr, const cbspan& in_buf)
     {
         FWCRITICAL("not enough space to write "
                    << in_buf.size() << " bytes at offset " << std::hex << addr);
+        result = 3;
         return 3;
     }
     first_block = (addr & ~SMALL_BLOCK_MASK) / SMALL_BLOCK_SIZE;
@@ -312,25 +438,50 @@ int mtd<deviceClassT>::write(uint32_t addr, const cbspan& in_buf)
             std::copy(&buf[buf_idx], &buf[buf_idx + block_size],
                       std::begin(buffer));
         }
-        erase(block_addr, block_size);
-        write_raw(block_addr, buffer);
+        if (_index && block_unchanged(block_addr, buffer))
+        {
+            FWDEBUG2("block " << std::hex << block_addr << " unchanged");
+        }
+        else
+        {
+            if (!_index || !block_erased(block_addr, block_size))
+                erase(block_addr, block_size);
+            write_raw(block_addr, buffer);
+        }
         addr = block_addr + block_size;
         buf_idx += ci_len;
     }
     FWDEBUG("cleaning up.  Copied " << std::dec << buf_idx << " (" << std::hex
                                     << buf_idx << ") bytes");
+    result = 0;
     return 0;
 }
 
 template <typename deviceClassT>
 int mtd<deviceClassT>::write_raw(uint32_t addr, const cbspan& in_buf)
 {
-    return _impl.write_raw(addr, in_buf);
+    TRACE_SPAN("flash", "program", addr, in_buf.size());
+    MTD_UTIL_PROBE(program_start, addr, in_buf.size());
+    int br = -1;
+    probe_done done(
+        [&] { MTD_UTIL_PROBE(program_done, addr, in_buf.size(), br); });
+    if (!_index)
+    {
+        br = _impl.write_raw(addr, in_buf);
+    }
+    else
+    {
+        auto prior = _index->begin(addr, in_buf.size());
+        br = _impl.write_raw(addr, in_buf);
+        _index->commit_program(addr, in_buf, prior);
+    }
+    return br;
 }
 
 template <typename deviceClassT>
 void mtd<deviceClassT>::erase(uint32_t addr, size_t len)
 {
+    TRACE_SPAN("flash", "erase", addr, len);
     FWDEBUG2("addr: " << std::hex << addr << ", len: " << len);
     if (_impl.is_4k())
     {
@@ -350,31 +501,47 @@ void mtd<deviceClassT>::erase(uint32_t addr, size_t len)
         }
         len = block_round(len, BIG_BLOCK_SIZE);
     }
+    MTD_UTIL_PROBE(erase_start, addr, len);
+    [[maybe_unused]] int result = -1;
+    probe_done done([&] { MTD_UTIL_PROBE(erase_done, addr, len, result); });
+    if (_index)
+        _index->begin(addr, len);
     _impl.erase(addr, len);
+    if (_index)
+        _index->commit_erase(addr, len);
+    result = 0;
     FWDEBUG2(std::hex << "erased " << addr << " +" << len);
 }
 
 #ifdef MTD_EMULATION
+typedef instrumented<file_mtd_emulation> mtd_device;
+typedef dry_run<file_mtd_emulation> dry_run_device;
+#else  /* ! MTD_EMULATION */
+typedef instrumented<hw_mtd> mtd_device;
+typedef dry_run<hw_mtd> dry_run_device;
+#endif /* MTD_EMULATION */
 
 /* forward declarations of templated types */
-template mtd<file_mtd_emulation>::mtd();
-template mtd<file_mtd_emulation>::~mtd();
-template void mtd<file_mtd_emulation>::open(const std::string& path);
-template int mtd<file_mtd_emulation>::read(uint32_t addr,
-                                           std::vector<uint8_t>& out_buf);
-template int mtd<file_mtd_emulation>::write(uint32_t addr,
+template mtd<mtd_device>::mtd();
+template mtd<mtd_device>::~mtd();
+template void mtd<mtd_device>::open(const std::string& path);
+template void mtd<mtd_device>::open_index(const std::string& index_path);
+template void mtd<mtd_device>::rebuild_index(size_t workers);
+template int mtd<mtd_device>::read(uint32_t addr,
+                                   std::vector<uint8_t>& out_buf);
+template int mtd<mtd_device>::write(uint32_t addr, const cbspan& in_buf);
+template int mtd<mtd_device>::write_raw(uint32_t addr, const cbspan& in_buf);
+template void mtd<mtd_device>::erase(uint32_t addr, size_t len);
+template bool mtd<mtd_device>::block_unchanged(uint32_t addr,
+                                               const cbspan& buf);
+template bool mtd<mtd_device>::block_erased(uint32_t addr, size_t len);
+template size_t mtd<mtd_device>::size(void) const;
+
+template mtd<dry_run_device>::mtd();
+template mtd<dry_run_device>::~mtd();
+template void mtd<dry_run_device>::open(const std::string& path);
+template int mtd<dry_run_device>::read(uint32_t addr,
+                                       std::vector<uint8_t>& out_buf);
+template int mtd<dry_run_device>::write_raw(uint32_t addr,
                                             const cbspan& in_buf);
-template int mtd<file_mtd_emulation>::write_raw(uint32_t addr,
-                                                const cbspan& in_buf);
-template void mtd<file_mtd_emulation>::erase(uint32_t addr, size_t len);
-template size_t mtd<file_mtd_emulation>::size(void) const;
-#else  /* ! MTD_EMULATION */
-template mtd<hw_mtd>::mtd();
-template mtd<hw_mtd>::~mtd();
-template void mtd<hw_mtd>::open(const std::string& path);
-template int mtd<hw_mtd>::read(uint32_t addr, std::vector<uint8_t>& out_buf);
-template int mtd<hw_mtd>::write(uint32_t addr, const cbspan& in_buf);
-template int mtd<hw_mtd>::write_raw(uint32_t addr, const cbspan& in_buf);
-template void mtd<hw_mtd>::erase(uint32_t addr, size_t len);
-template size_t mtd<hw_mtd>::size(void) const;
-#endif /* MTD_EMULATION */
+template void mtd<dry_run_device>::erase(uint32_t addr, size_t len);
@@ -23,6 +23,9 @@
 #include <string>
 #include <vector>
 
+#include "block-index.h"
+#include "flash-plan.h"
+#include "mtd-stats.h"
 #include "util.h" // cbspan type
 
 #define BIG_BLOCK_SIZE (64 * 1024)
@@ -54,6 +57,7 @@ class hw_mtd
     }
 
     int open(const std::string& path);
+    int read(uint32_t addr, uint8_t* out_buf, size_t len);
     void erase(uint32_t addr, size_t len);
     int write_raw(uint32_t addr, const cbspan& in_buf);
 
@@ -93,6 +97,7 @@ class file_mtd_emulation
     }
 
     int open(const std::string& path);
+    int read(uint32_t addr, uint8_t* out_buf, size_t len);
     void erase(uint32_t addr, size_t len);
     int write_raw(uint32_t addr, const cbspan& in_buf);
 
@@ -110,6 +115,97 @@ class file_mtd_emulation
     }
 };
 
+/* device held in memory, with NOR semantics, for replays and planning */
+class ram_mtd
+{
+  protected:
+    std::vector<uint8_t> _data;
+    bool _is_4k;
+
+  public:
+    explicit ram_mtd(size_t size = DEFAULT_MTD_EMU_SZ) :
+        _data(size, 0xff), _is_4k(mtd_use_4k_sectors)
+    {
+    }
+
+    int read(uint32_t addr, uint8_t* out_buf, size_t len);
+    void erase(uint32_t addr, size_t len);
+    int write_raw(uint32_t addr, const cbspan& in_buf);
+
+    int erase_size() const
+    {
+        return (64 * 1024);
+    }
+    size_t size() const
+    {
+        return _data.size();
+    }
+    int is_4k() const
+    {
+        return _is_4k;
+    }
+};
+
+/*
+ * Device class decorator: times every read, program and erase of the
+ * device class below it into mtd_stats and the operation trace, when
+ * either is enabled
+ */
+template <typename deviceClassT>
+class instrumented : public deviceClassT
+{
+  public:
+    int read(uint32_t addr, uint8_t* out_buf, size_t len)
+    {
+        mtd_op_timer timer(mtd_op::read, addr, len);
+        int br = deviceClassT::read(addr, out_buf, len);
+        timer.data(out_buf, br);
+        return br;
+    }
+    void erase(uint32_t addr, size_t len)
+    {
+        mtd_op_timer timer(mtd_op::erase, addr, len);
+        deviceClassT::erase(addr, len);
+    }
+    int write_raw(uint32_t addr, const cbspan& in_buf)
+    {
+        mtd_op_timer timer(mtd_op::program, addr, in_buf.size());
+        timer.data(in_buf.data(), in_buf.size());
+        return deviceClassT::write_raw(addr, in_buf);
+    }
+};
+
+/*
+ * Device class decorator for dry runs: the device class below is opened
+ * for its geometry and still serves reads, but erases and programs only
+ * go into a flash_plan
+ */
+template <typename deviceClassT>
+class dry_run : public deviceClassT
+{
+  public:
+    void erase(uint32_t addr, size_t len)
+    {
+        _plan.erase(addr, len);
+    }
+    int write_raw(uint32_t addr, const cbspan& in_buf)
+    {
+        _plan.program(addr, in_buf);
+        return in_buf.size();
+    }
+    void skip_unsigned(uint32_t addr, size_t len)
+    {
+        _plan.skip_unsigned(addr, len);
+    }
+    const flash_plan& plan() const
+    {
+        return _plan;
+    }
+
+  private:
+    flash_plan _plan;
+};
+
 template <typename deviceClassT>
 class mtd
 {
@@ -117,6 +213,7 @@ class mtd
     deviceClassT _impl;
     std::string _path;
     int _fd;
+    std::unique_ptr<block_index> _index;
 
   public:
     typedef std::shared_ptr<mtd> ptr;
@@ -128,6 +225,10 @@ class mtd
 
     /* after creating, one must call open, which may throw things */
     void open(const std::string& path);
+    /* optionally track block contents in an index file (after open) */
+    void open_index(const std::string& index_path);
+    /* re-read the whole device to rebuild the index */
+    void rebuild_index(size_t workers);
 
     /* read into a buffer out_buf.size() bytes */
     int read(uint32_t addr, std::vector<uint8_t>& out_buf);
@@ -136,6 +237,18 @@ class mtd
     /* write without an erase */
     int write_raw(uint32_t addr, const cbspan& in_buf);
     void erase(uint32_t addr, size_t len);
+    /* with an index: true if addr already holds buf; the index decides
+     * for blocks mtd-util wrote this boot and when it shows the block
+     * differs, otherwise the block is read back */
+    bool block_unchanged(uint32_t addr, const cbspan& buf);
+    /* with an index: true if the index shows the range erased, and for
+     * blocks mtd-util did not erase this boot, a read back agrees */
+    bool block_erased(uint32_t addr, size_t len);
+    /* what erase rounds to, and the block size of the index */
+    size_t erase_block_size(void) const
+    {
+        return _impl.is_4k() ? SMALL_BLOCK_SIZE : BIG_BLOCK_SIZE;
+    }
     size_t erase_size(void) const
     {
         return _impl.erase_size();
@@ -148,14 +261,33 @@ class mtd
     {
         return _impl.is_4k();
     }
+    const block_index* index(void) const
+    {
+        return _index.get();
+    }
+    /* report an erase left out because it is in an unsigned region; only
+     * dry_run device classes keep it */
+    void skip_unsigned(uint32_t addr, size_t len)
+    {
+        if constexpr (requires { _impl.skip_unsigned(addr, len); })
+        {
+            _impl.skip_unsigned(addr, len);
+        }
+    }
+    const deviceClassT& device(void) const
+    {
+        return _impl;
+    }
 };
 
 #ifdef MTD_EMULATION
-typedef mtd<file_mtd_emulation> mtd_type;
+typedef mtd<instrumented<file_mtd_emulation>> mtd_type;
+typedef mtd<dry_run<file_mtd_emulation>> dry_run_mtd_type;
 #define PROC_MTD_FILE "proc/mtd"
 #define MTD_DEV_BASE "dev/"
 #else /* !MTD_EMULATION */
-typedef mtd<hw_mtd> mtd_type;
+typedef mtd<instrumented<hw_mtd>> mtd_type;
+typedef mtd<dry_run<hw_mtd>> dry_run_mtd_type;
 #define PROC_MTD_FILE "/proc/mtd"
 #define MTD_DEV_BASE "/dev/"
 #endif /* MTD_EMULATION */
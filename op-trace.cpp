@@ -0,0 +1,282 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: flash operation trace recorder and replayer
+*/
+
+#include "op-trace.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/exception/errinfo_errno.hpp>
+#include <boost/exception/errinfo_file_name.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+
+#include "debug.h"
+#include "exceptions.h"
+
+static_assert(sizeof(op_trace_record) == 40, "op_trace_record is on disk");
+
+/* records are written out once this many are buffered */
+static constexpr size_t op_trace_batch = 1024;
+
+struct op_trace_state
+{
+    std::mutex lock;
+    std::string path;
+    int fd = -1;
+    std::chrono::steady_clock::time_point start;
+    std::vector<op_trace_record> pending;
+    uint16_t threads = 0;
+    bool failed = false;
+};
+
+/* never destroyed, so operations during static destruction still work */
+static op_trace_state& state(void)
+{
+    static op_trace_state* s = new op_trace_state;
+    return *s;
+}
+
+/* with the lock held */
+static void flush_pending(op_trace_state& s)
+{
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(s.pending.data());
+    size_t len = s.pending.size() * sizeof(op_trace_record);
+    while (len && !s.failed)
+    {
+        ssize_t wr = ::write(s.fd, data, len);
+        if (wr < 0 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+        {
+            FWERROR("failed to write operation trace to " << s.path << ": "
+                                                          << strerror(errno));
+            s.failed = true;
+            break;
+        }
+        data += wr;
+        len -= wr;
+    }
+    s.pending.clear();
+}
+
+void op_trace_start(const std::string& path)
+{
+    op_trace_state& s = state();
+    {
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+        if (s.fd < 0)
+            THROW(FileIOError() << boost::errinfo_errno(errno)
+                                << boost::errinfo_file_name(path));
+        s.path = path;
+        s.start = std::chrono::steady_clock::now();
+        s.pending.reserve(op_trace_batch);
+
+        op_trace_header header{};
+        std::memcpy(header.magic, op_trace_magic, sizeof(header.magic));
+        header.version = op_trace_version;
+        header.record_size = sizeof(op_trace_record);
+        if (::write(s.fd, &header, sizeof(header)) != sizeof(header))
+            THROW(FileIOError() << boost::errinfo_errno(errno)
+                                << boost::errinfo_file_name(path));
+    }
+    mtd_op_observe(observe_trace, true);
+    std::atexit(op_trace_stop);
+}
+
+void op_trace_stop(void)
+{
+    mtd_op_observe(observe_trace, false);
+    op_trace_state& s = state();
+    std::lock_guard<std::mutex> lock(s.lock);
+    if (s.fd < 0)
+        return;
+    flush_pending(s);
+    if (::close(s.fd) < 0 && !s.failed)
+        FWERROR("failed to write operation trace to " << s.path << ": "
+                                                      << strerror(errno));
+    s.fd = -1;
+}
+
+void op_trace_append(mtd_op op, uint32_t addr, size_t len,
+                     std::chrono::steady_clock::time_point begin,
+                     std::chrono::steady_clock::time_point end,
+                     const uint8_t* data, size_t data_len, bool failed)
+{
+    op_trace_record r{};
+    r.addr = addr;
+    r.len = len;
+    r.op = static_cast<uint8_t>(op);
+    r.flags = failed ? op_trace_record::failed : 0;
+    if (data)
+    {
+        // hashed outside the lock, so threads only contend on the append
+        r.hash = fast_hash64(data, data_len);
+        if (op == mtd_op::program && is_blank(data, data_len))
+            r.flags |= op_trace_record::blank;
+    }
+    r.dur_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+            .count();
+
+    op_trace_state& s = state();
+    static thread_local int thread = -1;
+    std::lock_guard<std::mutex> lock(s.lock);
+    if (s.fd < 0)
+        return;
+    if (thread < 0)
+        thread = s.threads++;
+    r.thread = thread;
+    r.begin_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(begin - s.start)
+            .count();
+    s.pending.push_back(r);
+    if (s.pending.size() >= op_trace_batch)
+        flush_pending(s);
+}
+
+std::vector<op_trace_record> op_trace_load(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(path));
+    std::vector<uint8_t> file;
+    uint8_t chunk[64 * 1024];
+    ssize_t rd;
+    while ((rd = ::read(fd, chunk, sizeof(chunk))) != 0)
+    {
+        if (rd < 0 && errno == EINTR)
+            continue;
+        if (rd < 0)
+        {
+            int err = errno;
+            ::close(fd);
+            THROW(FileIOError() << boost::errinfo_errno(err)
+                                << boost::errinfo_file_name(path));
+        }
+        file.insert(file.end(), chunk, chunk + rd);
+    }
+    ::close(fd);
+
+    op_trace_header header;
+    if (file.size() < sizeof(header))
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("not an operation trace"));
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, op_trace_magic, sizeof(header.magic)) ||
+        header.version != op_trace_version ||
+        header.record_size != sizeof(op_trace_record))
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("not an operation trace"));
+
+    // a trace cut short by a crash still replays up to the last record
+    size_t count = (file.size() - sizeof(header)) / sizeof(op_trace_record);
+    std::vector<op_trace_record> records(count);
+    std::memcpy(records.data(), file.data() + sizeof(header),
+                count * sizeof(op_trace_record));
+    return records;
+}
+
+void op_trace_print(const std::vector<op_trace_record>& records,
+                    std::ostream& out)
+{
+    for (const op_trace_record& r : records)
+    {
+        const char* name = r.op < mtd_op_count
+                               ? mtd_op_name(static_cast<mtd_op>(r.op))
+                               : "unknown";
+        out << std::left << std::setw(7) << name << std::right << std::hex
+            << std::setfill('0') << ' ' << std::setw(8) << r.addr << ' '
+            << std::setw(8) << r.len << ' ' << std::setw(16) << r.hash
+            << std::setfill(' ') << std::dec << std::fixed
+            << std::setprecision(3) << ' ' << r.dur_ns / 1000.0 << ' '
+            << r.begin_ns / 1000.0 << " t" << r.thread;
+        if (r.flags & op_trace_record::blank)
+            out << " blank";
+        if (r.flags & op_trace_record::failed)
+            out << " failed";
+        out << '\n';
+    }
+}
+
+void op_trace_fill(const op_trace_record& record, std::vector<uint8_t>& buf)
+{
+    buf.resize(record.len);
+    if (record.flags & op_trace_record::blank)
+    {
+        std::fill(buf.begin(), buf.end(), 0xff);
+        return;
+    }
+    // xorshift64 seeded by the hash: the same data always gets the same
+    // stand-in, and different data (almost always) a different one
+    uint64_t x = record.hash | 1;
+    for (size_t idx = 0; idx < buf.size(); idx += sizeof(x))
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        std::memcpy(buf.data() + idx, &x,
+                    std::min(sizeof(x), buf.size() - idx));
+    }
+}
+
+uint64_t op_trace_extent(const std::vector<op_trace_record>& records)
+{
+    uint64_t extent = 0;
+    for (const op_trace_record& r : records)
+        extent = std::max(extent, uint64_t(r.addr) + r.len);
+    return extent;
+}
+
+void op_trace_summary::report(std::ostream& out) const
+{
+    auto ms = [](double ns) { return ns / 1e6; };
+    out << std::dec << std::fixed << std::setprecision(1) << std::left
+        << std::setw(8) << "op" << std::right << std::setw(9) << "count"
+        << std::setw(12) << "bytes" << std::setw(12) << "recorded"
+        << std::setw(12) << "replayed" << std::setw(12) << "modelled"
+        << " (ms)\n";
+    op_trace_totals all;
+    for (size_t op = 0; op < mtd_op_count; op++)
+    {
+        const op_trace_totals& t = ops[op];
+        all.count += t.count;
+        all.bytes += t.bytes;
+        all.recorded_ns += t.recorded_ns;
+        all.replayed_ns += t.replayed_ns;
+        all.modelled_us += t.modelled_us;
+        if (!t.count)
+            continue;
+        out << std::left << std::setw(8)
+            << mtd_op_name(static_cast<mtd_op>(op)) << std::right
+            << std::setw(9) << t.count << std::setw(12) << t.bytes
+            << std::setw(12) << ms(t.recorded_ns) << std::setw(12)
+            << ms(t.replayed_ns) << std::setw(12) << t.modelled_us / 1e3
+            << '\n';
+    }
+    out << std::left << std::setw(8) << "total" << std::right << std::setw(9)
+        << all.count << std::setw(12) << all.bytes << std::setw(12)
+        << ms(all.recorded_ns) << std::setw(12) << ms(all.replayed_ns)
+        << std::setw(12) << all.modelled_us / 1e3 << '\n'
+        << "wall: recorded " << ms(recorded_wall_ns) << " ms, replayed "
+        << ms(replayed_wall_ns) << " ms\n";
+}
@@ -0,0 +1,179 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: flash operation trace recorder and replayer
+*/
+
+#ifndef __OP_TRACE_H__
+#define __OP_TRACE_H__
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "flash-timing.h"
+#include "mtd-stats.h"
+#include "util.h"
+
+/*
+ * An operation trace holds every device-level read, program (write_raw)
+ * and erase of a run, in the order they were issued, with a hash of the
+ * data rather than the data itself. Replaying it against an emulated or
+ * in-memory device repeats the same operations with the same sizes and
+ * alignment, so a field update becomes a reproducible benchmark, and two
+ * traces of the same capsule show how two versions of the write path
+ * differ.
+ *
+ * The file is an op_trace_header followed by op_trace_records, in host
+ * byte order (little endian on BMCs).
+ */
+constexpr char op_trace_magic[8] = {'M', 'T', 'D', 'O', 'P', 'T', 'R', 'C'};
+constexpr uint32_t op_trace_version = 1;
+
+struct op_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} __attribute__((packed));
+
+struct op_trace_record
+{
+    static constexpr uint8_t failed = 1 << 0;
+    /* a program of all 0xff */
+    static constexpr uint8_t blank = 1 << 1;
+
+    uint64_t begin_ns; // since the start of the trace
+    uint64_t dur_ns;
+    uint64_t hash;     // fast_hash64 of the data; 0 for erases
+    uint32_t addr;
+    uint32_t len;
+    uint8_t op;        // mtd_op
+    uint8_t flags;
+    uint16_t thread;   // in order of first operation, from 0
+    uint32_t reserved;
+} __attribute__((packed));
+
+/* record every device operation to path, until the process exits */
+void op_trace_start(const std::string& path);
+/* write out buffered records and stop recording */
+void op_trace_stop(void);
+
+void op_trace_append(mtd_op op, uint32_t addr, size_t len,
+                     std::chrono::steady_clock::time_point begin,
+                     std::chrono::steady_clock::time_point end,
+                     const uint8_t* data, size_t data_len, bool failed);
+
+/* read a whole trace; throws FileIOError if it is not one */
+std::vector<op_trace_record> op_trace_load(const std::string& path);
+
+/*
+ * One line per operation: op, address, length and data hash, which do
+ * not change with timing, then duration, start (both in us) and thread.
+ */
+void op_trace_print(const std::vector<op_trace_record>& records,
+                    std::ostream& out);
+
+/* the data itself is not kept, so a replay programs bytes derived from
+ * the recorded hash instead (0xff for blank programs) */
+void op_trace_fill(const op_trace_record& record, std::vector<uint8_t>& buf);
+
+/* highest address the trace touches */
+uint64_t op_trace_extent(const std::vector<op_trace_record>& records);
+
+struct op_trace_totals
+{
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+    uint64_t recorded_ns = 0;
+    uint64_t replayed_ns = 0;
+    double modelled_us = 0;
+};
+
+struct op_trace_summary
+{
+    std::array<op_trace_totals, mtd_op_count> ops;
+    /* first start to last end */
+    uint64_t recorded_wall_ns = 0;
+    uint64_t replayed_wall_ns = 0;
+
+    void report(std::ostream& out) const;
+};
+
+/*
+ * Issue every operation of the trace, in order and from one thread,
+ * against the device class deviceT, which needs the read, erase and
+ * write_raw of the classes in mtd.h. Each operation is also costed with
+ * timing, so a replay against memory still estimates real flash time.
+ */
+template <typename deviceT>
+op_trace_summary op_trace_replay(deviceT& dev,
+                                 const std::vector<op_trace_record>& records,
+                                 const flash_timing& timing)
+{
+    op_trace_summary summary;
+    std::vector<uint8_t> buf;
+    uint64_t first = UINT64_MAX, last = 0;
+    auto replay_begin = std::chrono::steady_clock::now();
+
+    for (const op_trace_record& r : records)
+    {
+        if (r.op >= mtd_op_count)
+            continue;
+        mtd_op op = static_cast<mtd_op>(r.op);
+        op_trace_totals& totals = summary.ops[r.op];
+        totals.count++;
+        totals.bytes += r.len;
+        totals.recorded_ns += r.dur_ns;
+        first = std::min(first, r.begin_ns);
+        last = std::max(last, r.begin_ns + r.dur_ns);
+
+        if (op == mtd_op::program)
+            op_trace_fill(r, buf);
+        else if (op == mtd_op::read)
+            buf.resize(r.len);
+        auto begin = std::chrono::steady_clock::now();
+        switch (op)
+        {
+            case mtd_op::read:
+                dev.read(r.addr, buf.data(), r.len);
+                totals.modelled_us += timing.read_us(r.len);
+                break;
+            case mtd_op::program:
+                dev.write_raw(r.addr, cbspan(buf.data(), r.len));
+                totals.modelled_us += timing.program_us(r.addr, r.len);
+                break;
+            case mtd_op::erase:
+                dev.erase(r.addr, r.len);
+                totals.modelled_us += timing.erase_us(r.addr, r.len);
+                break;
+        }
+        totals.replayed_ns += std::chrono::duration_cast<
+                                  std::chrono::nanoseconds>(
+                                  std::chrono::steady_clock::now() - begin)
+                                  .count();
+    }
+    summary.recorded_wall_ns = records.empty() ? 0 : last - first;
+    summary.replayed_wall_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - replay_begin)
+            .count();
+    return summary;
+}
+
+#endif /* __OP_TRACE_H__ */
@@ -0,0 +1,271 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: PBC encoder for raw flash images
+*/
+
+#include "pbc-encoder.h"
+
+#include <algorithm>
+#include <atomic>
+#include <boost/exception/errinfo_file_name.hpp>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "exceptions.h"
+#include "pfr.hpp"
+
+static constexpr size_t pbc_erase_block_size = 16 * pfr_blk_size;
+/* pages per task: one erase block */
+static constexpr size_t pbc_chunk_pages = 16;
+
+/* per page flags, turned into the bitmaps */
+static constexpr uint8_t pbc_page_erase = 1 << 0;
+static constexpr uint8_t pbc_page_copy = 1 << 1;
+
+std::vector<pbc_region> pbc_load_regions(const std::string& path)
+{
+    std::ifstream file(path);
+    if (!file)
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("cannot open region file"));
+
+    std::vector<pbc_region> regions;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line = line.substr(0, line.find('#'));
+        std::istringstream iss(line);
+        std::string start, end, kind;
+        if (!(iss >> start))
+            continue;
+        char* endptr;
+        pbc_region region{};
+        region.start = strtoul(start.c_str(), &endptr, 16);
+        bool ok = !*endptr && (iss >> end);
+        if (ok)
+        {
+            region.end = strtoul(end.c_str(), &endptr, 16);
+            ok = !*endptr;
+        }
+        region.copy = !(iss >> kind);
+        std::string extra;
+        if (!ok || (!region.copy && kind != "erase") || (iss >> extra))
+            THROW(FileIOError() << boost::errinfo_file_name(path)
+                                << msg_info("bad region: " + line));
+        regions.push_back(region);
+    }
+    return regions;
+}
+
+/* header, bitmaps and payload for per page flags */
+static std::vector<uint8_t> pbc_assemble(const cbspan& image,
+                                         const std::vector<uint8_t>& flags,
+                                         size_t workers, pbc_stats& stats)
+{
+    size_t pages = flags.size();
+    size_t map_size = pages / 8;
+    std::vector<uint8_t> out(sizeof(pbc) + 2 * map_size);
+    uint8_t* act_map = out.data() + sizeof(pbc);
+    uint8_t* pbc_map = act_map + map_size;
+
+    // payload slot of every copied page
+    std::vector<uint32_t> slot(pages);
+    stats.pages = pages;
+    stats.erased = stats.copied = 0;
+    for (size_t page = 0; page < pages; page++)
+    {
+        uint8_t bit = 0x80 >> (page % 8);
+        if (flags[page] & pbc_page_erase)
+        {
+            act_map[page / 8] |= bit;
+            stats.erased++;
+        }
+        if (flags[page] & pbc_page_copy)
+        {
+            pbc_map[page / 8] |= bit;
+            slot[page] = stats.copied++;
+        }
+    }
+
+    pbc hdr{};
+    hdr.magic = pbc_magic;
+    hdr.version = pbc_version;
+    hdr.page_size = pfr_blk_size;
+    hdr.pattern_size = 1;
+    hdr.pattern = 0xff;
+    hdr.bitmap_size = pages;
+    hdr.payload_length = stats.copied * pfr_blk_size;
+    std::memcpy(out.data(), &hdr, sizeof(hdr));
+
+    size_t payload = out.size();
+    out.resize(payload + hdr.payload_length);
+    parallel_for(pages / pbc_chunk_pages, workers, [&](size_t chunk) {
+        for (size_t page = chunk * pbc_chunk_pages;
+             page < (chunk + 1) * pbc_chunk_pages; page++)
+        {
+            if (flags[page] & pbc_page_copy)
+            {
+                std::memcpy(out.data() + payload + slot[page] * pfr_blk_size,
+                            image.data() + page * pfr_blk_size, pfr_blk_size);
+            }
+        }
+    });
+    return out;
+}
+
+/* page flags for the regions of an image of size bytes; copy_pages is
+ * set to the number of pages in copy regions
+ */
+static std::vector<uint8_t> region_flags(size_t size,
+                                         const std::vector<pbc_region>& regions,
+                                         size_t& copy_pages)
+{
+    if (!size || size % pbc_erase_block_size)
+        THROW(ImageFormatError()
+              << msg_info("image is not a whole number of 64K blocks"));
+
+    std::vector<uint8_t> flags(size / pfr_blk_size, 0);
+    copy_pages = 0;
+    for (const pbc_region& region : regions)
+    {
+        if (region.start >= region.end ||
+            region.start % pbc_erase_block_size ||
+            region.end % pbc_erase_block_size || region.end > size)
+            THROW(ImageFormatError() << msg_info("region is misaligned or "
+                                                 "outside the image"));
+        for (size_t page = region.start / pfr_blk_size;
+             page < region.end / pfr_blk_size; page++)
+        {
+            if (flags[page])
+                THROW(ImageFormatError() << msg_info("regions overlap"));
+            flags[page] =
+                pbc_page_erase | (region.copy ? pbc_page_copy : 0);
+        }
+        if (region.copy)
+            copy_pages += (region.end - region.start) / pfr_blk_size;
+    }
+    return flags;
+}
+
+/* blank pages are erased anyway, so they need not be copied */
+static void drop_blank_pages(const cbspan& image, std::vector<uint8_t>& flags,
+                             size_t chunk)
+{
+    for (size_t page = chunk * pbc_chunk_pages;
+         page < (chunk + 1) * pbc_chunk_pages; page++)
+    {
+        if ((flags[page] & pbc_page_copy) &&
+            is_blank(image.data() + page * pfr_blk_size, pfr_blk_size))
+        {
+            flags[page] &= ~pbc_page_copy;
+        }
+    }
+}
+
+std::vector<uint8_t> pbc_encode(const cbspan& image,
+                                const std::vector<pbc_region>& regions,
+                                size_t workers, pbc_stats& stats)
+{
+    size_t copy_pages;
+    std::vector<uint8_t> flags =
+        region_flags(image.size(), regions, copy_pages);
+    parallel_for(flags.size() / pbc_chunk_pages, workers,
+                 [&](size_t chunk) { drop_blank_pages(image, flags, chunk); });
+
+    std::vector<uint8_t> out = pbc_assemble(image, flags, workers, stats);
+    stats.blank = copy_pages - stats.copied;
+    stats.unchanged = 0;
+    return out;
+}
+
+std::vector<uint8_t> pbc_encode_delta(const cbspan& old_image,
+                                      const cbspan& image,
+                                      const std::vector<pbc_region>& regions,
+                                      size_t workers, pbc_stats& stats)
+{
+    if (old_image.size() != image.size())
+        THROW(ImageFormatError() << msg_info("images differ in size"));
+
+    size_t copy_pages;
+    std::vector<uint8_t> flags =
+        region_flags(image.size(), regions, copy_pages);
+    // a chunk is one erase block, and regions are erase block aligned, so
+    // a chunk is either all copy or not copy at all
+    std::atomic<size_t> unchanged{0};
+    parallel_for(flags.size() / pbc_chunk_pages, workers, [&](size_t chunk) {
+        size_t page = chunk * pbc_chunk_pages;
+        if (!(flags[page] & pbc_page_copy))
+        {
+            return;
+        }
+        size_t offset = page * pfr_blk_size;
+        if (!std::memcmp(old_image.data() + offset, image.data() + offset,
+                         pbc_erase_block_size))
+        {
+            std::fill(flags.begin() + page,
+                      flags.begin() + page + pbc_chunk_pages, 0);
+            unchanged += pbc_chunk_pages;
+            return;
+        }
+        // the block has to be erased for the pages that changed, so all
+        // its pages are written again
+        drop_blank_pages(image, flags, chunk);
+    });
+
+    std::vector<uint8_t> out = pbc_assemble(image, flags, workers, stats);
+    stats.unchanged = unchanged;
+
+    // what pfr write checks the flash against before applying this
+    pbc_delta_info info{};
+    info.magic = pbc_delta_magic;
+    std::vector<pbc_region> copies;
+    std::copy_if(regions.begin(), regions.end(), std::back_inserter(copies),
+                 [](const pbc_region& region) { return region.copy; });
+    std::sort(copies.begin(), copies.end(),
+              [](const pbc_region& a, const pbc_region& b) {
+                  return a.start < b.start;
+              });
+    size_t ranges = 0;
+    for (const pbc_region& region : copies)
+    {
+        uint32_t start = region.start / pbc_delta_block_size;
+        uint32_t end = region.end / pbc_delta_block_size;
+        if (end > UINT16_MAX)
+            THROW(ImageFormatError()
+                  << msg_info("image is too large for a delta pbc"));
+        if (ranges && info.ranges[ranges - 1].end == start)
+        {
+            info.ranges[ranges - 1].end = end;
+            continue;
+        }
+        if (ranges == pbc_delta_max_ranges)
+            THROW(ImageFormatError() << msg_info(
+                      "too many separate copy regions for a delta pbc"));
+        info.ranges[ranges].start = start;
+        info.ranges[ranges].end = end;
+        ranges++;
+    }
+    Hash hash(EVP_sha384(), cbspan());
+    pbc_delta_base_blocks(reinterpret_cast<const pbc*>(out.data()), info,
+                          [&](size_t offset) {
+                              hash.update(old_image.data() + offset,
+                                          pbc_delta_block_size);
+                          });
+    std::memcpy(info.base_sha384, hash.digest().data(), sha384_size);
+    std::memcpy(reinterpret_cast<pbc*>(out.data())->rsvd, &info, sizeof(info));
+    stats.blank = copy_pages - stats.unchanged - stats.copied;
+    return out;
+}
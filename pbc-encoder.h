@@ -0,0 +1,90 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: PBC encoder for raw flash images
+*/
+
+#ifndef __PBC_ENCODER_H__
+#define __PBC_ENCODER_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+constexpr uint32_t pbc_version = 2;
+
+/*
+ * A range of the flash image and what the PBC does with it: copy regions
+ * are erased and their pages copied, except for blank (all 0xff) pages,
+ * which are only erased; erase regions are only erased. Everything else
+ * is left alone. Both ends are 64K aligned, as pfr write only erases 64K
+ * blocks, and end is exclusive, like the spi regions of a PFM.
+ */
+struct pbc_region
+{
+    uint32_t start;
+    uint32_t end;
+    bool copy;
+};
+
+/*
+ * Read regions from a file of lines
+ *
+ *   <start> <end> [erase]
+ *
+ * in hex; without erase, the region is a copy region. '#' starts a
+ * comment. Throws FileIOError if the file cannot be read or a line does
+ * not parse, including one with anything else after the region.
+ */
+std::vector<pbc_region> pbc_load_regions(const std::string& path);
+
+struct pbc_stats
+{
+    size_t pages = 0;     // bitmap size
+    size_t erased = 0;    // pages with the erase bit
+    size_t copied = 0;    // pages with the copy bit, i.e. in the payload
+    size_t blank = 0;     // pages of copy regions left out as blank
+    size_t unchanged = 0; // pages of copy regions left alone (delta only)
+};
+
+/*
+ * Encode a raw flash image as a pbc header, the erase and copy bitmaps
+ * and the payload, which is what a capsule carries after its PFM. The
+ * image is scanned and the payload gathered on up to workers threads.
+ * Throws ImageFormatError if the image is not a whole number of 64K
+ * blocks or the regions are misaligned, overlap or fall outside it.
+ */
+std::vector<uint8_t> pbc_encode(const cbspan& image,
+                                const std::vector<pbc_region>& regions,
+                                size_t workers, pbc_stats& stats);
+
+/*
+ * Encode only what changed from old_image to image. A 64K block of a copy
+ * region that is the same in both is neither erased nor copied; a block
+ * with any changed page is erased and all of its non-blank pages copied,
+ * as the erase takes the unchanged pages with it. pfr write applies the
+ * result like any other pbc, but only to flash that holds old_image: the
+ * header carries the hash of the blocks of old_image the result relies on,
+ * which pfr write checks before erasing anything. Throws ImageFormatError
+ * like pbc_encode, if the images differ in size or if the copy regions
+ * make up more than pbc_delta_max_ranges separate ranges.
+ */
+std::vector<uint8_t> pbc_encode_delta(const cbspan& old_image,
+                                      const cbspan& image,
+                                      const std::vector<pbc_region>& regions,
+                                      size_t workers, pbc_stats& stats);
+
+#endif /* __PBC_ENCODER_H__ */
@@ -22,82 +22,32 @@
 #include <openssl/evp.h>
 #include <openssl/sha.h>
 
+#include <atomic>
+#include <bit>
+#include <boost/exception/errinfo_errno.hpp>
+#include <boost/exception/errinfo_file_name.hpp>
+#include <cstddef>
+#include <cstring>
 #include <fstream>
 #include <gpiod.hpp>
+#include <mutex>
 
-static const void* base_addr = NULL;
-static unsigned int image_offset(const void* thing)
-{
-    return static_cast<unsigned int>(static_cast<const uint8_t*>(thing) -
-                                     static_cast<const uint8_t*>(base_addr));
-}
-
-/**
- * @brief Class to handle non-consecutive hashing
+/* state of one authentication call; nothing is shared between calls, so
+ * several capsules can be authenticated concurrently
  */
-class Hash
+struct auth_context
 {
-  public:
-    Hash(const Hash&) = delete;
-    Hash& operator=(const Hash&) = delete;
-
-    Hash(const EVP_MD* dgst, const cbspan& expected) :
-        ctx{}, hash(EVP_MAX_MD_SIZE), expected(expected)
-    {
-        ctx = EVP_MD_CTX_new();
-        if (!ctx)
-        {
-            throw std::bad_alloc();
-        }
-        EVP_MD_CTX_init(ctx);
-        EVP_DigestInit_ex(ctx, dgst, nullptr);
-    }
-    ~Hash()
-    {
-        EVP_MD_CTX_free(ctx);
-    }
-    void update(const uint8_t* data, size_t len)
-    {
-        if (finalized)
-        {
-            throw std::logic_error("update after finalize");
-        }
-        EVP_DigestUpdate(ctx, data, len);
-    }
-    const std::vector<uint8_t>& digest() const
-    {
-        if (finalized)
-        {
-            return hash;
-        }
-        finalized = true;
-        unsigned int len = hash.size();
-        EVP_DigestFinal_ex(ctx, hash.data(), &len);
-        hash.resize(len);
-        return hash;
-    }
-    bool verify() const
-    {
-        digest();
-        bool match = std::equal(hash.begin(), hash.end(), expected.begin(),
-                                expected.end());
-        if (!match)
-        {
-            auto expected_ = &expected[0];
-            auto computed = &hash[0];
-            DUMP(PRINT_ERROR, expected_, expected.size());
-            DUMP(PRINT_ERROR, computed, hash.size());
-        }
-        return match;
-    }
-
-  private:
-    mutable bool finalized = false;
-    EVP_MD_CTX* ctx;
-    mutable std::vector<uint8_t> hash;
-    const cbspan expected;
+    const uint8_t* base; // start of the capsule, for error offsets
+    bool check_root_key; // compare the root key with the active PFM
+    bool hash_content;   // false for a quick (header only) check
 };
 
+static unsigned int image_offset(const auth_context& ctx, const void* thing)
+{
+    return static_cast<unsigned int>(static_cast<const uint8_t*>(thing) -
+                                     ctx.base);
+}
+
 /**
  * @brief This function hashes data with SHA384
  *
@@ -109,8 +59,11 @@ class Hash
  */
 static void hash_sha384(const uint8_t* data, size_t len, uint8_t* digest)
 {
-    unsigned int digest_sz = SHA384_DIGEST_LENGTH;
-    EVP_Digest(data, len, digest, &digest_sz, EVP_sha384(), nullptr);
+    TRACE_SPAN("crypto", "sha384");
+    Hash hash(EVP_sha384(), cbspan());
+    hash.update(data, len);
+    const auto& computed = hash.digest();
+    std::copy(computed.begin(), computed.end(), digest);
 }
 
 /**
@@ -129,6 +82,7 @@ static bool verify_sha384(const uint8_t* expected, const uint8_t* data,
     hash_sha384(data, len, digest);
     bool match = std::equal(expected, expected + SHA384_DIGEST_LENGTH, digest,
                             digest + SHA384_DIGEST_LENGTH);
+    MTD_UTIL_PROBE(image_hash_verify, len, match);
     if (!match)
     {
         DUMP(PRINT_ERROR, expected, SHA384_DIGEST_LENGTH);
@@ -155,6 +109,7 @@ static bool verify_ecdsa_and_sha(const uint8_t* key_x, const uint8_t* key_y,
                                  uint32_t curve, const uint8_t* data,
                                  size_t len)
 {
+    TRACE_SPAN("crypto", "ecdsa_verify");
 
     EC_KEY* key = nullptr;
     size_t keybits = 0;
@@ -203,6 +158,7 @@ static bool verify_ecdsa_and_sha(const uint8_t* key_x, const uint8_t* key_y,
     ECDSA_SIG_set0(sig, bn_r, bn_s);
 
     int ec_ret = ECDSA_do_verify(digest, keybits / 8, sig, key);
+    MTD_UTIL_PROBE(sig_verify, curve, len, ec_ret == 1);
 
     EC_KEY_free(key);
     ECDSA_SIG_free(sig);
@@ -240,20 +196,21 @@ static bool mem_check(const uint8_t* data, size_t len, uint8_t val)
 }
 
 /**
- * @brief This function checks the validity of Block 0
+ * @brief This function checks the fields of Block 0, except for the hash of
+ * the protected content, which is checked last by the callers
  *
+ * @param ctx authentication state
  * @param b0 pointer to the block 0
- * @param protected_content the start address of protected content
  *
- * @return bool true if this Block 0 is valid; false, otherwise
+ * @return bool true if this Block 0 is well formed; false, otherwise
  */
-static bool is_block0_valid(const blk0* b0, const uint8_t* protected_content)
+static bool is_block0_header_valid(const auth_context& ctx, const blk0* b0)
 {
     // Verify magic number
     if (b0->magic != blk0_magic)
     {
         FWERROR("bad b0 magic: offset=0x" << std::hex
-                                          << image_offset(&b0->magic));
+                                          << image_offset(ctx, &b0->magic));
         return false;
     }
 
@@ -374,14 +331,13 @@ static bool is_block0_valid(const blk0* b0, const uint8_t* protected_content)
         }
     }
 
-    // Verify Hash256 is 0xff and Hash384 matches PC
+    // Verify Hash256 is 0xff; Hash384 is checked against the PC later
     if (!mem_check(b0->sha256, sizeof(b0->sha256), 0xff))
     {
         FWWARN("sha256 signature is not empty");
         // do not enforce until images are generated correctly
     }
-    // require the sha384 signature to be correct
-    return verify_sha384(b0->sha384, protected_content, b0->pc_length);
+    return true;
 }
 
 /**
@@ -421,17 +377,18 @@ static bool root_key_from_pfm(key_entry& root_key)
 /**
  * @brief This function validates a Block 1 root entry
  *
+ * @param ctx authentication state
  * @param root_entry pointer to the Block 1 root entry
  * @return true if this root entry is valid; false, otherwise
  */
-static bool is_root_entry_valid(const key_entry* root_entry,
-                                bool check_root_key)
+static bool is_root_entry_valid(const auth_context& ctx,
+                                const key_entry* root_entry)
 {
     // Verify magic number
     if (root_entry->magic != root_key_magic)
     {
         FWERROR("bad root entry magic: offset=0x"
-                << std::hex << image_offset(&root_entry->magic));
+                << std::hex << image_offset(ctx, &root_entry->magic));
         return false;
     }
 
@@ -440,7 +397,7 @@ static bool is_root_entry_valid(const key_entry* root_entry,
         root_entry->curve != curve_secp384r1)
     {
         FWERROR("bad root curve: offset=0x"
-                << std::hex << image_offset(&root_entry->curve));
+                << std::hex << image_offset(ctx, &root_entry->curve));
         return false;
     }
 
@@ -448,7 +405,7 @@ static bool is_root_entry_valid(const key_entry* root_entry,
     if (root_entry->permissions != pfr_perm_sign_all)
     {
         FWERROR("bad root permissions: offset=0x"
-                << std::hex << image_offset(&root_entry->permissions));
+                << std::hex << image_offset(ctx, &root_entry->permissions));
         return false;
     }
 
@@ -456,7 +413,7 @@ static bool is_root_entry_valid(const key_entry* root_entry,
     if (root_entry->key_id != key_non_cancellable)
     {
         FWERROR("bad root key ID: offset=0x"
-                << std::hex << image_offset(&root_entry->key_id));
+                << std::hex << image_offset(ctx, &root_entry->key_id));
         return false;
     }
 
@@ -464,7 +421,7 @@ static bool is_root_entry_valid(const key_entry* root_entry,
     const uint8_t* key_y = root_entry->key_y;
     key_entry root_key;
 
-    if (!check_root_key)
+    if (!ctx.check_root_key)
     {
         return true;
     }
@@ -647,6 +604,7 @@ static bool is_block0_sig_entry_valid(uint32_t curve, const uint8_t* root_key_x,
 /**
  * @brief This function validates Block 1
  *
+ * @param ctx authentication state
  * @param b0 pointer to block 0
  * @param b1 pointer to block 1
  * @param is_key_cancellation_cert true if this signature is part of a signed
@@ -654,8 +612,8 @@ static bool is_block0_sig_entry_valid(uint32_t curve, const uint8_t* root_key_x,
  *
  * @return bool true if this Block 1 is valid; false, otherwise
  */
-static bool is_block1_valid(const blk0* b0, const sig_blk1* sig,
-                            bool is_key_cancellation_cert, bool check_root_key)
+static bool is_block1_valid(const auth_context& ctx, const blk0* b0,
+                            const sig_blk1* sig, bool is_key_cancellation_cert)
 {
     // Verify magic number
     if (sig->b1.magic != blk1_magic)
@@ -666,7 +624,7 @@ static bool is_block1_valid(const blk0* b0, const sig_blk1* sig,
 
     // Validate Block1 Root Entry
     const key_entry* root_entry = &sig->b1.root_key;
-    if (!is_root_entry_valid(root_entry, check_root_key))
+    if (!is_root_entry_valid(ctx, root_entry))
     {
         FWERROR("root_entry invalid");
         return false;
@@ -732,18 +690,22 @@ static uint32_t is_key_can_cert_valid(const cancel_payload* cert)
 /**
  * @brief This function authenticate a given signed payload.
  * Please refer to the specification regarding the format of signed payload.
- * This function authenticate the Block 0 (containing hash of the payload)
- * first, then authenticate the Block 1 (containing signature over Block0). For
- * key cancellation certificate, this function also validate the certificate
- * content for security reasons.
+ * This function checks the Block 0 fields first, then authenticates the
+ * Block 1 (containing signature over Block0) and only then hashes the
+ * payload against Block 0, so that a capsule with a wrong key or type is
+ * rejected without hashing it. For key cancellation certificate, this
+ * function also validate the certificate content for security reasons.
  *
+ * @param ctx authentication state
  * @param sig the start address of the signed payload (i.e. beginning of a
  * signature.)
  *
  * @return uint32_t true if this keychain is valid; false, otherwise
  */
-static bool is_signature_valid(const b0b1_signature* sig, bool check_root_key)
+static bool is_signature_valid(const auth_context& ctx,
+                               const b0b1_signature* sig)
 {
+    TRACE_SPAN("pfr", "signature");
     const blk0* b0 = &sig->b0;
     bool is_key_cancellation_cert = b0->pc_type & pfr_pc_type_cancel_cert;
 
@@ -766,20 +728,24 @@ static bool is_signature_valid(const b0b1_signature* sig, bool check_root_key)
         }
     }
 
-    // Validate block0 (contains hash of the protected content)
-    if (is_block0_valid(b0, pc))
+    if (!is_block0_header_valid(ctx, b0))
+    {
+        FWERROR("block0 failed authentication");
+        return false;
+    }
+    // Validate block1 (contains the signature chain used to sign block0)
+    if (!is_block1_valid(ctx, b0, &sig->b1_sig, is_key_cancellation_cert))
     {
-        // Validate block1 (contains the signature chain used to sign block0)
-        if (is_block1_valid(b0, &sig->b1_sig, is_key_cancellation_cert,
-                            check_root_key))
-        {
-            return true;
-        }
         FWERROR("block1 failed authentication");
         return false;
     }
-    FWERROR("block0 failed authentication");
-    return false;
+    // Validate the protected content against the hash in block0
+    if (ctx.hash_content && !verify_sha384(b0->sha384, pc, b0->pc_length))
+    {
+        FWERROR("block0 failed authentication");
+        return false;
+    }
+    return true;
 }
 
 static uint32_t read_saved_layout(void)
@@ -800,43 +766,119 @@ static uint32_t read_saved_layout(void)
     return layout;
 }
 
-static bool getGPIOInput(const std::string& name, gpiod::line& gpioLine,
-                         uint8_t& value)
+static const std::array<std::string, 6> boardIdGpioLines = {
+    "FM_BOARD_SKU_ID0", "FM_BOARD_SKU_ID1", "FM_BOARD_SKU_ID2",
+    "FM_BOARD_SKU_ID3", "FM_BOARD_SKU_ID4", "FM_BOARD_SKU_ID5"};
+
+/**
+ * @brief Board ID lines that live on the same gpiochip
+ */
+struct BoardIdGpioGroup
 {
-    // Find the GPIO line
-    gpioLine = gpiod::find_line(name);
-    if (!gpioLine)
-    {
-        FWERROR("Failed to find the GPIO line: " << name.c_str());
-        return false;
-    }
-    try
+    gpiod::chip chip;
+    std::vector<unsigned int> offsets;
+    // board id bit position of each entry in offsets
+    std::vector<size_t> bits;
+};
+
+/**
+ * @brief This function looks up the board ID lines by name
+ *
+ * gpiod::find_line scans every gpiochip in the system, so this is only
+ * done once; the lines are grouped per chip so that each group can be
+ * requested and read with a single line_bulk request.
+ *
+ * @param groups output vector of per-chip line groups
+ *
+ * @return true if all lines were found; false, otherwise
+ */
+static bool resolveBoardIdLines(std::vector<BoardIdGpioGroup>& groups)
+{
+    groups.clear();
+    for (size_t bit = 0; bit < boardIdGpioLines.size(); bit++)
     {
-        gpioLine.request({__FUNCTION__, gpiod::line_request::DIRECTION_INPUT});
+        gpiod::line gpioLine = gpiod::find_line(boardIdGpioLines[bit]);
+        if (!gpioLine)
+        {
+            FWERROR("Failed to find the GPIO line: "
+                    << boardIdGpioLines[bit].c_str());
+            groups.clear();
+            return false;
+        }
+        gpiod::chip chip = gpioLine.get_chip();
+        auto group = std::find_if(groups.begin(), groups.end(),
+                                  [&chip](const BoardIdGpioGroup& g) {
+                                      return g.chip.name() == chip.name();
+                                  });
+        if (group == groups.end())
+        {
+            groups.push_back({chip, {}, {}});
+            group = std::prev(groups.end());
+        }
+        group->offsets.push_back(gpioLine.offset());
+        group->bits.push_back(bit);
     }
-    catch (const std::exception& e)
+    return true;
+}
+
+bool getBoardId(uint8_t& boardId)
+{
+    TRACE_SPAN("gpio", "board_id");
+    // resolved line offsets are cached for the life of the process
+    static std::mutex boardIdLock;
+    static std::vector<BoardIdGpioGroup> boardIdGroups;
+    std::lock_guard<std::mutex> guard(boardIdLock);
+
+    if (boardIdGroups.empty() && !resolveBoardIdLines(boardIdGroups))
     {
-        FWERROR("Failed to request the GPIO line: " << e.what());
-        gpioLine.release();
         return false;
     }
-    try
-    {
-        value = gpioLine.get_value();
-    }
-    catch (const std::exception& e)
+
+    uint8_t value = 0;
+    for (const auto& group : boardIdGroups)
     {
-        FWERROR("Failed to get the value of GPIO line: " << e.what());
-        gpioLine.release();
-        return false;
+        std::vector<int> values;
+        try
+        {
+            gpiod::line_bulk gpioLines = group.chip.get_lines(group.offsets);
+            gpioLines.request(
+                {__FUNCTION__, gpiod::line_request::DIRECTION_INPUT});
+            try
+            {
+                values = gpioLines.get_values();
+            }
+            catch (const std::exception& e)
+            {
+                FWERROR("Failed to get the value of GPIO lines: " << e.what());
+                gpioLines.release();
+                return false;
+            }
+            gpioLines.release();
+        }
+        catch (const std::exception& e)
+        {
+            FWERROR("Failed to request the GPIO lines: " << e.what());
+            return false;
+        }
+        if (values.size() != group.bits.size())
+        {
+            FWERROR("Short read of GPIO lines on " << group.chip.name());
+            return false;
+        }
+        for (size_t idx = 0; idx < values.size(); idx++)
+        {
+            value |= (values[idx] ? 1 : 0) << group.bits[idx];
+        }
     }
-    gpioLine.release();
+    boardId = value;
     return true;
 }
 
-static bool pfm_cfm_authenticate(const uint8_t* base_addr, bool check_root_key,
+static bool pfm_cfm_authenticate(const auth_context& ctx,
                                  const size_t max_size)
 {
+    TRACE_SPAN("pfr", "pfm_cfm_authenticate");
+    const uint8_t* base_addr = ctx.base;
 
     auto offset =
         reinterpret_cast<const uint8_t*>(base_addr + blk0blk1_size * 2);
@@ -847,29 +889,11 @@ static bool pfm_cfm_authenticate(const uint8_t* base_addr, bool check_root_key,
         return false;
     }
 
-    static const std::array<std::string, 6> boardIdGpioLines = {
-        "FM_BOARD_SKU_ID0", "FM_BOARD_SKU_ID1", "FM_BOARD_SKU_ID2",
-        "FM_BOARD_SKU_ID3", "FM_BOARD_SKU_ID4", "FM_BOARD_SKU_ID5"};
-
-    // BOARD ID SGPIO lines
-    gpiod::line boardIdGpioLine;
-
     // read Board Id version
     uint8_t board_id = 0;
-    for (size_t idx = 0; const auto& gLine : boardIdGpioLines)
+    if (!getBoardId(board_id))
     {
-        uint8_t value = 0;
-        if (getGPIOInput(gLine, boardIdGpioLine, value))
-        {
-            value = value << idx++;
-            board_id = board_id | value;
-        }
-        else
-        {
-            FWERROR("Failed to read GPIO line: " << gLine.c_str());
-            board_id = 0;
-            break;
-        }
+        FWERROR("Failed to read board ID GPIO lines");
     }
     FWDEBUG("Board ID read via GPIO's is : " << std::to_string(board_id));
 
@@ -900,7 +924,7 @@ static bool pfm_cfm_authenticate(const uint8_t* base_addr, bool check_root_key,
 
     auto cpu_img_sig = reinterpret_cast<const b0b1_signature*>(offset);
 
-    if (!is_signature_valid(cpu_img_sig, check_root_key))
+    if (!is_signature_valid(ctx, cpu_img_sig))
     {
         FWERROR("HPM CPLD signature is not valid");
         return false;
@@ -926,8 +950,23 @@ static bool pfm_cfm_authenticate(const uint8_t* base_addr, bool check_root_key,
     return true;
 }
 
-static bool fvm_authenticate(const b0b1_signature* img_sig)
+/**
+ * @brief This function authenticates the FVM of a partial update capsule
+ * and the pbc payload against the spi region hashes of the FVM
+ *
+ * @param ctx authentication state; the capsule headers, up to the end of
+ * both pbc bitmaps, are at ctx.base
+ * @param stream source of the pbc payload pages; nullptr if the payload
+ * follows the bitmaps in memory
+ *
+ * @return true if the FVM and payload are authentic; false, otherwise
+ */
+static bool fvm_authenticate(const auth_context& ctx,
+                             pfr_stream* stream = nullptr)
 {
+    TRACE_SPAN("pfr", "fvm_authenticate");
+    const bool hash_content = ctx.hash_content;
+    const auto img_sig = reinterpret_cast<const b0b1_signature*>(ctx.base);
     // sig (full image signature) has already been authenticated; immediately
     // following should be the fvm signature, which should not be incorrect,
     // but it is authenticated as follows:
@@ -936,17 +975,25 @@ static bool fvm_authenticate(const b0b1_signature* img_sig)
     const blk1* b1 = &sig->b1_sig.b1;
     const uint8_t* pc = reinterpret_cast<const uint8_t*>(sig + 1);
 
-    if (!is_block0_valid(b0, pc))
+    if (!is_block0_header_valid(ctx, b0))
     {
         FWERROR("block0 failed authentication");
         return false;
     }
-    // Validate block1 (contains the signature chain used to sign block0)
-    if (!is_block1_valid(b0, &sig->b1_sig, false, false))
+    // Validate block1 (contains the signature chain used to sign block0);
+    // the fvm root key is not compared with the active PFM
+    auth_context fvm_ctx = ctx;
+    fvm_ctx.check_root_key = false;
+    if (!is_block1_valid(fvm_ctx, b0, &sig->b1_sig, false))
     {
         FWERROR("block1 failed authentication");
         return false;
     }
+    if (hash_content && !verify_sha384(b0->sha384, pc, b0->pc_length))
+    {
+        FWERROR("block0 failed authentication");
+        return false;
+    }
     auto map_base = reinterpret_cast<const uint8_t*>(img_sig);
     auto offset = reinterpret_cast<const uint8_t*>(img_sig);
     offset += blk0blk1_size * 2; // one blk0blk1 for package, one for fvm
@@ -1001,8 +1048,11 @@ static bool fvm_authenticate(const b0b1_signature* img_sig)
             {
                 FWINFO("           spi_region + sha384 (" << sha384_size
                                                           << " bytes)");
-                hash384 = std::make_unique<Hash>(EVP_sha384(),
-                                                 cbspan(offset, sha384_size));
+                if (hash_content)
+                {
+                    hash384 = std::make_unique<Hash>(
+                        EVP_sha384(), cbspan(offset, sha384_size));
+                }
                 offset += sha384_size;
             }
 
@@ -1024,15 +1074,29 @@ static bool fvm_authenticate(const b0b1_signature* img_sig)
             }
             uint8_t ffs[pbc_hdr->page_size];
             std::fill_n(ffs, pbc_hdr->page_size, 0xff);
-            for (size_t pg = info->start / pbc_hdr->page_size;
-                 pg < info->end / pbc_hdr->page_size; pg++)
+            std::vector<uint8_t> page(stream ? pbc_hdr->page_size : 0);
+            // a quick check does not walk the payload at all
+            size_t end_page = (hash_content ? info->end : info->start) /
+                              pbc_hdr->page_size;
+            for (size_t pg = info->start / pbc_hdr->page_size; pg < end_page;
+                 pg++)
             {
                 const uint8_t* data;
                 FWDEBUG("er: " << std::hex << (int)act_map[pg / 8]
                                << ", cp: " << (int)pbc_map[pg / 8]);
                 bool erase = (act_map[pg / 8] >> (7 - pg % 8)) & 1;
                 bool copy = (pbc_map[pg / 8] >> (7 - pg % 8)) & 1;
-                if (copy)
+                if (copy && stream)
+                {
+                    // payload pages arrive in the order they are used
+                    if (!stream->read(page.data(), page.size()))
+                    {
+                        FWERROR("capsule ends inside the pbc payload");
+                        return false;
+                    }
+                    data = page.data();
+                }
+                else if (copy)
                 {
                     data = payload;
                     FWDEBUG("data page " << pg << " at " << std::hex
@@ -1128,15 +1192,249 @@ static bool fvm_authenticate(const b0b1_signature* img_sig)
     return true;
 }
 
-bool pfr_authenticate(const std::string& filename, bool check_root_key)
+/* authentication result cache, see pfr_set_auth_cache */
+static std::atomic<bool> auth_cache_enabled{false};
+static std::string auth_cache_dir;
+
+static constexpr char auth_record_magic[8] = {'P', 'F', 'R', 'A',
+                                              'U', 'T', 'H', '1'};
+
+struct auth_record
+{
+    char magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint8_t sig_sha384[SHA384_DIGEST_LENGTH]; // outer blk0blk1
+    uint32_t check_root_key;
+    uint32_t rsvd;
+} __attribute__((packed));
+
+/* files written this recently may still be written to, and on some file
+ * systems (FAT) mtime only moves in 2s steps, so they are not cached
+ */
+static constexpr time_t auth_record_min_age = 2;
+/* a change within the timestamp granularity (a clock tick, or 10ms on FAT)
+ * does not move ctime; as only the kernel sets ctime, a record is only
+ * stored once the ctime of the file is older than that
+ */
+static constexpr int64_t auth_record_ctime_margin_ns = 50 * 1000 * 1000;
+
+void pfr_set_auth_cache(bool enable, const std::string& dir)
+{
+    auth_cache_dir = dir;
+    if (!auth_cache_dir.empty() && auth_cache_dir.back() != '/')
+    {
+        auth_cache_dir += '/';
+    }
+    auth_cache_enabled = enable;
+}
+
+/**
+ * @brief This function checks that the cache directory exists and that
+ * only the effective user can change what is in it
+ *
+ * @return true if records can be trusted; false, otherwise
+ */
+static bool auth_cache_usable()
+{
+    if (!auth_cache_enabled)
+    {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(auth_cache_dir, ec);
+    struct stat st;
+    if (::lstat(auth_cache_dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != ::geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+    {
+        FWWARN("not using authentication cache " << auth_cache_dir);
+        return false;
+    }
+    return true;
+}
+
+static std::string auth_record_path(const struct stat& st)
+{
+    std::stringstream path;
+    path << auth_cache_dir << std::hex << st.st_dev << '-' << st.st_ino;
+    return path.str();
+}
+
+static auth_record make_auth_record(const struct stat& st, const cbspan& data,
+                                    bool check_root_key)
+{
+    auth_record rec{};
+    std::copy(std::begin(auth_record_magic), std::end(auth_record_magic),
+              rec.magic);
+    rec.dev = st.st_dev;
+    rec.ino = st.st_ino;
+    rec.size = st.st_size;
+    rec.mtime_sec = st.st_mtim.tv_sec;
+    rec.mtime_nsec = st.st_mtim.tv_nsec;
+    rec.ctime_sec = st.st_ctim.tv_sec;
+    rec.ctime_nsec = st.st_ctim.tv_nsec;
+    hash_sha384(data.data(), std::min(data.size(), blk0blk1_size),
+                rec.sig_sha384);
+    rec.check_root_key = check_root_key;
+    return rec;
+}
+
+/**
+ * @brief This function looks up the record of an earlier authentication;
+ * records that do not match the file any more are removed
+ *
+ * @param st identity of the capsule file
+ * @param data mapped capsule
+ * @param check_root_key whether the root key check is required
+ *
+ * @return true if the file was authenticated before and is unchanged
+ */
+static bool auth_cache_lookup(const struct stat& st, const cbspan& data,
+                              bool check_root_key)
 {
-    boost::iostreams::mapped_file file(filename,
-                                       boost::iostreams::mapped_file::readonly);
-    base_addr = file.const_data();
-    const auto sig = reinterpret_cast<const b0b1_signature*>(file.const_data());
+    TRACE_SPAN("pfr", "auth_cache_lookup");
+    std::string path = auth_record_path(st);
+    int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    auth_record rec;
+    struct stat rst;
+    bool trusted = ::fstat(fd, &rst) == 0 && S_ISREG(rst.st_mode) &&
+                   rst.st_uid == ::geteuid() &&
+                   !(rst.st_mode & (S_IWGRP | S_IWOTH)) &&
+                   ::read(fd, &rec, sizeof(rec)) == sizeof(rec);
+    ::close(fd);
+
+    auth_record expected = make_auth_record(st, data, check_root_key);
+    if (trusted && std::memcmp(&rec, &expected,
+                               offsetof(auth_record, check_root_key)) == 0)
+    {
+        // a record without the root key check does not cover one with it
+        return rec.check_root_key || !check_root_key;
+    }
+    FWDEBUG("removing stale authentication record " << path);
+    ::unlink(path.c_str());
+    return false;
+}
+
+static void auth_cache_store(const struct stat& st, const cbspan& data,
+                             bool check_root_key)
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    int64_t ctime_age_ns = (now.tv_sec - st.st_ctim.tv_sec) * 1000000000LL +
+                           (now.tv_nsec - st.st_ctim.tv_nsec);
+    if (st.st_mtim.tv_sec + auth_record_min_age > now.tv_sec ||
+        ctime_age_ns < auth_record_ctime_margin_ns)
+    {
+        FWDEBUG("capsule changed too recently to cache its authentication");
+        return;
+    }
+    auth_record rec = make_auth_record(st, data, check_root_key);
+    std::string path = auth_record_path(st);
+    std::string tmp = path + ".XXXXXX";
+    int fd = ::mkstemp(tmp.data());
+    if (fd < 0)
+    {
+        FWDEBUG("failed to create " << tmp << ": " << strerror(errno));
+        return;
+    }
+    bool ok = ::write(fd, &rec, sizeof(rec)) == sizeof(rec);
+    ::close(fd);
+    if (!ok || ::rename(tmp.c_str(), path.c_str()) < 0)
+    {
+        ::unlink(tmp.c_str());
+    }
+}
+
+/* true if both stats describe the same, unmodified file */
+static bool same_file_state(const struct stat& a, const struct stat& b)
+{
+    return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+           a.st_size == b.st_size &&
+           a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+           a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+           a.st_ctim.tv_sec == b.st_ctim.tv_sec &&
+           a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+pfr_image::pfr_image(const std::string& filename) :
+    _identified(::stat(filename.c_str(), &_st) == 0),
+    _file(filename, boost::iostreams::mapped_file::readonly),
+    _data(reinterpret_cast<const uint8_t*>(_file.const_data()), _file.size()),
+    _authenticated(false), _pfm(nullptr), _pfm_size(0), _pbc(nullptr)
+{
+    // a file replaced while it was being mapped cannot be identified
+    struct stat st;
+    if (_identified &&
+        (::stat(filename.c_str(), &st) < 0 || !same_file_state(_st, st) ||
+         static_cast<size_t>(st.st_size) != _data.size()))
+    {
+        _identified = false;
+    }
+    FWDEBUG("file mapped " << _data.size() << " bytes at 0x" << std::hex
+                           << reinterpret_cast<unsigned long>(_data.data()));
+}
+
+/**
+ * @brief This function locates the PFM and pbc headers that follow the
+ * package and PFM signatures; headers that are absent or do not fit in the
+ * image are left unset
+ */
+void pfr_image::parse_headers()
+{
+    size_t pfm_start = blk0blk1_size * 2;
+    if (_data.size() < pfm_start + sizeof(pfm))
+    {
+        return;
+    }
+    auto pfm_hdr = reinterpret_cast<const pfm*>(_data.data() + pfm_start);
+    size_t pfm_size = block_round(pfm_hdr->length, pfm_block_size);
+    if (pfm_hdr->magic != pfm_magic || pfm_start + pfm_size > _data.size())
+    {
+        return;
+    }
+    _pfm = pfm_hdr;
+    _pfm_size = pfm_size;
+
+    size_t pbc_start = pfm_start + pfm_size;
+    if (_data.size() < pbc_start + sizeof(pbc))
+    {
+        return;
+    }
+    auto pbc_hdr = reinterpret_cast<const pbc*>(_data.data() + pbc_start);
+    if (pbc_hdr->magic != pbc_magic ||
+        pbc_start + sizeof(pbc) + 2 * (pbc_hdr->bitmap_size / 8) >
+            _data.size())
+    {
+        return;
+    }
+    _pbc = pbc_hdr;
+}
+
+bool pfr_image::authenticate(bool check_root_key, bool quick)
+{
+    TRACE_SPAN("pfr", "pfr_authenticate");
+    probe_phase phase("authenticate");
+    _authenticated = false;
+    bool use_cache = !quick && _identified && auth_cache_usable();
+    bool cached = use_cache && auth_cache_lookup(_st, _data, check_root_key);
+    if (cached)
+    {
+        FWDEBUG("authenticated before, only checking signatures");
+    }
+    const auth_context ctx{_data.data(), check_root_key, !quick && !cached};
+    const auto sig = signature();
     // check for basic shape
-    if (file.size() < blk0blk1_size ||
-        (sig->b0.pc_length + blk0blk1_size) != file.size())
+    if (_data.size() < blk0blk1_size ||
+        (sig->b0.pc_length + blk0blk1_size) != _data.size())
     {
         FWERROR("bad file size");
         return false;
@@ -1144,26 +1442,630 @@ bool pfr_authenticate(const std::string& filename, bool check_root_key)
 
     if (sig->b0.pc_type == pfr_pc_type_combined_cpld_update)
     {
-        auto offset = reinterpret_cast<const uint8_t*>(file.const_data());
-        offset += blk0blk1_size;
+        auto offset = _data.data() + blk0blk1_size;
 
         const auto pfm_sig = reinterpret_cast<const b0b1_signature*>(offset);
 
-        if (!is_signature_valid(pfm_sig, check_root_key))
+        if (!is_signature_valid(ctx, pfm_sig))
         {
             FWERROR("PFM signature not valid");
             return false;
         }
 
-        return pfm_cfm_authenticate(reinterpret_cast<const uint8_t*>(base_addr),
-                                    check_root_key, file.size());
+        _authenticated = pfm_cfm_authenticate(ctx, _data.size());
     }
     // partial images should have the FVM signature checked as well
     else if (sig->b0.pc_type == pfr_pc_type_partial_update)
     {
         // check PFM for FVMs to authenticate
-        return fvm_authenticate(sig);
+        _authenticated = fvm_authenticate(ctx);
+    }
+    else
+    {
+        // non-partial packages only need the outside signature checked
+        _authenticated = true;
+    }
+    if (!_authenticated)
+    {
+        return false;
+    }
+    if (quick)
+    {
+        // the content was not hashed, so this does not authorize writes
+        _authenticated = false;
+        return phase.done(true);
+    }
+    if (use_cache && !cached)
+    {
+        auth_cache_store(_st, _data, check_root_key);
+    }
+    parse_headers();
+    return phase.done(true);
+}
+
+bool pfr_authenticate(const std::string& filename, bool check_root_key,
+                      bool quick)
+{
+    pfr_image image(filename);
+    return image.authenticate(check_root_key, quick);
+}
+
+bool pfr_stream::read(uint8_t* buf, size_t len)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t ret = ::read(_fd, buf + done, len - done);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        }
+        if (ret == 0)
+        {
+            break;
+        }
+        if (_sink)
+        {
+            _sink(cbspan(buf + done, ret));
+        }
+        done += ret;
+        _consumed += ret;
+    }
+    return done == len;
+}
+
+bool pfr_stream::skip(size_t len)
+{
+    std::vector<uint8_t> chunk(std::min(len, pfr_stream_chunk_size));
+    while (len)
+    {
+        size_t count = std::min(len, chunk.size());
+        if (!read(chunk.data(), count))
+        {
+            return false;
+        }
+        len -= count;
+    }
+    return true;
+}
+
+bool pfr_stream::at_end()
+{
+    uint8_t extra;
+    return !read(&extra, sizeof(extra));
+}
+
+/**
+ * @brief read the partial update headers (signatures, FVM, pbc header and
+ * both pbc bitmaps) from the stream, so that only the pbc payload is left
+ *
+ * @param stream capsule stream, positioned after the outer blk0blk1
+ * @param hdrs buffer holding the outer blk0blk1; the headers are appended
+ *
+ * @return true if the headers are complete and of a sane size
+ */
+static bool read_partial_update_headers(pfr_stream& stream,
+                                        std::vector<uint8_t>& hdrs)
+{
+    // fvm signature and the fixed part of the fvm
+    size_t fvm_start = blk0blk1_size * 2;
+    hdrs.resize(fvm_start + sizeof(fvm));
+    if (!stream.read(hdrs.data() + blk0blk1_size,
+                     hdrs.size() - blk0blk1_size))
+    {
+        return false;
+    }
+    auto fvm_hdr = reinterpret_cast<const fvm*>(hdrs.data() + fvm_start);
+    size_t fvm_size = block_round(fvm_hdr->length, fvm_block_size);
+    if (fvm_size < sizeof(fvm) || fvm_size > pfr_pfm_max_size)
+    {
+        FWERROR("fvm size not valid");
+        return false;
+    }
+    // the fvm signature is checked against what is read here, so it
+    // cannot cover more than the fvm
+    auto fvm_sig =
+        reinterpret_cast<const b0b1_signature*>(hdrs.data() + blk0blk1_size);
+    if (fvm_sig->b0.pc_length > fvm_size)
+    {
+        FWERROR("fvm pc_length not valid");
+        return false;
+    }
+
+    // rest of the fvm and the pbc header
+    size_t pbc_start = fvm_start + fvm_size;
+    size_t have = hdrs.size();
+    hdrs.resize(pbc_start + sizeof(pbc));
+    if (!stream.read(hdrs.data() + have, hdrs.size() - have))
+    {
+        return false;
+    }
+    auto pbc_hdr = reinterpret_cast<const pbc*>(hdrs.data() + pbc_start);
+    size_t bitmap_bytes = pbc_hdr->bitmap_size / 8;
+    if (bitmap_bytes > pfr_pfm_max_size || !pbc_hdr->page_size ||
+        pbc_hdr->page_size > pfr_stream_chunk_size)
+    {
+        FWERROR("pbc header not valid");
+        return false;
+    }
+
+    // active and pbc bitmaps
+    have = hdrs.size();
+    hdrs.resize(have + 2 * bitmap_bytes);
+    return stream.read(hdrs.data() + have, hdrs.size() - have);
+}
+
+bool pfr_authenticate_stream(int fd, bool check_root_key,
+                             const pfr_stream::sink_t& sink, bool quick)
+{
+    TRACE_SPAN("pfr", "pfr_authenticate_stream");
+    probe_phase phase("authenticate_stream");
+    pfr_stream stream(fd, sink);
+    std::vector<uint8_t> hdrs(blk0blk1_size);
+    if (!stream.read(hdrs.data(), hdrs.size()))
+    {
+        FWERROR("bad file size");
+        return false;
+    }
+    uint32_t pc_type =
+        reinterpret_cast<const b0b1_signature*>(hdrs.data())->b0.pc_type;
+    size_t img_size =
+        reinterpret_cast<const b0b1_signature*>(hdrs.data())->b0.pc_length +
+        blk0blk1_size;
+
+    bool authentic = true;
+    if (pc_type == pfr_pc_type_combined_cpld_update)
+    {
+        // small enough to be checked as a whole, like a mapped file
+        if (img_size > pfr_combined_cpld_max_size + blk0blk1_size)
+        {
+            FWERROR("combined image too big");
+            return false;
+        }
+        hdrs.resize(img_size);
+        if (!stream.read(hdrs.data() + blk0blk1_size,
+                         img_size - blk0blk1_size))
+        {
+            FWERROR("bad file size");
+            return false;
+        }
+        const auth_context ctx{hdrs.data(), check_root_key, !quick};
+        auto pfm_sig = reinterpret_cast<const b0b1_signature*>(
+            hdrs.data() + blk0blk1_size);
+        if (!is_signature_valid(ctx, pfm_sig))
+        {
+            FWERROR("PFM signature not valid");
+            return false;
+        }
+        authentic = pfm_cfm_authenticate(ctx, img_size);
+    }
+    else if (pc_type == pfr_pc_type_partial_update)
+    {
+        if (!read_partial_update_headers(stream, hdrs) ||
+            stream.consumed() > img_size)
+        {
+            FWERROR("bad file size");
+            return false;
+        }
+        const auth_context ctx{hdrs.data(), check_root_key, !quick};
+        authentic = fvm_authenticate(ctx, &stream);
+    }
+    if (!authentic)
+    {
+        return false;
+    }
+
+    // whatever was not needed for authentication still has to be there
+    if (stream.consumed() > img_size ||
+        !stream.skip(img_size - stream.consumed()) || !stream.at_end())
+    {
+        FWERROR("bad file size");
+        return false;
+    }
+    return phase.done(true);
+}
+
+/* 1 if [addr, addr + len) is in a signed spi region of the PFM, 0 if it
+ * is in an unsigned one or in none, and -1 if the region it starts in
+ * ends inside it; like pbc_apply, the first region that starts at or
+ * before addr and reaches past its first page decides
+ */
+static int pfm_range_signed(const pfm* pfm_hdr, size_t pfm_size,
+                            uint64_t addr, size_t len)
+{
+    auto region_offset = reinterpret_cast<const uint8_t*>(pfm_hdr + 1);
+    auto region_end = region_offset + pfm_size;
+    while (region_offset < region_end)
+    {
+        auto region = reinterpret_cast<const spi_region*>(region_offset);
+        if (region->type == type_spi_region)
+        {
+            if (region->start <= addr)
+            {
+                if (addr + len <= region->end)
+                {
+                    return region->hash_info != 0;
+                }
+                if (addr + pfr_blk_size <= region->end)
+                {
+                    return -1;
+                }
+            }
+            region_offset +=
+                sizeof(spi_region) +
+                (region->hash_info & sha256_present ? sha256_size : 0) +
+                (region->hash_info & sha384_present ? sha384_size : 0);
+        }
+        else if (region->type == type_smbus_rule)
+        {
+            region_offset += sizeof(smbus_rule);
+        }
+        else if (region->type == type_fvm_address)
+        {
+            region_offset += sizeof(fvm_address);
+        }
+        else
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+/* stands in for the device while pbc_apply runs and collects its erases
+ * and programs as update plan runs
+ */
+struct plan_recorder
+{
+    const uint8_t* base;
+    std::vector<update_plan_erase>& erases;
+    std::vector<update_plan_program>& programs;
+    // a plan does all erases before all programs, which only gives the
+    // same flash if no erase reaches back over an earlier one or a program
+    bool ordered = true;
+
+    void erase(uint32_t addr, size_t len)
+    {
+        uint64_t erased = erases.empty() ? 0
+                                         : uint64_t(erases.back().flash_offset) +
+                                               erases.back().length;
+        uint64_t programmed =
+            programs.empty() ? 0
+                             : uint64_t(programs.back().flash_offset) +
+                                   programs.back().length;
+        if (addr < erased || addr < programmed)
+        {
+            ordered = false;
+        }
+        if (!erases.empty() && addr == erased)
+        {
+            erases.back().length += len;
+        }
+        else
+        {
+            erases.push_back({addr, static_cast<uint32_t>(len)});
+        }
+    }
+    int write_raw(uint32_t addr, const cbspan& data)
+    {
+        uint32_t payload_offset = data.data() - base;
+        if (!programs.empty())
+        {
+            update_plan_program& last = programs.back();
+            if (uint64_t(last.flash_offset) + last.length == addr &&
+                uint64_t(last.payload_offset) + last.length == payload_offset)
+            {
+                last.length += data.size();
+                return data.size();
+            }
+        }
+        programs.push_back(
+            {addr, payload_offset, static_cast<uint32_t>(data.size())});
+        return data.size();
+    }
+    void skip_unsigned(uint32_t, size_t)
+    {
+    }
+};
+
+bool update_plan::build(const pfr_image& image, bool recovery_reset)
+{
+    if (!image.authenticated())
+    {
+        FWERROR("refusing to plan an unauthenticated image");
+        return false;
+    }
+    return build(image.data(), image.pfm_header(), image.pfm_size(),
+                 image.pbc_header(), image.signature()->b0.sha384,
+                 recovery_reset);
+}
+
+/* where the payload of a pbc starts and ends within its capsule; false if
+ * there is no pbc or the payload does not fit
+ */
+static bool pbc_payload_range(const cbspan& capsule, const pfm* pfm_hdr,
+                              const pbc* pbc_hdr, uint64_t& payload_start,
+                              uint64_t& payload_end)
+{
+    if (!pfm_hdr || !pbc_hdr || pbc_hdr->magic != pbc_magic)
+    {
+        FWERROR("capsule has no pbc to plan");
+        return false;
+    }
+    auto payload = reinterpret_cast<const uint8_t*>(pbc_hdr + 1) +
+                   2 * (pbc_hdr->bitmap_size / 8);
+    payload_start = payload - capsule.data();
+    payload_end = payload_start + pbc_hdr->payload_length;
+    if (payload_end > capsule.size())
+    {
+        FWERROR("pbc payload runs past the end of the capsule");
+        return false;
+    }
+    return true;
+}
+
+/* the runs pbc_apply issues for a pbc, each program checked to read from
+ * the payload that the pbc header declares
+ */
+static bool record_plan(const cbspan& capsule, const pfm* pfm_hdr,
+                        size_t pfm_size, const pbc* pbc_hdr,
+                        bool recovery_reset,
+                        std::vector<update_plan_erase>& erases,
+                        std::vector<update_plan_program>& programs)
+{
+    uint64_t payload_start, payload_end;
+    if (!pbc_payload_range(capsule, pfm_hdr, pbc_hdr, payload_start,
+                           payload_end))
+    {
+        return false;
+    }
+
+    erases.clear();
+    programs.clear();
+    plan_recorder recorder{capsule.data(), erases, programs};
+    if (!pbc_apply(recorder, pfm_hdr, pfm_size, pbc_hdr, 0, recovery_reset))
+    {
+        return false;
+    }
+    if (!recorder.ordered)
+    {
+        FWERROR("pbc erases out of order and cannot be planned");
+        return false;
+    }
+    for (const update_plan_program& run : programs)
+    {
+        if (run.payload_offset < payload_start ||
+            uint64_t(run.payload_offset) + run.length > payload_end)
+        {
+            FWERROR("pbc copies more pages than its payload holds");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool update_plan::build(const cbspan& capsule, const pfm* pfm_hdr,
+                        size_t pfm_size, const pbc* pbc_hdr,
+                        const uint8_t* sha384, bool recovery_reset)
+{
+    std::copy(sha384, sha384 + sha384_size, _sha384.begin());
+    _recovery_reset = recovery_reset;
+    return record_plan(capsule, pfm_hdr, pfm_size, pbc_hdr, recovery_reset,
+                       _erases, _programs);
+}
+
+update_plan update_plan::load(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+    {
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(path));
+    }
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)),
+                              std::istreambuf_iterator<char>());
+    update_plan_header header;
+    if (file.size() < sizeof(header))
+    {
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("not an update plan"));
+    }
+    std::memcpy(&header, file.data(), sizeof(header));
+    uint64_t runs_size =
+        uint64_t(header.erase_runs) * sizeof(update_plan_erase) +
+        uint64_t(header.program_runs) * sizeof(update_plan_program);
+    if (std::memcmp(header.magic, update_plan_magic, sizeof(header.magic)) ||
+        header.version != update_plan_version ||
+        file.size() != sizeof(header) + runs_size)
+    {
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("not an update plan"));
+    }
+    const uint8_t* runs = file.data() + sizeof(header);
+    if (fast_hash64(runs, runs_size) != header.hash)
+    {
+        THROW(FileIOError() << boost::errinfo_file_name(path)
+                            << msg_info("update plan is corrupted"));
+    }
+
+    update_plan plan;
+    std::copy(header.sha384, header.sha384 + sha384_size,
+              plan._sha384.begin());
+    plan._recovery_reset = header.flags & update_plan_recovery_reset;
+    plan._erases.resize(header.erase_runs);
+    std::memcpy(plan._erases.data(), runs,
+                header.erase_runs * sizeof(update_plan_erase));
+    runs += header.erase_runs * sizeof(update_plan_erase);
+    plan._programs.resize(header.program_runs);
+    std::memcpy(plan._programs.data(), runs,
+                header.program_runs * sizeof(update_plan_program));
+    return plan;
+}
+
+void update_plan::save(const std::string& path) const
+{
+    std::vector<uint8_t> runs(_erases.size() * sizeof(update_plan_erase) +
+                              _programs.size() * sizeof(update_plan_program));
+    std::memcpy(runs.data(), _erases.data(),
+                _erases.size() * sizeof(update_plan_erase));
+    std::memcpy(runs.data() + _erases.size() * sizeof(update_plan_erase),
+                _programs.data(),
+                _programs.size() * sizeof(update_plan_program));
+
+    update_plan_header header{};
+    std::memcpy(header.magic, update_plan_magic, sizeof(header.magic));
+    header.version = update_plan_version;
+    header.flags = _recovery_reset ? update_plan_recovery_reset : 0;
+    std::copy(_sha384.begin(), _sha384.end(), header.sha384);
+    header.erase_runs = _erases.size();
+    header.program_runs = _programs.size();
+    header.hash = fast_hash64(runs.data(), runs.size());
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(runs.data()), runs.size());
+    out.close();
+    if (!out)
+    {
+        THROW(FileIOError() << boost::errinfo_errno(errno)
+                            << boost::errinfo_file_name(path));
+    }
+}
+
+bool update_plan::validate(const pfr_image& image, bool recovery_reset) const
+{
+    return validate(image.data(), image.pfm_header(), image.pfm_size(),
+                    image.pbc_header(), image.signature()->b0.sha384,
+                    recovery_reset);
+}
+
+bool update_plan::validate(const cbspan& capsule, const pfm* pfm_hdr,
+                           size_t pfm_size, const pbc* pbc_hdr,
+                           const uint8_t* sha384, bool recovery_reset) const
+{
+    if (std::memcmp(sha384, _sha384.data(), sha384_size))
+    {
+        FWERROR("update plan is for a different capsule");
+        return false;
+    }
+    if (recovery_reset != _recovery_reset)
+    {
+        FWERROR("update plan was made " << (_recovery_reset ? "with" : "without")
+                                        << " -r");
+        return false;
+    }
+
+    // the plan file is not signed, so every run is checked against the
+    // bits of the authenticated pbc that it covers, in one pass over the
+    // bitmaps: the erases have to be exactly the 64K blocks that pbc_apply
+    // erases, and the programs exactly its pages with the erase and copy
+    // bits, in address order, from consecutive payload pages
+    uint64_t payload_start, payload_end;
+    if (!pbc_payload_range(capsule, pfm_hdr, pbc_hdr, payload_start,
+                           payload_end))
+    {
+        return false;
+    }
+    auto act_map = reinterpret_cast<const uint8_t*>(pbc_hdr + 1);
+    auto pbc_map = act_map + pbc_hdr->bitmap_size / 8;
+    const uint64_t flash_size = uint64_t(pbc_hdr->bitmap_size) * pfr_blk_size;
+    auto mismatch = [] {
+        FWERROR("update plan does not match the pbc of the capsule");
+        return false;
+    };
+
+    size_t run = 0;
+    uint64_t erased_to = 0;
+    for (uint32_t b8 = 0; b8 + 1 < pbc_hdr->bitmap_size / 8; b8 += 2)
+    {
+        uint64_t addr = uint64_t(b8) * 8 * pfr_blk_size;
+        bool erase = act_map[b8] || act_map[b8 + 1];
+        if (erase && (act_map[b8] != 0xff || act_map[b8 + 1] != 0xff))
+        {
+            FWERROR("pbc erases less than 64K at " << std::hex << addr);
+            return false;
+        }
+        // erase-only blocks of unsigned regions are kept without -r
+        if (erase && !recovery_reset && !pbc_map[b8] && !pbc_map[b8 + 1])
+        {
+            int is_signed = pfm_range_signed(pfm_hdr, pfm_size, addr,
+                                             BIG_BLOCK_SIZE);
+            if (is_signed < 0)
+            {
+                return mismatch();
+            }
+            erase = is_signed;
+        }
+        if (run < _erases.size() && addr >= erased_to)
+        {
+            const update_plan_erase& next = _erases[run];
+            if (next.flash_offset % BIG_BLOCK_SIZE ||
+                next.length % BIG_BLOCK_SIZE || !next.length ||
+                next.flash_offset < erased_to ||
+                uint64_t(next.flash_offset) + next.length > flash_size)
+            {
+                return mismatch();
+            }
+            if (next.flash_offset == addr)
+            {
+                erased_to = uint64_t(next.flash_offset) + next.length;
+                run++;
+            }
+        }
+        if (erase != (addr < erased_to))
+        {
+            return mismatch();
+        }
+    }
+    if (run != _erases.size() ||
+        (pbc_hdr->bitmap_size / 8 % 2 && act_map[pbc_hdr->bitmap_size / 8 - 1]))
+    {
+        return mismatch();
+    }
+
+    // pbc_apply only copies pages that it also erases, and takes their
+    // data from the payload in address order
+    uint64_t pages = 0;
+    for (uint32_t b8 = 0; b8 < pbc_hdr->bitmap_size / 8; b8++)
+    {
+        pages += std::popcount(uint8_t(act_map[b8] & pbc_map[b8]));
+    }
+    uint64_t payload_next = payload_start;
+    uint64_t programmed_to = 0;
+    for (const update_plan_program& next : _programs)
+    {
+        if (next.flash_offset % pfr_blk_size || next.length % pfr_blk_size ||
+            !next.length || next.flash_offset < programmed_to ||
+            uint64_t(next.flash_offset) + next.length > flash_size ||
+            next.payload_offset != payload_next)
+        {
+            return mismatch();
+        }
+        for (uint64_t page = next.flash_offset / pfr_blk_size;
+             page < (uint64_t(next.flash_offset) + next.length) / pfr_blk_size;
+             page++)
+        {
+            uint8_t bit = 0x80 >> (page % 8);
+            if (!(act_map[page / 8] & pbc_map[page / 8] & bit))
+            {
+                return mismatch();
+            }
+        }
+        programmed_to = uint64_t(next.flash_offset) + next.length;
+        payload_next += next.length;
+    }
+    if (payload_next != payload_start + pages * pfr_blk_size)
+    {
+        return mismatch();
+    }
+    if (payload_next > payload_end)
+    {
+        FWERROR("pbc copies more pages than its payload holds");
+        return false;
     }
-    // non-partial packages only need the outside signature checked
     return true;
 }
@@ -17,18 +17,29 @@
 
 #pragma once
 
+#include <sys/stat.h>
+
+#include <array>
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <mutex>
 #include <sdbusplus/bus.hpp>
 #include <string>
 
 #include "debug.h"
 #include "exceptions.h"
+#include "hash.hpp"
 #include "mtd.h"
+#include "probes.h"
+#include "trace.h"
 
 constexpr uint32_t pfr_pc_type_cpld_update = 0x00;
 constexpr uint32_t pfr_pc_type_pch_pfm = 0x01;
@@ -395,39 +406,528 @@ struct pbc
     // payload
 } __attribute__((packed));
 
-static std::string serviceName;
-static std::string pfrPath;
+/*
+ * A delta pbc (pfr delta) only gives the new image on flash that holds the
+ * image it was made from. It keeps this in the reserved bytes of its
+ * header: the copy ranges it was made for, in 64K blocks (end exclusive,
+ * unused ranges empty), and the SHA-384 of the old image's blocks in
+ * those ranges that it neither erases nor copies.
+ */
+constexpr uint32_t pbc_delta_magic = 0x544c4544; // "DELT"
+constexpr size_t pbc_delta_block_size = 64 * 1024;
+constexpr size_t pbc_delta_max_ranges = 12;
+struct pbc_delta_info
+{
+    uint32_t magic;
+    uint8_t base_sha384[sha384_size];
+    struct
+    {
+        uint16_t start;
+        uint16_t end;
+    } __attribute__((packed)) ranges[pbc_delta_max_ranges];
+} __attribute__((packed));
+static_assert(sizeof(pbc_delta_info) <= sizeof(pbc::rsvd));
+
 struct SubPartitionProperties
 {
     std::string name;
     uint64_t offset;
     uint64_t size;
 };
+
+/**
+ * @brief PFM placement as described by the PFR entity-manager configuration
+ */
+struct PfrLayout
+{
+    uint32_t pfmOffset = 0;
+    uint32_t pfmSize = 0;
+    uint32_t partitionNum = 0;
+    std::vector<SubPartitionProperties> subPartitions;
+};
+
 using DbusSubtree =
     std::map<std::string, std::map<std::string, std::vector<std::string>>>;
 using PropertiesType =
     std::vector<std::pair<std::string, std::variant<std::string, uint64_t>>>;
+// entity-manager exposes every configuration record through one
+// ObjectManager, so this must cover all of its property types
+using DbusVariant =
+    std::variant<std::string, bool, uint64_t, int64_t, double,
+                 std::vector<std::string>, std::vector<uint64_t>,
+                 std::vector<int64_t>, std::vector<double>>;
+using ManagedObjectType = std::map<
+    sdbusplus::message::object_path,
+    std::map<std::string, std::map<std::string, DbusVariant>>>;
+
+constexpr const char* entityManagerService = "xyz.openbmc_project.EntityManager";
+constexpr const char* entityManagerRoot = "/xyz/openbmc_project/inventory";
+constexpr const char* pfrConfigInterface =
+    "xyz.openbmc_project.Configuration.PFR";
+constexpr const char* pfrSubPartitionInterface =
+    "xyz.openbmc_project.Configuration.PFR.SubPartition";
+// entity-manager rewrites this whenever the configuration changes
+constexpr const char* pfrConfigurationFile = "/var/configuration/system.json";
+constexpr const char* pfrLayoutCacheFile = "/var/cache/mtd-util/pfr-layout";
+
+#ifdef MTD_EMULATION
+#define PFR_AUTH_CACHE_DIR "run/mtd-util/auth-cache/"
+#else /* !MTD_EMULATION */
+#define PFR_AUTH_CACHE_DIR "/run/mtd-util/auth-cache/"
+#endif /* MTD_EMULATION */
+
+/**
+ * @brief Enable or disable the authentication result cache (off by default)
+ *
+ * When enabled, every successful full authentication of a capsule file
+ * leaves a record in dir, keyed by the device and inode of the file. It
+ * holds the size, mtime and ctime of the file and the SHA-384 of its
+ * signature blocks. A later authentication of the same unchanged file
+ * only re-checks the signatures and skips hashing the protected content.
+ * Records that no longer match their file are removed. The directory must
+ * be owned by the effective user and not writable by anyone else, or the
+ * cache is not used.
+ *
+ * @param enable true to use the cache
+ * @param dir directory to keep the records in
+ */
+void pfr_set_auth_cache(bool enable,
+                        const std::string& dir = PFR_AUTH_CACHE_DIR);
+
+/**
+ * @brief A capsule that is mapped, authenticated and parsed once
+ *
+ * The handle owns the only mapping of the capsule. Once authenticated, it
+ * carries the header pointers that the write engines need, so they do not
+ * map or parse the file again.
+ */
+class pfr_image
+{
+  public:
+    pfr_image(const pfr_image&) = delete;
+    pfr_image& operator=(const pfr_image&) = delete;
+
+    /**
+     * @brief map a capsule (throws if the file cannot be mapped)
+     *
+     * @param filename capsule to map
+     */
+    explicit pfr_image(const std::string& filename);
+
+    /**
+     * @brief authenticate the capsule and locate its PFM and pbc headers
+     *
+     * @param check_root_key compare the root key with the one in the
+     * active PFM
+     * @param quick only check the headers and signatures, not the hash of
+     * the content; a quick check leaves the image unauthenticated
+     *
+     * With the authentication cache enabled, a full check of a file that
+     * was already authenticated and has not changed since only checks the
+     * signatures.
+     *
+     * @return true if the capsule is authentic; false, otherwise
+     */
+    bool authenticate(bool check_root_key, bool quick = false);
+
+    bool authenticated() const
+    {
+        return _authenticated;
+    }
+    const cbspan& data() const
+    {
+        return _data;
+    }
+    const b0b1_signature* signature() const
+    {
+        return reinterpret_cast<const b0b1_signature*>(_data.data());
+    }
+    /* PFM following the PFM signature, or nullptr if there is none */
+    const pfm* pfm_header() const
+    {
+        return _pfm;
+    }
+    /* size of the PFM body, rounded to pfm_block_size */
+    size_t pfm_size() const
+    {
+        return _pfm_size;
+    }
+    /* pbc header following the PFM, or nullptr if there is none */
+    const pbc* pbc_header() const
+    {
+        return _pbc;
+    }
+    const uint8_t* act_map() const
+    {
+        return reinterpret_cast<const uint8_t*>(_pbc + 1);
+    }
+    const uint8_t* pbc_map() const
+    {
+        return act_map() + _pbc->bitmap_size / 8;
+    }
+    /* first page of the compressed payload */
+    const uint8_t* payload() const
+    {
+        return pbc_map() + _pbc->bitmap_size / 8;
+    }
+
+  private:
+    void parse_headers();
+
+    /* identity of the mapped file, if it was stable while mapping */
+    struct stat _st;
+    bool _identified;
+    boost::iostreams::mapped_file _file;
+    cbspan _data;
+    bool _authenticated;
+    const pfm* _pfm;
+    size_t _pfm_size;
+    const pbc* _pbc;
+};
+
+/*
+ * An update plan is the erase and program schedule that pfr_write derives
+ * from the pbc bitmaps of a capsule, computed once (pfr plan) and shipped
+ * next to the capsule, with adjacent erases and programs joined into runs.
+ * It names its capsule by the SHA-384 of the protected content in block0,
+ * but the file itself is not signed: before it is executed, pfr write
+ * checks every run against the bitmaps of the authenticated capsule and
+ * refuses a plan that erases or programs anything else.
+ *
+ * The file is an update_plan_header, the erase runs and then the program
+ * runs, in host byte order (little endian on BMCs). Offsets are from the
+ * start of the image on flash and from the start of the capsule file.
+ */
+constexpr char update_plan_magic[8] = {'P', 'F', 'R', 'P', 'L', 'A', 'N', '1'};
+constexpr uint32_t update_plan_version = 1;
+constexpr uint32_t update_plan_recovery_reset = 1 << 0;
+
+struct update_plan_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint8_t sha384[sha384_size]; // blk0 sha384 of the capsule
+    uint32_t erase_runs;
+    uint32_t program_runs;
+    uint64_t hash; // fast_hash64 of the runs
+} __attribute__((packed));
+
+struct update_plan_erase
+{
+    uint32_t flash_offset;
+    uint32_t length;
+} __attribute__((packed));
+
+struct update_plan_program
+{
+    uint32_t flash_offset;
+    uint32_t payload_offset;
+    uint32_t length;
+} __attribute__((packed));
+
+class update_plan
+{
+  public:
+    /**
+     * @brief derive the plan from the pbc of an authenticated capsule
+     *
+     * @param image capsule to plan the update for
+     * @param recovery_reset plan for pfr write -r (erase unsigned regions)
+     *
+     * @return true if the pbc could be planned; false, otherwise
+     */
+    bool build(const pfr_image& image, bool recovery_reset);
+
+    /**
+     * @brief derive the plan from a pbc
+     *
+     * @param capsule whole capsule, for the payload offsets
+     * @param pfm_hdr PFM of the capsule
+     * @param pfm_size size of the PFM body
+     * @param pbc_hdr pbc header within capsule
+     * @param sha384 blk0 sha384 of the capsule
+     * @param recovery_reset plan for pfr write -r
+     *
+     * @return true if the pbc could be planned; false, otherwise
+     */
+    bool build(const cbspan& capsule, const pfm* pfm_hdr, size_t pfm_size,
+               const pbc* pbc_hdr, const uint8_t* sha384,
+               bool recovery_reset);
+
+    /**
+     * @brief read a plan (throws FileIOError if it is not one)
+     *
+     * @param path plan file
+     */
+    static update_plan load(const std::string& path);
+    void save(const std::string& path) const;
+
+    /**
+     * @brief check the plan against the capsule it is about to write
+     *
+     * Each run is checked against the pbc bits it covers, in one pass
+     * over the bitmaps and without touching flash: the erases have to be
+     * the 64K blocks pbc_apply erases, and the programs its copied pages,
+     * in address order and from consecutive pages of the payload the pbc
+     * declares. The bitmaps are not walked block by block as in
+     * pbc_apply.
+     *
+     * @param image authenticated capsule
+     * @param recovery_reset whether pfr write was given -r
+     *
+     * @return true if the plan may be executed; false, otherwise
+     */
+    bool validate(const pfr_image& image, bool recovery_reset) const;
+    bool validate(const cbspan& capsule, const pfm* pfm_hdr, size_t pfm_size,
+                  const pbc* pbc_hdr, const uint8_t* sha384,
+                  bool recovery_reset) const;
+
+    /* all erases, then all programs, with data from capsule_base */
+    template <typename deviceT>
+    void execute(deviceT& dev, const uint8_t* capsule_base,
+                 size_t dev_offset) const
+    {
+        for (const update_plan_erase& run : _erases)
+        {
+            dev.erase(run.flash_offset + dev_offset, run.length);
+        }
+        for (const update_plan_program& run : _programs)
+        {
+            dev.write_raw(run.flash_offset + dev_offset,
+                          cbspan(capsule_base + run.payload_offset,
+                                 capsule_base + run.payload_offset +
+                                     run.length));
+        }
+    }
 
-bool pfr_authenticate(const std::string& filename, bool check_root_key);
+    const std::vector<update_plan_erase>& erases() const
+    {
+        return _erases;
+    }
+    const std::vector<update_plan_program>& programs() const
+    {
+        return _programs;
+    }
+    bool recovery_reset() const
+    {
+        return _recovery_reset;
+    }
+
+  private:
+    std::array<uint8_t, sha384_size> _sha384;
+    bool _recovery_reset = false;
+    std::vector<update_plan_erase> _erases;
+    std::vector<update_plan_program> _programs;
+};
+
+bool pfr_authenticate(const std::string& filename, bool check_root_key,
+                      bool quick = false);
+
+// capsules read from a pipe or socket are consumed in chunks of this size
+constexpr size_t pfr_stream_chunk_size = 64 * 1024;
+
+/**
+ * @brief Sequential reader for a capsule arriving on a file descriptor
+ *
+ * Bytes can only be consumed in order. Every consumed byte is also passed
+ * to the optional sink, which allows a capsule to be staged as it arrives.
+ */
+class pfr_stream
+{
+  public:
+    using sink_t = std::function<void(const cbspan&)>;
+
+    pfr_stream(int fd, const sink_t& sink) : _fd(fd), _sink(sink), _consumed(0)
+    {
+    }
+
+    /**
+     * @brief read exactly len bytes into buf
+     *
+     * @return true if len bytes were read; false on a short stream
+     */
+    bool read(uint8_t* buf, size_t len);
+
+    /**
+     * @brief consume len bytes without keeping them
+     *
+     * @return true if len bytes were consumed; false on a short stream
+     */
+    bool skip(size_t len);
+
+    /**
+     * @brief check that the stream has no bytes left
+     *
+     * @return true at end of stream; false if more data follows
+     */
+    bool at_end();
+
+    size_t consumed() const
+    {
+        return _consumed;
+    }
+
+  private:
+    int _fd;
+    sink_t _sink;
+    size_t _consumed;
+};
+
+/**
+ * @brief Authenticate a capsule read sequentially from a file descriptor
+ *
+ * This gives the same verdict as the mapped pfr_authenticate, but only
+ * keeps the capsule headers and one chunk of payload in memory, so a
+ * capsule can be checked as it arrives on stdin or a socket.
+ *
+ * @param fd file descriptor to read the capsule from
+ * @param check_root_key compare the root key with the one in the active PFM
+ * @param sink optional consumer of every byte read from fd
+ * @param quick only check the headers and signatures, not the hash of the
+ * content; the rest of the capsule is still read, but not hashed
+ *
+ * @return true if the capsule is authentic; false, otherwise
+ */
+bool pfr_authenticate_stream(int fd, bool check_root_key,
+                             const pfr_stream::sink_t& sink = nullptr,
+                             bool quick = false);
+
+/**
+ * @brief Read the FM_BOARD_SKU_ID0..5 lines as one board ID value
+ *
+ * @param boardId output board ID (bit N is FM_BOARD_SKU_IDN)
+ *
+ * @return true if all lines were read; false, otherwise
+ */
+bool getBoardId(uint8_t& boardId);
+
+/**
+ * @brief Copy an authenticated capsule to the staging area
+ *
+ * @param dev staging device
+ * @param image authenticated capsule
+ * @param offset staging offset in dev
+ * @param erased true if the staging range was already erased
+ *
+ * @return true if the capsule was staged; false, otherwise
+ */
+template <typename deviceClassT>
+bool pfr_stage(mtd<deviceClassT>& dev, const pfr_image& image, size_t offset,
+               bool erased = false)
+{
+    TRACE_SPAN("pfr", "pfr_stage");
+    probe_phase phase("stage");
+    if (!image.authenticated())
+    {
+        FWERROR("refusing to stage an unauthenticated image");
+        return false;
+    }
+    if (!erased)
+    {
+        dev.erase(offset, image.data().size());
+    }
+    dev.write_raw(offset, image.data());
+    return phase.done(true);
+}
 
 template <typename deviceClassT>
 bool pfr_stage(mtd<deviceClassT>& dev, const std::string& filename,
                size_t offset)
 {
-    if (!pfr_authenticate(filename, true))
+    pfr_image image(filename);
+
+    // the staging area is scratch space, so it is erased while the capsule
+    // is authenticated; it is left erased if authentication fails
+    auto erase = std::async(std::launch::async, [&dev, &image, offset]() {
+        dev.erase(offset, image.data().size());
+    });
+    bool authentic = image.authenticate(true);
+    erase.get();
+    if (!authentic)
     {
         return false;
     }
-    boost::iostreams::mapped_file file(filename,
-                                       boost::iostreams::mapped_file::readonly);
-    auto map_base = reinterpret_cast<const uint8_t*>(file.const_data());
-    size_t img_size = file.size();
+    return pfr_stage(dev, image, offset, true);
+}
 
-    dev.erase(offset, img_size);
+/**
+ * @brief Stage a capsule read from a file descriptor
+ *
+ * The capsule is authenticated as it arrives and written to the staging
+ * area, which is erased ahead of it, one chunk at a time. Its first 64K,
+ * which hold the signature blocks, are kept in memory and only written
+ * once the capsule was found authentic and complete, so the staging area
+ * never holds something that looks like a capsule before then. On any
+ * failure, what was written is erased again.
+ *
+ * @param dev staging device
+ * @param fd file descriptor to read the capsule from
+ * @param offset staging offset in dev
+ * @param complete optional check, after the capsule was read and before
+ * its first 64K are written, that the source delivered all of it
+ *
+ * @return true if the capsule was authentic and staged; false, otherwise
+ */
+template <typename deviceClassT>
+bool pfr_stage(mtd<deviceClassT>& dev, int fd, size_t offset,
+               const std::function<bool()>& complete = nullptr)
+{
+    std::vector<uint8_t> head;
+    head.reserve(BIG_BLOCK_SIZE);
+    size_t received = 0;
+    size_t erased = 0;
+    auto stream = [&](const cbspan& data) {
+        if (offset + received + data.size() > dev.size())
+        {
+            THROW(FileIOError() << msg_info("capsule exceeds staging area"));
+        }
+        if (received + data.size() > erased)
+        {
+            size_t len = block_round(received + data.size() - erased,
+                                     BIG_BLOCK_SIZE);
+            len = std::min(len, dev.size() - offset - erased);
+            dev.erase(offset + erased, len);
+            erased += len;
+        }
+        size_t held = std::min(data.size(), head.capacity() - head.size());
+        head.insert(head.end(), data.begin(), data.begin() + held);
+        if (held < data.size())
+        {
+            dev.write_raw(offset + received + held,
+                          cbspan(data.data() + held, data.size() - held));
+        }
+        received += data.size();
+    };
 
-    cbspan rc_img_data(map_base, map_base + img_size);
-    dev.write_raw(offset, rc_img_data);
-    return true;
+    bool staged = false;
+    try
+    {
+        staged = pfr_authenticate_stream(fd, true, stream) &&
+                 (!complete || complete());
+        if (staged)
+        {
+            TRACE_SPAN("pfr", "pfr_stage");
+            probe_phase phase("stage");
+            dev.write_raw(offset, head);
+            FWDEBUG("staged " << std::hex << received << " bytes at "
+                              << offset);
+            return phase.done(true);
+        }
+    }
+    catch (...)
+    {
+        if (erased)
+        {
+            dev.erase(offset, erased);
+        }
+        throw;
+    }
+    if (erased)
+    {
+        dev.erase(offset, erased);
+    }
+    return false;
 }
 
 inline PropertiesType getAllProperties(sdbusplus::bus::bus& bus,
@@ -435,6 +935,7 @@ inline PropertiesType getAllProperties(sdbusplus::bus::bus& bus,
                                        const std::string& objPath,
                                        const std::string& interface)
 {
+    TRACE_SPAN("dbus", "GetAll");
     PropertiesType properties;
 
     try
@@ -460,6 +961,7 @@ inline DbusSubtree getSubTree(sdbusplus::bus::bus& bus, const std::string& path,
                               const std::vector<std::string>& interfaces,
                               int32_t depth)
 {
+    TRACE_SPAN("dbus", "GetSubTree");
     DbusSubtree response;
 
     try
@@ -483,206 +985,423 @@ inline DbusSubtree getSubTree(sdbusplus::bus::bus& bus, const std::string& path,
     return response;
 }
 
-inline bool pfm_layout(uint32_t& pfm_address, uint32_t& pfm_region_size,
-                       uint32_t& partition_num)
+inline ManagedObjectType getManagedObjects(sdbusplus::bus::bus& bus,
+                                           const std::string& service,
+                                           const std::string& path)
 {
-    auto bus = sdbusplus::bus::new_default();
+    TRACE_SPAN("dbus", "GetManagedObjects");
+    ManagedObjectType response;
 
-    std::vector<std::string> interfaces = {
-        "xyz.openbmc_project.Configuration.PFR"};
-    auto subTree =
-        getSubTree(bus, "/xyz/openbmc_project/inventory/system", interfaces, 0);
+    try
+    {
+        auto methodCall = bus.new_method_call(
+            service.c_str(), path.c_str(),
+            "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
 
-    if (subTree.empty())
+        auto reply = bus.call(methodCall);
+
+        reply.read(response);
+    }
+    catch (const std::exception& e)
     {
-        FWDEBUG("No PFR objects found.");
-        return false;
+        FWDEBUG("Failed to get managed objects from " << service << ": "
+                                                      << e.what());
     }
+    return response;
+}
 
-    bool foundValidPfm = false;
+/**
+ * @brief Pick the PFM placement out of a PFR interface property list
+ *
+ * @return true if both PFMOffset and PFMSize were found; false, otherwise
+ */
+template <typename PropertyList>
+bool readPfrProperties(const PropertyList& propertiesList, PfrLayout& layout)
+{
+    const uint64_t* pfm_offset = nullptr;
+    const uint64_t* pfm_size = nullptr;
 
-    for (const auto& [objPath, serviceVec] : subTree)
+    for (const auto& [propName, propVariant] : propertiesList)
     {
-        if (!serviceVec.empty() && boost::ends_with(objPath, "/PFR"))
+        if (propName == "PFMOffset")
         {
-            serviceName = serviceVec.begin()->first;
-            pfrPath = objPath;
-            FWDEBUG("Found PFR object at: " << objPath << " with service: "
-                                            << serviceName);
-
-            auto propertiesList =
-                getAllProperties(bus, serviceName, objPath,
-                                 "xyz.openbmc_project.Configuration.PFR");
+            pfm_offset = std::get_if<uint64_t>(&propVariant);
+            if (pfm_offset)
+            {
+                layout.pfmOffset = static_cast<uint32_t>(*pfm_offset);
+                FWDEBUG("PFMOffset: 0x" << std::hex << layout.pfmOffset);
+            }
+        }
+        else if (propName == "PFMSize")
+        {
+            pfm_size = std::get_if<uint64_t>(&propVariant);
+            if (pfm_size)
+            {
+                layout.pfmSize = static_cast<uint32_t>(*pfm_size);
+                FWDEBUG("PFMSize: 0x" << std::hex << layout.pfmSize);
+            }
+        }
+        else if (propName == "PartitionNo")
+        {
+            auto pfm_subpart_num = std::get_if<uint64_t>(&propVariant);
+            if (pfm_subpart_num)
+            {
+                layout.partitionNum = static_cast<uint32_t>(*pfm_subpart_num);
+                FWDEBUG("PartitionNo: " << std::hex << layout.partitionNum);
+            }
+        }
+    }
+    return pfm_offset && pfm_size;
+}
 
-            const uint64_t* pfm_offset = nullptr;
-            const uint64_t* pfm_size = nullptr;
-            const uint64_t* pfm_subpart_num = nullptr;
+/**
+ * @brief Pick the sub-partition placement out of a SubPartitionN interface
+ * property list
+ *
+ * @return true if Name, Offset and Size were all found; false, otherwise
+ */
+template <typename PropertyList>
+bool readSubPartitionProperties(const PropertyList& propertiesList,
+                                const std::string& interfaceName,
+                                SubPartitionProperties& properties)
+{
+    bool nameFound = false, offsetFound = false, sizeFound = false;
 
-            for (const auto& [propName, propVariant] : propertiesList)
+    for (const auto& [propName, propVariant] : propertiesList)
+    {
+        if (propName == "Name")
+        {
+            auto namePtr = std::get_if<std::string>(&propVariant);
+            if (namePtr)
             {
-                if (propName == "PFMOffset")
-                {
-                    pfm_offset = std::get_if<uint64_t>(&propVariant);
-                    if (pfm_offset)
-                    {
-                        pfm_address = static_cast<uint32_t>(*pfm_offset);
-                        FWDEBUG("PFMOffset: 0x" << std::hex << pfm_address);
-                    }
-                }
-                else if (propName == "PFMSize")
-                {
-                    pfm_size = std::get_if<uint64_t>(&propVariant);
-                    if (pfm_size)
-                    {
-                        pfm_region_size = static_cast<uint32_t>(*pfm_size);
-                        FWDEBUG("PFMSize: 0x" << std::hex << pfm_region_size);
-                    }
-                }
-                else if (propName == "PartitionNo")
-                {
-                    pfm_subpart_num = std::get_if<uint64_t>(&propVariant);
-                    if (pfm_subpart_num)
-                    {
-                        partition_num = static_cast<uint32_t>(*pfm_subpart_num);
-                        FWDEBUG("PartitionNo: " << std::hex << partition_num);
-                    }
-                }
+                properties.name = *namePtr;
+                nameFound = true;
+                FWDEBUG("subpartition name: " << properties.name
+                                              << " for the interface: "
+                                              << interfaceName);
             }
-            // Check if both PFMOffset and PFMSize are found for the current
-            // object
-            if (pfm_offset && pfm_size)
+        }
+        else if (propName == "Offset")
+        {
+            auto offsetPtr = std::get_if<uint64_t>(&propVariant);
+            if (offsetPtr)
             {
-                foundValidPfm = true;
-                break;
+                properties.offset = *offsetPtr;
+                offsetFound = true;
+                FWDEBUG("subpartition offset: " << properties.offset
+                                                << " for the interface: "
+                                                << interfaceName);
+            }
+        }
+        else if (propName == "Size")
+        {
+            auto sizePtr = std::get_if<uint64_t>(&propVariant);
+            if (sizePtr)
+            {
+                properties.size = *sizePtr;
+                sizeFound = true;
+                FWDEBUG("subpartition size: " << properties.size
+                                              << " for the interface: "
+                                              << interfaceName);
             }
         }
     }
-    if (!foundValidPfm)
+    if (!(nameFound && offsetFound && sizeFound))
     {
-        FWDEBUG("Unable to read the PFM address/size");
+        FWDEBUG("Not all required properties were found for the interface: "
+                << interfaceName);
         return false;
     }
     return true;
 }
 
-inline std::optional<SubPartitionProperties> getSubPartitionProperties(
-    sdbusplus::bus::bus& bus, const std::string& service,
-    const std::string& objPath, const std::string& interfaceName)
+/**
+ * @brief Extract the PFR layout from an entity-manager object tree
+ *
+ * @param objects reply of GetManagedObjects on the entity-manager root
+ * @param layout output layout
+ *
+ * @return true if a PFR object with a valid PFM placement was found
+ */
+inline bool parsePfrLayout(const ManagedObjectType& objects,
+                           PfrLayout& layout)
 {
-
-    try
+    for (const auto& [objPath, interfaces] : objects)
     {
-        auto propertiesList =
-            getAllProperties(bus, service, objPath, interfaceName);
-        if (propertiesList.empty())
+        if (!boost::ends_with(objPath.str, "/PFR"))
         {
-            return std::nullopt; // Subpartition does not exist or no properties
-                                 // found
+            continue;
         }
-
-        SubPartitionProperties properties;
-        bool nameFound = false, offsetFound = false, sizeFound = false;
-
-        for (const auto& [propName, propVariant] : propertiesList)
+        auto pfrIntf = interfaces.find(pfrConfigInterface);
+        if (pfrIntf == interfaces.end())
         {
+            continue;
+        }
+        FWDEBUG("Found PFR object at: " << objPath.str);
 
-            if (propName == "Name")
+        PfrLayout found;
+        if (!readPfrProperties(pfrIntf->second, found))
+        {
+            continue;
+        }
+        // sub-partitions are used in order up to the first missing one
+        for (uint32_t part = 0; part < found.partitionNum; part++)
+        {
+            std::string interfaceName =
+                pfrSubPartitionInterface + std::to_string(part);
+            auto subIntf = interfaces.find(interfaceName);
+            SubPartitionProperties properties;
+            if (subIntf == interfaces.end() ||
+                !readSubPartitionProperties(subIntf->second, interfaceName,
+                                            properties))
             {
-                auto namePtr = std::get_if<std::string>(&propVariant);
-                if (namePtr)
-                {
-                    properties.name = *namePtr;
-                    nameFound = true;
-                    FWDEBUG("subpartition name: " << properties.name
-                                                  << " for the interface: "
-                                                  << interfaceName);
-                }
+                FWDEBUG("SubPartition"
+                        << part << " is not present or an error occurred.");
+                break;
             }
-            else if (propName == "Offset")
+            found.subPartitions.push_back(properties);
+        }
+        layout = found;
+        return true;
+    }
+    FWDEBUG("No PFR objects found.");
+    return false;
+}
+
+/**
+ * @brief Look up the PFR layout through ObjectMapper, one GetAll per
+ * interface; used when entity-manager does not answer GetManagedObjects
+ */
+inline bool pfm_layout_from_subtree(sdbusplus::bus::bus& bus,
+                                    PfrLayout& layout)
+{
+    std::vector<std::string> interfaces = {pfrConfigInterface};
+    auto subTree =
+        getSubTree(bus, "/xyz/openbmc_project/inventory/system", interfaces, 0);
+
+    if (subTree.empty())
+    {
+        FWDEBUG("No PFR objects found.");
+        return false;
+    }
+
+    for (const auto& [objPath, serviceVec] : subTree)
+    {
+        if (serviceVec.empty() || !boost::ends_with(objPath, "/PFR"))
+        {
+            continue;
+        }
+        const std::string& serviceName = serviceVec.begin()->first;
+        FWDEBUG("Found PFR object at: " << objPath
+                                        << " with service: " << serviceName);
+
+        PfrLayout found;
+        auto propertiesList =
+            getAllProperties(bus, serviceName, objPath, pfrConfigInterface);
+        if (!readPfrProperties(propertiesList, found))
+        {
+            continue;
+        }
+        for (uint32_t part = 0; part < found.partitionNum; part++)
+        {
+            std::string interfaceName =
+                pfrSubPartitionInterface + std::to_string(part);
+            auto subProperties =
+                getAllProperties(bus, serviceName, objPath, interfaceName);
+            SubPartitionProperties properties;
+            if (subProperties.empty() ||
+                !readSubPartitionProperties(subProperties, interfaceName,
+                                            properties))
             {
-                auto offsetPtr = std::get_if<uint64_t>(&propVariant);
-                if (offsetPtr)
-                {
-                    properties.offset = *offsetPtr;
-                    offsetFound = true;
-                    FWDEBUG("subpartition offset: " << properties.offset
-                                                    << " for the interface: "
-                                                    << interfaceName);
-                }
+                FWDEBUG("SubPartition"
+                        << part << " is not present or an error occurred.");
+                break;
             }
-            else if (propName == "Size")
+            found.subPartitions.push_back(properties);
+        }
+        layout = found;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * @brief Identify the current entity-manager configuration
+ *
+ * @return a key that changes whenever the configuration is rewritten, or
+ * an empty string if the configuration file cannot be found
+ */
+inline std::string pfrConfigGeneration(
+    const std::string& configFile = pfrConfigurationFile)
+{
+    struct stat sb;
+    if (stat(configFile.c_str(), &sb) < 0)
+    {
+        return {};
+    }
+    std::stringstream generation;
+    generation << sb.st_dev << ':' << sb.st_ino << ':' << sb.st_size << ':'
+               << sb.st_mtim.tv_sec << '.' << sb.st_mtim.tv_nsec;
+    return generation.str();
+}
+
+/**
+ * @brief Load a cached PFR layout
+ *
+ * cache file format (one record per line):
+ *   generation <key>
+ *   pfm <offset> <size> <partitions>
+ *   sub <offset> <size> <name>
+ *
+ * @return true if the cache exists and matches generation
+ */
+inline bool readPfrLayoutCache(const std::string& cacheFile,
+                               const std::string& generation,
+                               PfrLayout& layout)
+{
+    std::ifstream cache(cacheFile);
+    std::string line, tag, key;
+    if (generation.empty() || !std::getline(cache, line))
+    {
+        return false;
+    }
+    std::istringstream gen(line);
+    if (!(gen >> tag >> key) || tag != "generation" || key != generation)
+    {
+        FWDEBUG("PFR layout cache is stale");
+        return false;
+    }
+    PfrLayout cached;
+    bool havePfm = false;
+    while (std::getline(cache, line))
+    {
+        std::istringstream record(line);
+        record >> tag >> std::hex;
+        if (tag == "pfm")
+        {
+            havePfm = static_cast<bool>(record >> cached.pfmOffset >>
+                                        cached.pfmSize >> cached.partitionNum);
+        }
+        else if (tag == "sub")
+        {
+            SubPartitionProperties properties;
+            if (!(record >> properties.offset >> properties.size >> std::ws) ||
+                !std::getline(record, properties.name))
             {
-                auto sizePtr = std::get_if<uint64_t>(&propVariant);
-                if (sizePtr)
-                {
-                    properties.size = *sizePtr;
-                    sizeFound = true;
-                    FWDEBUG("subpartition size: " << properties.size
-                                                  << " for the interface: "
-                                                  << interfaceName);
-                }
+                return false;
             }
+            cached.subPartitions.push_back(properties);
         }
-        if (nameFound && offsetFound && sizeFound)
+        else
         {
-            return properties;
+            return false;
         }
-        else
+    }
+    if (!havePfm)
+    {
+        return false;
+    }
+    layout = cached;
+    return true;
+}
+
+/**
+ * @brief Save a resolved PFR layout for the given configuration generation
+ */
+inline void writePfrLayoutCache(const std::string& cacheFile,
+                                const std::string& generation,
+                                const PfrLayout& layout)
+{
+    if (generation.empty())
+    {
+        return;
+    }
+    try
+    {
+        std::filesystem::path path(cacheFile);
+        std::filesystem::create_directories(path.parent_path());
+        std::filesystem::path tmp(cacheFile + ".tmp");
         {
-            FWDEBUG("Not all required properties were found for the interface: "
-                    << interfaceName);
-            return std::nullopt;
+            std::ofstream cache(tmp);
+            cache << "generation " << generation << '\n'
+                  << std::hex << "pfm " << layout.pfmOffset << ' '
+                  << layout.pfmSize << ' ' << layout.partitionNum << '\n';
+            for (const auto& sub : layout.subPartitions)
+            {
+                cache << "sub " << sub.offset << ' ' << sub.size << ' '
+                      << sub.name << '\n';
+            }
+            if (!cache.good())
+            {
+                THROW(FileIOError());
+            }
         }
+        // rename so that a reader never sees a partial cache
+        std::filesystem::rename(tmp, path);
     }
     catch (const std::exception& e)
     {
-        FWDEBUG("Failed to get properties for " << interfaceName << ": "
-                                                << e.what());
+        FWDEBUG("Failed to write PFR layout cache: " << e.what());
+    }
+}
+
+/**
+ * @brief Resolve the PFR layout
+ *
+ * The layout is taken from the on-disk cache if the entity-manager
+ * configuration has not changed since it was written; otherwise all PFR
+ * and SubPartition properties are fetched with a single GetManagedObjects
+ * call on one bus connection.
+ *
+ * @param layout output layout
+ *
+ * @return true if the PFM placement was found; false, otherwise
+ */
+inline bool pfm_layout(PfrLayout& layout)
+{
+    TRACE_SPAN("dbus", "pfm_layout");
+    // several flash devices may be updated concurrently from one process
+    static std::mutex layoutLock;
+    std::lock_guard<std::mutex> guard(layoutLock);
+
+    std::string generation = pfrConfigGeneration();
+    if (readPfrLayoutCache(pfrLayoutCacheFile, generation, layout))
+    {
+        FWDEBUG("Using cached PFR layout");
+        return true;
     }
 
-    // Return an empty optional to indicate the subpartition was not found or an
-    // error occurred
-    return std::nullopt;
+    auto bus = sdbusplus::bus::new_default();
+    if (!parsePfrLayout(
+            getManagedObjects(bus, entityManagerService, entityManagerRoot),
+            layout) &&
+        !pfm_layout_from_subtree(bus, layout))
+    {
+        FWDEBUG("Unable to read the PFM address/size");
+        return false;
+    }
+    writePfrLayoutCache(pfrLayoutCacheFile, generation, layout);
+    return true;
 }
 
 // Process sub-partitions
 template <typename deviceClassT>
 bool processSubPartitions(mtd<deviceClassT>& dev, uint32_t dev_offset,
-                          const uint8_t*& offset, uint32_t& partition_num)
+                          const uint8_t*& offset, const PfrLayout& layout)
 {
     offset -= blk0blk1_size;
-    auto bus = sdbusplus::bus::new_default();
     bool success = false;
-    if (serviceName.empty() || pfrPath.empty())
+    for (const auto& sub_partition : layout.subPartitions)
     {
-        FWDEBUG("Either serviceName or pfrPath is empty (or both).");
-        return success;
-    }
-    for (int part = 0; part < partition_num; part++)
-    {
-        std::string interfaceName =
-            "xyz.openbmc_project.Configuration.PFR.SubPartition" +
-            std::to_string(part);
-        auto propertiesOpt =
-            getSubPartitionProperties(bus, serviceName, pfrPath, interfaceName);
-        if (!propertiesOpt)
-        {
-            FWDEBUG("SubPartition" << part
-                                   << " is not present or an error occurred.");
-            break; // Exit if a subpartition does not exist
-        }
-        auto sub_partition_name = propertiesOpt->name;
-        auto sub_partition_offset = propertiesOpt->offset;
-        auto sub_partition_size = propertiesOpt->size;
-        cbspan pfm_data(offset, sub_partition_size);
+        cbspan pfm_data(offset, sub_partition.size);
 
         FWDEBUG("Processing sub_partition "
-                << sub_partition_name << ": offset = 0x" << std::hex
-                << sub_partition_offset << ", size = 0x" << std::hex
-                << sub_partition_size);
+                << sub_partition.name << ": offset = 0x" << std::hex
+                << sub_partition.offset << ", size = 0x" << std::hex
+                << sub_partition.size);
 
-        dev.write_raw(dev_offset + sub_partition_offset, pfm_data);
-        offset += sub_partition_size;
+        dev.write_raw(dev_offset + sub_partition.offset, pfm_data);
+        offset += sub_partition.size;
         success = true;
     }
     return success;
@@ -692,79 +1411,53 @@ template <typename deviceClassT>
 bool locate_and_place_pfm(mtd<deviceClassT>& dev, uint32_t dev_offset,
                           const uint8_t*& offset, size_t pfm_size)
 {
-    uint32_t pfm_address;
-    uint32_t pfm_region_size;
-    uint32_t partition_num;
-    if (!pfm_layout(pfm_address, pfm_region_size, partition_num))
+    TRACE_SPAN("pfr", "locate_and_place_pfm");
+    PfrLayout layout;
+    if (!pfm_layout(layout))
     {
         return false;
     }
 
-    dev.erase(pfm_address + dev_offset, pfm_region_size);
-    if (!processSubPartitions(dev, dev_offset, offset, partition_num))
+    dev.erase(layout.pfmOffset + dev_offset, layout.pfmSize);
+    if (!processSubPartitions(dev, dev_offset, offset, layout))
     {
         offset += blk0blk1_size;
         cbspan pfm_data(offset - blk0blk1_size, offset + pfm_size);
-        dev.write_raw(pfm_address + dev_offset, pfm_data);
+        dev.write_raw(layout.pfmOffset + dev_offset, pfm_data);
         offset += pfm_size;
     }
 
     return true;
 }
 
-template <typename deviceClassT>
-bool pfr_write(mtd<deviceClassT>& dev, const std::string& filename,
-               size_t dev_offset, bool recovery_reset)
+/**
+ * @brief Erase and copy the blocks marked in a pbc
+ *
+ * @param dev device to write; anything with the erase, write_raw and
+ * skip_unsigned of mtd<> will do
+ * @param pfm_hdr PFM of the capsule, for its unsigned regions
+ * @param pfm_size size of the PFM body
+ * @param pbc_hdr pbc header, followed by its bitmaps and payload
+ * @param dev_offset offset of the image within dev
+ * @param recovery_reset also erase unsigned regions
+ *
+ * @return true if every marked block was handled; false, otherwise
+ */
+template <typename deviceT>
+bool pbc_apply(deviceT& dev, const pfm* pfm_hdr, size_t pfm_size,
+               const pbc* pbc_hdr, size_t dev_offset, bool recovery_reset)
 {
-    if (!pfr_authenticate(filename, !recovery_reset))
-    {
-        return false;
-    }
-    boost::iostreams::mapped_file file(filename,
-                                       boost::iostreams::mapped_file::readonly);
-    auto map_base = reinterpret_cast<const uint8_t*>(file.const_data());
-    auto offset = map_base;
-
-    FWDEBUG("file mapped " << file.size() << " bytes at 0x" << std::hex
-                           << reinterpret_cast<unsigned long>(offset));
-
-    // walk the bitmap, erase and copy
-    offset += blk0blk1_size * 2; // one blk0blk1 for package, one for pfm
-    auto pfm_hdr = reinterpret_cast<const pfm*>(offset);
-    FWDEBUG("pfm header at " << std::hex << pfm_hdr
-                             << " (magic:" << pfm_hdr->magic << ")");
-    FWDEBUG("pfm length is 0x" << std::hex << pfm_hdr->length);
-    size_t pfm_size = block_round(pfm_hdr->length, pfm_block_size);
-
-    if (pfm_hdr->magic != pfm_magic)
-    {
-        FWDEBUG("PFM Magic number is not matching !");
-        return false;
-    }
-    if (!locate_and_place_pfm(dev, dev_offset, offset, pfm_size))
-    {
-        return false;
-    }
-    auto pbc_hdr = reinterpret_cast<const pbc*>(offset);
-    FWDEBUG("pbc header at " << std::hex << pbc_hdr
-                             << " (magic:" << pbc_hdr->magic << ")");
-    FWDEBUG("pbc bitmap size 0x" << std::hex << pbc_hdr->bitmap_size);
-
-    if (pbc_hdr->magic != pbc_magic)
-    {
-        FWDEBUG("PBC Mgic number is not matching !");
-        return false;
-    }
-    offset += sizeof(pbc);
-    auto act_map = reinterpret_cast<const uint8_t*>(offset);
+    auto offset = reinterpret_cast<const uint8_t*>(pbc_hdr + 1);
+    auto act_map = offset;
     FWDEBUG("active map at 0x" << std::hex
                                << reinterpret_cast<unsigned long>(act_map));
     offset += pbc_hdr->bitmap_size / 8;
-    auto pbc_map = reinterpret_cast<const uint8_t*>(offset);
+    auto pbc_map = offset;
     FWDEBUG("pbc map at 0x" << std::hex
                             << reinterpret_cast<unsigned long>(pbc_map));
 
     offset += pbc_hdr->bitmap_size / 8;
+    auto payload = offset;
     uint32_t wr_count = 1;
     uint32_t er_count = 1;
     uint32_t erase_end_addr = 0;
@@ -857,6 +1550,8 @@ bool pfr_write(mtd<deviceClassT>& dev, const std::string& filename,
                 FWDEBUG("skipping erase on unsigned block"
                         << (er_count == 16 ? "s" : "") << " @" << std::hex
                         << pfr_blk_size * blk + dev_offset);
+                dev.skip_unsigned(pfr_blk_size * blk + dev_offset,
+                                  pfr_blk_size * wr_count);
                 continue;
             }
         }
@@ -909,8 +1604,8 @@ bool pfr_write(mtd<deviceClassT>& dev, const std::string& filename,
             }
             // DUMP(PRINT_ERROR, data);
             FWDEBUG("write(" << std::hex << pfr_blk_size * blk << ", "
-                             << pfr_blk_size * wr_count << "), offset = 0x"
-                             << (offset - map_base) + dev_offset);
+                             << pfr_blk_size * wr_count
+                             << "), payload offset = 0x" << (offset - payload));
             dev.write_raw(pfr_blk_size * blk + dev_offset, data);
 
             offset += pfr_blk_size * wr_count;
@@ -919,42 +1614,349 @@ bool pfr_write(mtd<deviceClassT>& dev, const std::string& filename,
     return true;
 }
 
+/**
+ * @brief Call fn with the offset of every 64K block a delta pbc relies on,
+ * in address order: the blocks of its copy ranges that it neither erases
+ * nor copies
+ *
+ * @return false if a range is outside the bitmaps; true, otherwise
+ */
+template <typename F>
+bool pbc_delta_base_blocks(const pbc* pbc_hdr, const pbc_delta_info& info,
+                           F fn)
+{
+    constexpr size_t pages = pbc_delta_block_size / pfr_blk_size;
+    auto act_map = reinterpret_cast<const uint8_t*>(pbc_hdr + 1);
+    for (const auto& range : info.ranges)
+    {
+        if (size_t(range.end) * pages > pbc_hdr->bitmap_size)
+        {
+            return false;
+        }
+        for (size_t blk = range.start; blk < range.end; blk++)
+        {
+            // a 64K block is two bytes of the map
+            if (!act_map[blk * 2] && !act_map[blk * 2 + 1])
+            {
+                fn(blk * pbc_delta_block_size);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Check that the flash holds the image a delta pbc was made from
+ *
+ * @param dev device to check; anything with the read and size of mtd<>
+ * @param pbc_hdr pbc header, followed by its bitmaps
+ * @param dev_offset offset of the image within dev
+ *
+ * @return true if the pbc is not a delta or the flash matches; false,
+ * otherwise
+ */
+template <typename deviceT>
+bool pbc_delta_base_matches(deviceT& dev, const pbc* pbc_hdr,
+                            size_t dev_offset)
+{
+    pbc_delta_info info;
+    std::memcpy(&info, pbc_hdr->rsvd, sizeof(info));
+    if (info.magic != pbc_delta_magic)
+    {
+        return true;
+    }
+    Hash hash(EVP_sha384(), cbspan(info.base_sha384, sha384_size));
+    std::vector<uint8_t> block(pbc_delta_block_size);
+    bool in_map = pbc_delta_base_blocks(pbc_hdr, info, [&](size_t offset) {
+        if (dev_offset + offset + block.size() > dev.size() ||
+            dev.read(dev_offset + offset, block) !=
+                static_cast<int>(block.size()))
+        {
+            THROW(FileIOError() << msg_info("short read"));
+        }
+        hash.update(block.data(), block.size());
+    });
+    if (!in_map || !hash.verify())
+    {
+        FWERROR("flash does not hold the image the delta pbc was made from");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Write an authenticated capsule to flash
+ *
+ * @param dev device to write
+ * @param image authenticated capsule
+ * @param dev_offset offset of the image within dev
+ * @param recovery_reset also erase unsigned regions
+ * @param plan optional update plan, checked against the pbc and then executed
+ *
+ * @return true if the image was written; false, otherwise
+ */
 template <typename deviceClassT>
-bool secure_boot_image_update(mtd<deviceClassT>& dev,
-                              const std::string& filename, size_t dev_offset)
+bool pfr_write(mtd<deviceClassT>& dev, const pfr_image& image,
+               size_t dev_offset, bool recovery_reset,
+               const update_plan* plan = nullptr)
+{
+    TRACE_SPAN("pfr", "pfr_write");
+    probe_phase phase("write");
+    if (!image.authenticated())
+    {
+        FWERROR("refusing to write an unauthenticated image");
+        return false;
+    }
+    auto pfm_hdr = image.pfm_header();
+    if (!pfm_hdr)
+    {
+        FWDEBUG("PFM Magic number is not matching !");
+        return false;
+    }
+    FWDEBUG("pfm header at " << std::hex << pfm_hdr
+                             << " (magic:" << pfm_hdr->magic << ")");
+    FWDEBUG("pfm length is 0x" << std::hex << pfm_hdr->length);
+    size_t pfm_size = image.pfm_size();
+    if (plan && !plan->validate(image, recovery_reset))
+    {
+        return false;
+    }
+    // before anything is erased, as a delta on other flash would only
+    // leave a mix of both images
+    if (image.pbc_header() &&
+        !pbc_delta_base_matches(dev, image.pbc_header(), dev_offset))
+    {
+        return false;
+    }
+
+    // place the PFM, then walk the bitmap, erase and copy
+    auto offset = reinterpret_cast<const uint8_t*>(pfm_hdr);
+    if (!locate_and_place_pfm(dev, dev_offset, offset, pfm_size))
+    {
+        return false;
+    }
+    auto pbc_hdr = reinterpret_cast<const pbc*>(offset);
+    FWDEBUG("pbc header at " << std::hex << pbc_hdr
+                             << " (magic:" << pbc_hdr->magic << ")");
+    FWDEBUG("pbc bitmap size 0x" << std::hex << pbc_hdr->bitmap_size);
+
+    if (pbc_hdr->magic != pbc_magic)
+    {
+        FWDEBUG("PBC Mgic number is not matching !");
+        return false;
+    }
+    if (plan)
+    {
+        // the plan was made from the pbc that follows the PFM in the capsule
+        if (pbc_hdr != image.pbc_header())
+        {
+            FWERROR("update plan does not match the PFM layout");
+            return false;
+        }
+        plan->execute(dev, image.data().data(), dev_offset);
+        return phase.done(true);
+    }
+    return phase.done(pbc_apply(dev, pfm_hdr, pfm_size, pbc_hdr, dev_offset,
+                                recovery_reset));
+}
+
+template <typename deviceClassT>
+bool pfr_write(mtd<deviceClassT>& dev, const std::string& filename,
+               size_t dev_offset, bool recovery_reset)
+{
+    pfr_image image(filename);
+    if (!image.authenticate(!recovery_reset))
+    {
+        return false;
+    }
+    return pfr_write(dev, image, dev_offset, recovery_reset);
+}
+
+struct pfm_signed_region
+{
+    uint32_t start;
+    uint32_t end;
+    const uint8_t* sha384;
+};
+
+/**
+ * @brief Collect the spi regions of a PFM that carry a SHA-384 digest
+ *
+ * @param pfm_hdr pointer to the PFM header
+ * @param pfm_size size of the PFM body (rounded to pfm_block_size)
+ *
+ * @return the signed regions, in PFM order
+ */
+inline std::vector<pfm_signed_region> pfm_signed_regions(const pfm* pfm_hdr,
+                                                         size_t pfm_size)
+{
+    std::vector<pfm_signed_region> regions;
+    auto region_offset = reinterpret_cast<const uint8_t*>(pfm_hdr + 1);
+    auto region_end = region_offset + pfm_size;
+    while (region_offset < region_end)
+    {
+        auto region = reinterpret_cast<const spi_region*>(region_offset);
+        if (region->type == type_spi_region)
+        {
+            auto hash = region_offset + sizeof(spi_region) +
+                        (region->hash_info & sha256_present ? sha256_size : 0);
+            if (region->hash_info & sha384_present)
+            {
+                regions.push_back({region->start, region->end, hash});
+            }
+            region_offset +=
+                sizeof(spi_region) +
+                (region->hash_info & sha256_present ? sha256_size : 0) +
+                (region->hash_info & sha384_present ? sha384_size : 0);
+        }
+        else if (region->type == type_smbus_rule)
+        {
+            region_offset += sizeof(smbus_rule);
+        }
+        else if (region->type == type_fvm_address)
+        {
+            region_offset += sizeof(fvm_address);
+        }
+        else
+        {
+            break;
+        }
+    }
+    return regions;
+}
+
+/**
+ * @brief Check flash contents against the PFM of an authenticated capsule
+ *
+ * Every spi region that has a SHA-384 digest in the PFM is read back from
+ * the device in 1MB chunks and hashed; regions are processed in parallel.
+ * The reads go through dev, so they show up in the flash statistics, the
+ * op-trace and the read probes.
+ *
+ * @param dev device to check
+ * @param image authenticated capsule
+ * @param dev_offset offset of the image within dev
+ *
+ * @return true if all signed regions match; false, otherwise
+ */
+constexpr size_t pfr_verify_chunk_size = 1024 * 1024;
+
+template <typename deviceClassT>
+bool pfr_verify(mtd<deviceClassT>& dev, const pfr_image& image,
+                size_t dev_offset)
 {
-    if (!pfr_authenticate(filename, true))
+    TRACE_SPAN("pfr", "pfr_verify");
+    probe_phase phase("verify");
+    if (!image.authenticated())
+    {
+        FWERROR("refusing to verify against an unauthenticated image");
+        return false;
+    }
+    if (!image.pfm_header())
     {
+        FWERROR("PFM Magic number is not matching !");
         return false;
     }
-    boost::iostreams::mapped_file file(filename,
-                                       boost::iostreams::mapped_file::readonly);
-    auto map_base = reinterpret_cast<const uint8_t*>(file.const_data());
-    auto offset = reinterpret_cast<const uint8_t*>(file.const_data());
+    auto regions = pfm_signed_regions(image.pfm_header(), image.pfm_size());
+    for (const auto& region : regions)
+    {
+        if (region.start >= region.end ||
+            dev_offset + region.end > dev.size())
+        {
+            FWERROR("bad spi region " << std::hex << region.start << ".."
+                                      << region.end);
+            return false;
+        }
+    }
+
+    std::vector<char> mismatch(regions.size(), 0);
+    parallel_for(regions.size(), default_worker_count(), [&](size_t idx) {
+        const auto& region = regions[idx];
+        Hash hash384(EVP_sha384(), cbspan(region.sha384, sha384_size));
+        std::vector<uint8_t> chunk;
+        for (size_t addr = region.start; addr < region.end;
+             addr += chunk.size())
+        {
+            chunk.resize(std::min(pfr_verify_chunk_size, region.end - addr));
+            if (dev.read(dev_offset + addr, chunk) !=
+                static_cast<int>(chunk.size()))
+            {
+                THROW(FileIOError() << msg_info("short read"));
+            }
+            hash384.update(chunk.data(), chunk.size());
+        }
+        mismatch[idx] = !hash384.verify();
+        MTD_UTIL_PROBE(flash_hash_verify, dev_offset + region.start,
+                       region.end - region.start, !mismatch[idx]);
+    });
 
-    FWDEBUG("file mapped " << file.size() << " bytes at 0x" << std::hex
-                           << reinterpret_cast<unsigned long>(offset));
+    bool ok = true;
+    for (size_t idx = 0; idx < regions.size(); idx++)
+    {
+        if (mismatch[idx])
+        {
+            FWERROR("spi region " << std::hex << regions[idx].start << ".."
+                                  << regions[idx].end
+                                  << " does not match the PFM");
+            ok = false;
+        }
+    }
+    FWINFO("verified " << regions.size() << " signed regions"
+                       << (ok ? "" : " with mismatches"));
+    return phase.done(ok);
+}
 
-    auto block0 = reinterpret_cast<const blk0*>(offset);
-    // walk the bitmap, erase and copy
-    offset += blk0blk1_size * 2; // one blk0blk1 for package, one for pfm
-    auto pfm_hdr = reinterpret_cast<const pfm*>(offset);
+template <typename deviceClassT>
+bool pfr_verify(mtd<deviceClassT>& dev, const std::string& filename,
+                size_t dev_offset)
+{
+    pfr_image image(filename);
+    if (!image.authenticate(true))
+    {
+        return false;
+    }
+    return pfr_verify(dev, image, dev_offset);
+}
+
+/**
+ * @brief Write an authenticated secure boot capsule to flash
+ *
+ * @param dev device to write
+ * @param image authenticated capsule
+ * @param dev_offset offset of the image within dev
+ *
+ * @return true if the image was written; false, otherwise
+ */
+template <typename deviceClassT>
+bool secure_boot_image_update(mtd<deviceClassT>& dev, const pfr_image& image,
+                              size_t dev_offset)
+{
+    if (!image.authenticated())
+    {
+        FWERROR("refusing to write an unauthenticated image");
+        return false;
+    }
+    if (!image.pfm_header() || !image.pbc_header())
+    {
+        FWERROR("PFM or PBC header not found");
+        return false;
+    }
+    auto map_base = image.data().data();
+    auto block0 = &image.signature()->b0;
+    auto pfm_hdr = image.pfm_header();
     FWDEBUG("pfm header at " << std::hex << pfm_hdr
                              << " (magic:" << pfm_hdr->magic << ")");
     FWDEBUG("pfm length is 0x" << std::hex << pfm_hdr->length);
-    size_t pfm_size = block_round(pfm_hdr->length, pfm_block_size);
-    cbspan pfm_data(offset - blk0blk1_size, offset + pfm_size);
-    offset += pfm_size;
-    auto pbc_hdr = reinterpret_cast<const pbc*>(offset);
+    auto pfm_start = reinterpret_cast<const uint8_t*>(pfm_hdr);
+    cbspan pfm_data(pfm_start - blk0blk1_size, pfm_start + image.pfm_size());
+    auto pbc_hdr = image.pbc_header();
     FWDEBUG("pbc header at " << std::hex << pbc_hdr
                              << " (magic:" << pbc_hdr->magic << ")");
     FWDEBUG("pbc bitmap size 0x" << std::hex << pbc_hdr->bitmap_size);
-    offset += sizeof(pbc);
-    auto act_map = reinterpret_cast<const uint8_t*>(offset);
+    auto act_map = image.act_map();
     FWDEBUG("active map at 0x" << std::hex
                                << reinterpret_cast<unsigned long>(act_map));
-    offset += pbc_hdr->bitmap_size / 8;
-    auto pbc_map = reinterpret_cast<const uint8_t*>(offset);
+    auto pbc_map = image.pbc_map();
     FWDEBUG("pbc map at 0x" << std::hex
                             << reinterpret_cast<unsigned long>(pbc_map));
 
@@ -971,7 +1973,8 @@ bool secure_boot_image_update(mtd<deviceClassT>& dev,
     dev.erase(pfm_address + dev_offset, pfm_region_size);
     dev.write_raw(pfm_address + dev_offset, pfm_data);
     // set offset to the beginning of the compressed data
-    offset += pbc_hdr->bitmap_size / 8;
+    auto offset = image.payload();
+    size_t pfm_size = image.pfm_size();
     uint32_t wr_count = 1;
     uint32_t er_count = 1;
     uint32_t erase_end_addr = 0;
@@ -1077,6 +2080,9 @@ bool secure_boot_image_update(mtd<deviceClassT>& dev,
                 FWDEBUG("skipping erase on unsigned block"
                         << (er_count == 16 ? "s" : "") << " @" << std::hex
                         << pfr_blk_size * (blk - blocks_to_skip) + dev_offset);
+                dev.skip_unsigned(pfr_blk_size * (blk - blocks_to_skip) +
+                                      dev_offset,
+                                  pfr_blk_size * wr_count);
                 continue;
             }
         }
@@ -1139,3 +2145,15 @@ bool secure_boot_image_update(mtd<deviceClassT>& dev,
     }
     return true;
 }
+
+template <typename deviceClassT>
+bool secure_boot_image_update(mtd<deviceClassT>& dev,
+                              const std::string& filename, size_t dev_offset)
+{
+    pfr_image image(filename);
+    if (!image.authenticate(true))
+    {
+        return false;
+    }
+    return secure_boot_image_update(dev, image, dev_offset);
+}
@@ -0,0 +1,103 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: USDT static tracepoints
+*/
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/*
+ * With the USDT_PROBES CMake option, each MTD_UTIL_PROBE is a
+ * systemtap/DTrace style static tracepoint of provider mtd_util: a nop
+ * until bpftrace, perf or systemtap attaches to it, e.g.
+ *
+ *   bpftrace -e 'usdt:/usr/bin/mtd-util:mtd_util:erase_done
+ *                { printf("%x +%x\n", arg0, arg1); }'
+ *
+ * Without the option the probes (and their arguments) compile to nothing.
+ *
+ * Probes and arguments:
+ *   read_start, write_start, program_start, erase_start   addr, len
+ *   read_done, write_done, program_done, erase_done       addr, len, result
+ *
+ * A _done probe fires for every _start probe, with result -1 if the
+ * operation threw; erase_done has result 0 otherwise.
+ *   phase_start                                           name
+ *   phase_done                                            name, ok
+ *   sig_verify                                            curve, len, ok
+ *   image_hash_verify                                     len, ok
+ *   flash_hash_verify                                     addr, len, ok
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define MTD_UTIL_PROBE(NAME, ...) STAP_PROBEV(mtd_util, NAME, ##__VA_ARGS__)
+#else /* !HAVE_SYS_SDT_H */
+#define MTD_UTIL_PROBE(NAME, ...)                                              \
+    do                                                                         \
+    {                                                                          \
+    } while (0)
+#endif /* HAVE_SYS_SDT_H */
+
+/* calls fire when it goes out of scope, also when an exception unwinds
+ * it; for _done probes that must not be skipped
+ */
+template <typename F>
+class probe_done
+{
+  public:
+    probe_done(const probe_done&) = delete;
+    probe_done& operator=(const probe_done&) = delete;
+
+    explicit probe_done(F fire) : _fire(fire)
+    {
+    }
+    ~probe_done()
+    {
+        _fire();
+    }
+
+  private:
+    F _fire;
+};
+
+/* fires phase_start now and phase_done when it goes out of scope */
+class probe_phase
+{
+  public:
+    probe_phase(const probe_phase&) = delete;
+    probe_phase& operator=(const probe_phase&) = delete;
+
+    explicit probe_phase(const char* name) : _name(name), _ok(false)
+    {
+        MTD_UTIL_PROBE(phase_start, _name);
+    }
+    ~probe_phase()
+    {
+        MTD_UTIL_PROBE(phase_done, _name, _ok);
+    }
+
+    /* record the outcome; returns ok, for use in return statements */
+    bool done(bool ok)
+    {
+        _ok = ok;
+        return ok;
+    }
+
+  private:
+    const char* _name;
+    bool _ok;
+};
+
+#endif /* __PROBES_H__ */
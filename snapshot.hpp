@@ -0,0 +1,372 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: sparse whole-device flash snapshots
+*/
+
+#pragma once
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "block-index.h"
+#include "debug.h"
+#include "exceptions.h"
+#include "util.h"
+
+/*
+ * A snapshot holds a whole device and leaves out erased (all 0xff) blocks:
+ *
+ *   snapshot_header
+ *   presence bitmap, one bit per block (set: block is stored), padded
+ *   to a multiple of 8 bytes so the hashes that follow are aligned
+ *   fast_hash64 of every block, 0 for blocks that are not stored
+ *   contents of the stored blocks, in address order
+ *
+ * The bitmap and hashes have a fixed size, so they are written last, after
+ * the stored blocks have been streamed out.
+ */
+static constexpr char snapshot_magic[8] = {'M', 'T', 'D', 'S',
+                                           'N', 'A', 'P', '1'};
+static constexpr uint32_t snapshot_version = 1;
+
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t dev_size;
+    uint64_t stored;    // number of stored (non blank) blocks
+    uint64_t meta_hash; // fast_hash64 of the bitmap and hashes
+} __attribute__((packed));
+
+/* flash is read for a snapshot in chunks of at least this size */
+constexpr size_t snapshot_chunk_size = 256 * 1024;
+/* stored blocks are programmed in pages; blank pages are skipped */
+constexpr size_t snapshot_page_size = 256;
+
+struct snapshot_layout
+{
+    size_t blocks;
+    size_t bitmap_size;
+    size_t meta_size; // bitmap + hashes
+    size_t data_offset;
+
+    snapshot_layout(size_t dev_size, size_t block_size) :
+        blocks(dev_size / block_size),
+        bitmap_size((blocks + 63) / 64 * sizeof(uint64_t)),
+        meta_size(bitmap_size + blocks * sizeof(uint64_t)),
+        data_offset(sizeof(snapshot_header) + meta_size)
+    {
+    }
+    static bool stored(const uint8_t* bitmap, size_t block)
+    {
+        return bitmap[block / 8] & (1 << (block % 8));
+    }
+};
+
+static inline void snapshot_pwrite(int fd, const void* data, size_t len,
+                                   off_t offset)
+{
+    auto buf = static_cast<const uint8_t*>(data);
+    while (len)
+    {
+        ssize_t ret = ::pwrite(fd, buf, len, offset);
+        if (ret < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ret < 0)
+        {
+            THROW(FileIOError() << boost::errinfo_errno(errno));
+        }
+        buf += ret;
+        offset += ret;
+        len -= ret;
+    }
+}
+
+/**
+ * @brief Write a sparse snapshot of a whole device
+ *
+ * Flash reads run ahead on a worker thread while the previous chunk is
+ * checked for blank blocks and written out.
+ *
+ * @param dev device to snapshot
+ * @param fd seekable file to write the snapshot to
+ *
+ * @return the number of blocks stored
+ */
+template <typename deviceT>
+size_t snapshot_write(deviceT& dev, int fd)
+{
+    const size_t block_size = dev.erase_size();
+    snapshot_layout layout(dev.size(), block_size);
+    std::vector<uint8_t> meta(layout.meta_size, 0);
+    uint8_t* bitmap = meta.data();
+    uint64_t* hashes =
+        reinterpret_cast<uint64_t*>(meta.data() + layout.bitmap_size);
+
+    const size_t per_chunk = std::max<size_t>(1, snapshot_chunk_size /
+                                                     block_size);
+    const size_t chunks = (layout.blocks + per_chunk - 1) / per_chunk;
+    size_t stored = 0;
+    off_t offset = layout.data_offset;
+    pipeline(
+        chunks, 3,
+        [&](size_t idx, std::vector<uint8_t>& buf) {
+            size_t first = idx * per_chunk;
+            buf.resize(std::min(per_chunk, layout.blocks - first) *
+                       block_size);
+            if (dev.read(first * block_size, buf) !=
+                static_cast<int>(buf.size()))
+            {
+                THROW(FileIOError() << msg_info("short read"));
+            }
+        },
+        [&](size_t idx, std::vector<uint8_t>& buf) {
+            for (size_t pos = 0; pos < buf.size(); pos += block_size)
+            {
+                size_t block = idx * per_chunk + pos / block_size;
+                const uint8_t* data = buf.data() + pos;
+                if (is_blank(data, block_size))
+                {
+                    continue;
+                }
+                bitmap[block / 8] |= 1 << (block % 8);
+                hashes[block] = fast_hash64(data, block_size);
+                snapshot_pwrite(fd, data, block_size, offset);
+                offset += block_size;
+                stored++;
+            }
+        });
+
+    snapshot_header hdr{};
+    std::memcpy(hdr.magic, snapshot_magic, sizeof(hdr.magic));
+    hdr.version = snapshot_version;
+    hdr.block_size = block_size;
+    hdr.dev_size = dev.size();
+    hdr.stored = stored;
+    hdr.meta_hash = fast_hash64(meta.data(), meta.size());
+    snapshot_pwrite(fd, meta.data(), meta.size(), sizeof(hdr));
+    snapshot_pwrite(fd, &hdr, sizeof(hdr), 0);
+    FWINFO("stored " << std::dec << stored << " of " << layout.blocks
+                     << " blocks");
+    return stored;
+}
+
+/**
+ * @brief Check a snapshot for consistency with itself and with dev
+ *
+ * @return the header, or nullptr if the snapshot cannot be restored to dev
+ */
+template <typename deviceT>
+const snapshot_header* snapshot_check(deviceT& dev, const cbspan& snap)
+{
+    auto hdr = reinterpret_cast<const snapshot_header*>(snap.data());
+    if (snap.size() < sizeof(*hdr) ||
+        std::memcmp(hdr->magic, snapshot_magic, sizeof(hdr->magic)) ||
+        hdr->version != snapshot_version)
+    {
+        FWERROR("not a snapshot");
+        return nullptr;
+    }
+    if (hdr->dev_size != dev.size() || !hdr->block_size ||
+        hdr->block_size % dev.erase_size() ||
+        hdr->dev_size % hdr->block_size ||
+        (hdr->block_size % dev.erase_block_size() &&
+         dev.erase_block_size() % hdr->block_size))
+    {
+        FWERROR("snapshot of a " << std::hex << hdr->dev_size
+                                 << " byte device with " << hdr->block_size
+                                 << " byte blocks does not fit this device");
+        return nullptr;
+    }
+    snapshot_layout layout(hdr->dev_size, hdr->block_size);
+    // bounded first, so the size cannot overflow and the blocks checked
+    // below are inside the file
+    if (hdr->stored > layout.blocks ||
+        snap.size() != layout.data_offset + hdr->stored * hdr->block_size ||
+        fast_hash64(snap.data() + sizeof(*hdr), layout.meta_size) !=
+            hdr->meta_hash)
+    {
+        FWERROR("snapshot is truncated or corrupt");
+        return nullptr;
+    }
+    const uint8_t* bitmap = snap.data() + sizeof(*hdr);
+    auto hashes = reinterpret_cast<const uint64_t*>(bitmap +
+                                                    layout.bitmap_size);
+    const uint8_t* data = snap.data() + layout.data_offset;
+    size_t stored = 0;
+    for (size_t block = 0; block < layout.blocks; block++)
+    {
+        if (!layout.stored(bitmap, block))
+        {
+            continue;
+        }
+        if (++stored > hdr->stored ||
+            fast_hash64(data, hdr->block_size) != hashes[block])
+        {
+            FWERROR("snapshot block " << std::dec << block << " is corrupt");
+            return nullptr;
+        }
+        data += hdr->block_size;
+    }
+    if (stored != hdr->stored)
+    {
+        FWERROR("snapshot is truncated or corrupt");
+        return nullptr;
+    }
+    return hdr;
+}
+
+/**
+ * @brief Restore a whole device from a snapshot
+ *
+ * The snapshot is checked completely before the device is touched. Blocks
+ * that have to change are erased in coalesced runs, and only the non blank
+ * pages of stored blocks are programmed. With a block index, flash that
+ * already holds the right contents is left alone, in units of what
+ * dev.erase() erases at once.
+ *
+ * @param dev device to restore
+ * @param snap mapped snapshot
+ *
+ * @return true if the device was restored; false, otherwise
+ */
+template <typename deviceT>
+bool snapshot_restore(deviceT& dev, const cbspan& snap)
+{
+    const snapshot_header* hdr = snapshot_check(dev, snap);
+    if (!hdr)
+    {
+        return false;
+    }
+    const size_t block_size = hdr->block_size;
+    snapshot_layout layout(hdr->dev_size, block_size);
+    const uint8_t* bitmap = snap.data() + sizeof(*hdr);
+    std::vector<const uint8_t*> contents(layout.blocks, nullptr);
+    const uint8_t* data = snap.data() + layout.data_offset;
+    for (size_t block = 0; block < layout.blocks; block++)
+    {
+        if (layout.stored(bitmap, block))
+        {
+            contents[block] = data;
+            data += block_size;
+        }
+    }
+
+    // erase rounds to its own block size, so only a whole unit of that
+    // size can be left alone, and only if the device confirms all of it
+    const block_index* index = dev.index();
+    const size_t unit = std::max(block_size, dev.erase_block_size());
+    const size_t per_unit = unit / block_size;
+    const size_t units = (layout.blocks + per_unit - 1) / per_unit;
+    std::vector<uint8_t> expected;
+    auto unchanged = [&](size_t u) {
+        size_t first = u * per_unit;
+        size_t count = std::min(per_unit, layout.blocks - first);
+        bool blank = true;
+        expected.assign(count * block_size, 0xff);
+        for (size_t b = 0; b < count; b++)
+        {
+            if (contents[first + b])
+            {
+                std::memcpy(expected.data() + b * block_size,
+                            contents[first + b], block_size);
+                blank = false;
+            }
+        }
+        size_t addr = first * block_size;
+        if (blank)
+        {
+            return dev.block_erased(addr, expected.size());
+        }
+        return dev.block_unchanged(addr, expected);
+    };
+
+    std::vector<char> skip(layout.blocks, 0);
+    size_t run = 0, erased = 0, skipped = 0;
+    for (size_t u = 0; u <= units; u++)
+    {
+        bool keep = u == units || (index && unchanged(u));
+        if (!keep)
+        {
+            continue;
+        }
+        size_t first = run * per_unit;
+        size_t end = std::min(u * per_unit, layout.blocks);
+        if (end > first)
+        {
+            dev.erase(first * block_size, (end - first) * block_size);
+            erased += end - first;
+        }
+        if (u < units)
+        {
+            size_t last = std::min((u + 1) * per_unit, layout.blocks);
+            std::fill(skip.begin() + end, skip.begin() + last, 1);
+            skipped += last - end;
+        }
+        run = u + 1;
+    }
+
+    size_t programmed = 0;
+    for (size_t block = 0; block < layout.blocks; block++)
+    {
+        if (!contents[block] || skip[block])
+        {
+            continue;
+        }
+        // the erase left the block blank, so blank pages are not
+        // programmed; the index can only follow one program per erased
+        // block, so with an index only the blank head and tail are trimmed
+        const uint8_t* src = contents[block];
+        size_t page = 0;
+        while (page < block_size)
+        {
+            while (page < block_size &&
+                   is_blank(src + page, snapshot_page_size))
+            {
+                page += snapshot_page_size;
+            }
+            size_t end = page;
+            size_t last = page;
+            while (end < block_size &&
+                   (index || !is_blank(src + end, snapshot_page_size)))
+            {
+                end += snapshot_page_size;
+                if (!is_blank(src + end - snapshot_page_size,
+                              snapshot_page_size))
+                {
+                    last = end;
+                }
+            }
+            if (last > page)
+            {
+                dev.write_raw(block * block_size + page,
+                              cbspan(src + page, last - page));
+            }
+            page = end;
+        }
+        programmed++;
+    }
+    FWINFO("erased " << std::dec << erased << ", programmed " << programmed
+                     << " and skipped " << skipped << " of " << layout.blocks
+                     << " blocks");
+    return true;
+}
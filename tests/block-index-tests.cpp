@@ -0,0 +1,153 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: block index test utility
+*/
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "block-index.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+#define TEST_BLOCK 0x1000
+#define TEST_DEV_SIZE (16 * TEST_BLOCK)
+
+class BlockIndex : public ::testing::Test
+{
+  protected:
+	fs::path path{fs::temp_directory_path() / "mtd-util-index-test" /
+		      "mtd0.idx"};
+
+	void SetUp() override
+	{
+		fs::remove_all(path.parent_path());
+	}
+	void TearDown() override
+	{
+		fs::remove_all(path.parent_path());
+	}
+};
+
+TEST_F(BlockIndex, StartsInvalid) {
+	block_index index;
+	index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+	EXPECT_EQ(index.blocks(), 16u);
+	EXPECT_FALSE(index.is_valid(0, TEST_DEV_SIZE));
+	EXPECT_FALSE(index.is_erased(0, TEST_BLOCK));
+}
+
+TEST_F(BlockIndex, TracksEraseAndProgram) {
+	std::vector<uint8_t> data(TEST_BLOCK, 0x5a);
+	block_index index;
+	index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+
+	index.begin(TEST_BLOCK, 2 * TEST_BLOCK);
+	index.commit_erase(TEST_BLOCK, 2 * TEST_BLOCK);
+	EXPECT_TRUE(index.is_erased(TEST_BLOCK, 2 * TEST_BLOCK));
+
+	auto prior = index.begin(TEST_BLOCK, data.size());
+	EXPECT_FALSE(index.is_valid(TEST_BLOCK, data.size()));
+	index.commit_program(TEST_BLOCK, data, prior);
+	EXPECT_TRUE(index.matches(TEST_BLOCK, data));
+	EXPECT_FALSE(index.is_erased(TEST_BLOCK, TEST_BLOCK));
+	EXPECT_TRUE(index.is_erased(2 * TEST_BLOCK, TEST_BLOCK));
+
+	// programming a block of unknown contents leaves it invalid
+	prior = index.begin(4 * TEST_BLOCK, data.size());
+	index.commit_program(4 * TEST_BLOCK, data, prior);
+	EXPECT_FALSE(index.is_valid(4 * TEST_BLOCK, data.size()));
+}
+
+TEST_F(BlockIndex, MarksWhatItWrote) {
+	std::vector<uint8_t> data(TEST_BLOCK, 0x96);
+	block_index index;
+	index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+
+	// contents only seen in a read are not trusted
+	index.update(1, data);
+	EXPECT_TRUE(index.is_valid(TEST_BLOCK, TEST_BLOCK));
+	EXPECT_FALSE(index.is_written(TEST_BLOCK, TEST_BLOCK));
+
+	index.begin(TEST_BLOCK, TEST_BLOCK);
+	index.commit_erase(TEST_BLOCK, TEST_BLOCK);
+	EXPECT_TRUE(index.is_written(TEST_BLOCK, TEST_BLOCK));
+	auto prior = index.begin(TEST_BLOCK, data.size());
+	EXPECT_FALSE(index.is_written(TEST_BLOCK, TEST_BLOCK));
+	index.commit_program(TEST_BLOCK, data, prior);
+	EXPECT_TRUE(index.is_written(TEST_BLOCK, TEST_BLOCK));
+	EXPECT_TRUE(index.matches(TEST_BLOCK, data));
+	index.flush();
+
+	// and it stays trusted for the rest of the boot
+	block_index other;
+	other.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+	EXPECT_TRUE(other.is_written(TEST_BLOCK, TEST_BLOCK));
+}
+
+TEST_F(BlockIndex, PersistsAndResets) {
+	std::vector<uint8_t> data(TEST_BLOCK, 0xa5);
+	{
+		block_index index;
+		index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+		index.update(3, data);
+		index.flush();
+	}
+	{
+		block_index index;
+		index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+		EXPECT_TRUE(index.matches(3 * TEST_BLOCK, data));
+	}
+	// a different geometry does not trust the old entries
+	block_index index;
+	index.open(path, TEST_DEV_SIZE, 2 * TEST_BLOCK);
+	EXPECT_FALSE(index.is_valid(0, TEST_DEV_SIZE));
+}
+
+TEST_F(BlockIndex, BatchesInvalidationUntilFlush) {
+	std::vector<uint8_t> data(TEST_BLOCK, 0x3c);
+	{
+		block_index index;
+		index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+		index.update(5, data);
+		index.flush();
+	}
+	{
+		block_index index;
+		index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+		index.begin(0, TEST_BLOCK);
+		index.commit_erase(0, TEST_BLOCK);
+		EXPECT_TRUE(index.is_erased(0, TEST_BLOCK));
+		EXPECT_TRUE(index.matches(5 * TEST_BLOCK, data));
+
+		// on disk, the following blocks were invalidated along with
+		// the first, and the completed erase is not written back yet
+		block_index other;
+		other.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+		EXPECT_FALSE(other.is_valid(0, TEST_BLOCK));
+		EXPECT_FALSE(other.is_valid(5 * TEST_BLOCK, TEST_BLOCK));
+	}
+	// destroying the index writes everything back
+	block_index index;
+	index.open(path, TEST_DEV_SIZE, TEST_BLOCK);
+	EXPECT_TRUE(index.is_erased(0, TEST_BLOCK));
+	EXPECT_TRUE(index.matches(5 * TEST_BLOCK, data));
+}
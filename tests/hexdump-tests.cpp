@@ -0,0 +1,97 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: hex dump formatter test utility
+*/
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "hexdump.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+static std::string dump(const std::vector<uint8_t>& data, size_t addr,
+						dump_format format, bool squeeze = false,
+						size_t chunk = 0)
+{
+	std::ostringstream out;
+	hex_dumper dumper(out, addr, format, squeeze);
+	if (!chunk)
+		chunk = data.size();
+	for (size_t pos = 0; pos < data.size(); pos += chunk)
+		dumper.dump(data.data() + pos, std::min(chunk, data.size() - pos));
+	dumper.finish();
+	return out.str();
+}
+
+TEST(HexDump, Classic)
+{
+	std::vector<uint8_t> data{'H', 'i', 0x00, 0xff, 0x7e, 0x7f, 0x20, 0x0a,
+							  '0', '1', '2', '3', '4', '5', '6', '7', 'x'};
+	EXPECT_EQ(dump(data, 0x20, dump_format::classic),
+			  "0000020: 4869 00ff 7e7f 200a 3031 3233 3435 3637  "
+			  "Hi..~. .01234567\n"
+			  "0000030: 78" + std::string(39, ' ') + "x\n");
+}
+
+TEST(HexDump, XxdMatchesAcrossChunks)
+{
+	std::vector<uint8_t> data(100);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 7;
+	std::string whole = dump(data, 0x13, dump_format::xxd);
+	EXPECT_EQ(whole.substr(0, 68),
+			  "00000013: 0007 0e15 1c23 2a31 383f 464d 545b 6269  "
+			  ".....#*18?FMT[bi\n");
+	// a partial last line is padded so the ascii column lines up
+	EXPECT_EQ(whole.substr(whole.rfind("00000073")),
+			  "00000073: a0a7 aeb5                                ....\n");
+	// lines split over dump() calls come out the same
+	EXPECT_EQ(dump(data, 0x13, dump_format::xxd, false, 5), whole);
+	EXPECT_EQ(dump(data, 0x13, dump_format::xxd, false, 17), whole);
+}
+
+TEST(HexDump, Raw)
+{
+	std::vector<uint8_t> data{0x00, 0xff, 'a', '\n'};
+	EXPECT_EQ(dump(data, 0x1000, dump_format::raw, true, 1),
+			  std::string("\0\xff" "a\n", 4));
+}
+
+TEST(HexDump, Squeeze)
+{
+	std::vector<uint8_t> data(0x80, 0xff);
+	data[0] = 0;
+	std::string line = "ffff ffff ffff ffff ffff ffff ffff ffff  "
+					   "................\n";
+	EXPECT_EQ(dump(data, 0, dump_format::classic, true, 48),
+			  "0000000: 00ff ffff ffff ffff ffff ffff ffff ffff  "
+			  "................\n"
+			  "0000010: " +
+				  line + "*\n0000070: " + line);
+
+	// a short last line is never squeezed
+	data.resize(0x38);
+	EXPECT_EQ(dump(data, 0, dump_format::classic, true),
+			  "0000000: 00ff ffff ffff ffff ffff ffff ffff ffff  "
+			  "................\n"
+			  "0000010: " +
+				  line + "*\n0000030: ffff ffff ffff ffff" +
+				  std::string(22, ' ') + "........\n");
+}
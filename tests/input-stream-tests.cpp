@@ -0,0 +1,120 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: streamed input test utility
+*/
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+
+#include "input-stream.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+namespace io = boost::iostreams;
+
+class InputStream : public ::testing::Test
+{
+  protected:
+	fs::path dir{fs::temp_directory_path() / "mtd-util-input-test"};
+	std::vector<uint8_t> image;
+
+	void SetUp() override
+	{
+		fs::remove_all(dir);
+		fs::create_directories(dir);
+		// mostly erased flash, like a real image
+		image.assign(0x50000, 0xff);
+		for (size_t i = 0; i < 0x8000; i++)
+			image[i] = i * 13;
+	}
+	void TearDown() override
+	{
+		fs::remove_all(dir);
+	}
+
+	template <typename filterT>
+	fs::path write_compressed(const std::string& name, filterT filter)
+	{
+		fs::path path = dir / name;
+		std::ofstream fout(path, std::ios::binary);
+		io::filtering_ostream out;
+		out.push(filter);
+		out.push(fout);
+		out.write(reinterpret_cast<const char*>(image.data()),
+			  image.size());
+		return path;
+	}
+
+	std::vector<uint8_t> read_all(input_stream& input)
+	{
+		std::vector<uint8_t> data(image.size() + 1);
+		data.resize(read_full(input.fd(), data.data(), data.size()));
+		return data;
+	}
+};
+
+TEST_F(InputStream, DecompressesGzipAndBzip2) {
+	for (auto path : {write_compressed("image.gz", io::gzip_compressor()),
+			  write_compressed("image.bz2", io::bzip2_compressor())}) {
+		auto input = input_stream::open(path);
+		ASSERT_TRUE(input) << path;
+		EXPECT_NE(input->type(), compression::none);
+		EXPECT_TRUE(read_all(*input) == image) << path;
+		EXPECT_TRUE(input->finish());
+	}
+}
+
+TEST_F(InputStream, PlainFilesAreMapped) {
+	fs::path path = dir / "image.bin";
+	std::ofstream(path, std::ios::binary)
+		.write(reinterpret_cast<const char*>(image.data()), image.size());
+	EXPECT_FALSE(input_stream::open(path));
+	EXPECT_EQ(file_compression(path), compression::none);
+}
+
+TEST_F(InputStream, TruncatedInputFails) {
+	fs::path path = write_compressed("image.gz", io::gzip_compressor());
+	fs::resize_file(path, fs::file_size(path) / 2);
+	auto input = input_stream::open(path);
+	ASSERT_TRUE(input);
+	EXPECT_LT(read_all(*input).size(), image.size());
+	EXPECT_FALSE(input->finish());
+}
+
+TEST(Compression, Detect) {
+	const uint8_t gz[] = {0x1f, 0x8b, 0x08, 0x00};
+	const uint8_t bz[] = {'B', 'Z', 'h', '9'};
+	const uint8_t zst[] = {0x28, 0xb5, 0x2f, 0xfd};
+	const uint8_t zz[] = {0x78, 0x9c, 0x00, 0x00};
+	const uint8_t capsule[] = {0x19, 0xfd, 0xea, 0xb6};
+	EXPECT_EQ(detect_compression(gz, 4, "x"), compression::gzip);
+	EXPECT_EQ(detect_compression(bz, 4, "x"), compression::bzip2);
+	EXPECT_EQ(detect_compression(zst, 4, "x"), compression::zstd);
+	// zlib has no magic of its own, so only the name gives it away
+	EXPECT_EQ(detect_compression(zz, 4, "image.bin"), compression::none);
+	EXPECT_EQ(detect_compression(zz, 4, "image.zz"), compression::zlib);
+	EXPECT_EQ(detect_compression(capsule, 4, "x"), compression::none);
+	EXPECT_EQ(detect_compression(gz, 1, "x"), compression::none);
+}
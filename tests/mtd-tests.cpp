@@ -21,6 +21,7 @@
 #include <vector>
 #include <random>
 #include <memory>
+#include <sstream>
 #include <boost/iostreams/device/mapped_file.hpp>
 
 #include <cstdint>
@@ -31,6 +32,8 @@
 
 #include "debug.h"
 #include "mtd.h"
+#include "op-trace.h"
+#include "trace.h"
 #include "util.h"
 #include "exceptions.h"
 
@@ -363,3 +366,255 @@ TEST(PossiblyDestructiveMtdTests, CrossSector64kWrite) {
 	write_single_test(seek_back, BIG_BLOCK_SIZE, false);
 }
 
+
+TEST(UtilTests, PipelineKeepsOrderAndDepth) {
+	const size_t count = 200, depth = 3;
+	std::atomic<size_t> in_flight{0}, max_in_flight{0};
+	std::vector<size_t> seen;
+	pipeline(count, depth,
+		 [&](size_t idx, std::vector<uint8_t>& buf) {
+			 buf.assign(16, idx & 0xff);
+			 size_t now = ++in_flight;
+			 size_t prev = max_in_flight;
+			 while (now > prev &&
+				!max_in_flight.compare_exchange_weak(prev, now))
+				 ;
+		 },
+		 [&](size_t idx, std::vector<uint8_t>& buf) {
+			 EXPECT_EQ(buf[0], idx & 0xff);
+			 seen.push_back(idx);
+			 in_flight--;
+		 });
+	ASSERT_EQ(seen.size(), count);
+	for (size_t idx = 0; idx < count; idx++)
+		EXPECT_EQ(seen[idx], idx);
+	EXPECT_LE(max_in_flight, depth);
+}
+
+TEST(UtilTests, PipelineStopsOnError) {
+	size_t consumed = 0;
+	EXPECT_THROW(pipeline(100, 2,
+			      [](size_t idx, std::vector<uint8_t>&) {
+				      if (idx == 10)
+					      throw std::runtime_error("read");
+			      },
+			      [&](size_t, std::vector<uint8_t>&) { consumed++; }),
+		     std::runtime_error);
+	EXPECT_EQ(consumed, 10u);
+	EXPECT_THROW(pipeline(100, 2, [](size_t, std::vector<uint8_t>&) {},
+			      [](size_t idx, std::vector<uint8_t>&) {
+				      if (idx == 5)
+					      throw std::runtime_error("write");
+			      }),
+		     std::runtime_error);
+}
+
+TEST(MtdStats, HistogramBuckets) {
+	// every value falls into the bucket that claims it
+	for (uint64_t v : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 1000ull,
+			   123456789ull, ~0ull}) {
+		size_t idx = latency_histogram::bucket(v);
+		ASSERT_LT(idx, latency_histogram::buckets);
+		EXPECT_LE(latency_histogram::bucket_low(idx), v);
+		EXPECT_GE(latency_histogram::bucket_high(idx), v);
+	}
+	// and buckets never get wider than an eighth of their values
+	for (size_t idx = latency_histogram::sub_buckets;
+	     idx < latency_histogram::buckets; idx++) {
+		uint64_t low = latency_histogram::bucket_low(idx);
+		EXPECT_LE(latency_histogram::bucket_high(idx) - low, low / 8);
+		if (idx + 1 < latency_histogram::buckets)
+			EXPECT_EQ(latency_histogram::bucket_low(idx + 1),
+				  latency_histogram::bucket_high(idx) + 1);
+	}
+
+	latency_histogram h;
+	for (uint64_t v = 1; v <= 1000; v++)
+		h.record(v * 1000);
+	EXPECT_EQ(h.count(), 1000u);
+	EXPECT_EQ(h.min(), 1000u);
+	EXPECT_EQ(h.max(), 1000000u);
+	EXPECT_NEAR(h.percentile(0.5), 500000, 500000 / 8);
+	EXPECT_NEAR(h.percentile(0.99), 990000, 990000 / 8);
+	EXPECT_EQ(h.percentile(1.0), 1000000u);
+}
+
+TEST(MtdStats, RecordsBySizeClass) {
+	mtd_stats& stats = mtd_stats::instance();
+	stats.reset();
+	using std::chrono::microseconds;
+	stats.record(mtd_op::erase, 0x10000, 0x10000, microseconds(900), false);
+	stats.record(mtd_op::erase, 0x20000, 0x10000, microseconds(100), true);
+	stats.record(mtd_op::read, 0, 0x1000, microseconds(5), false);
+	stats.record(mtd_op::read, 0, 0x200000, microseconds(700), false);
+
+	std::ostringstream table;
+	stats.report(table);
+	EXPECT_THAT(table.str(),
+		    ::testing::HasSubstr("slowest erase: 10000+10000=900us "
+					 "20000+10000=100us"));
+
+	std::ostringstream json;
+	stats.write_json(json);
+	EXPECT_THAT(json.str(),
+		    ::testing::HasSubstr("{\"op\": \"erase\", \"size_class\": "
+					 "\"<=64K\", \"count\": 2, \"bytes\": "
+					 "131072, \"errors\": 1"));
+	EXPECT_THAT(json.str(),
+		    ::testing::HasSubstr("\"size_class\": \">1M\", \"count\": 1"));
+	stats.reset();
+}
+
+TEST(TraceTests, WritesChromeTraceEvents) {
+	std::string path = "/tmp/mtd-util-trace-test.json";
+	{
+		TRACE_SPAN("test", "not_traced");
+	}
+	trace_start(path);
+	{
+		TRACE_SPAN("test", "outer");
+		TRACE_SPAN("flash", "erase", 0x10000, 0x20000);
+	}
+	trace_write();
+	EXPECT_FALSE(trace_enabled());
+
+	std::ifstream in(path);
+	std::stringstream json;
+	json << in.rdbuf();
+	std::string text = json.str();
+	EXPECT_EQ(text.find("not_traced"), std::string::npos);
+	EXPECT_THAT(text, ::testing::HasSubstr("\"name\": \"outer\", "
+					       "\"cat\": \"test\", \"ph\": \"X\""));
+	EXPECT_THAT(text, ::testing::HasSubstr("\"args\": {\"addr\": "
+					       "\"0x10000\", \"len\": 131072}"));
+	// the inner span ends first
+	EXPECT_LT(text.find("\"erase\""), text.find("\"outer\""));
+	unlink(path.c_str());
+}
+
+TEST(OpTraceTests, RecordsAndReplays) {
+	std::string path = "/tmp/mtd-util-op-trace-test.bin";
+	std::vector<uint8_t> data(0x1000);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 7;
+	std::vector<uint8_t> ffs(0x100, 0xff);
+
+	op_trace_start(path);
+	{
+		instrumented<ram_mtd> dev;
+		std::vector<uint8_t> back(data.size());
+		dev.erase(0x10000, 0x10000);
+		dev.write_raw(0x10000, data);
+		dev.write_raw(0x11000, ffs);
+		dev.read(0x10000, back.data(), back.size());
+	}
+	op_trace_stop();
+
+	std::vector<op_trace_record> records = op_trace_load(path);
+	ASSERT_EQ(records.size(), 4u);
+	EXPECT_EQ(records[0].op, static_cast<uint8_t>(mtd_op::erase));
+	EXPECT_EQ(records[0].hash, 0u);
+	EXPECT_EQ(records[1].op, static_cast<uint8_t>(mtd_op::program));
+	EXPECT_EQ(records[1].addr, 0x10000u);
+	EXPECT_EQ(records[1].hash, fast_hash64(data.data(), data.size()));
+	EXPECT_EQ(records[2].flags, op_trace_record::blank);
+	// the read returns what was programmed
+	EXPECT_EQ(records[3].op, static_cast<uint8_t>(mtd_op::read));
+	EXPECT_EQ(records[3].hash, records[1].hash);
+	EXPECT_LE(records[0].begin_ns, records[3].begin_ns);
+	EXPECT_EQ(op_trace_extent(records), 0x20000u);
+
+	// a replay programs the same stand-in for the same recorded data
+	std::vector<uint8_t> a, b;
+	op_trace_fill(records[1], a);
+	op_trace_fill(records[3], b);
+	EXPECT_EQ(a, b);
+	op_trace_fill(records[2], b);
+	EXPECT_EQ(b, ffs);
+
+	ram_mtd dev(0x20000);
+	flash_timing timing;
+	op_trace_summary summary = op_trace_replay(dev, records, timing);
+	EXPECT_EQ(summary.ops[static_cast<size_t>(mtd_op::program)].count, 2u);
+	EXPECT_EQ(summary.ops[static_cast<size_t>(mtd_op::erase)].bytes,
+		  0x10000u);
+	EXPECT_DOUBLE_EQ(summary.ops[static_cast<size_t>(mtd_op::erase)]
+				 .modelled_us,
+			 timing.op_overhead_us + timing.erase_64k_us);
+	std::vector<uint8_t> back(a.size());
+	dev.read(0x10000, back.data(), back.size());
+	EXPECT_EQ(back, a);
+	unlink(path.c_str());
+}
+
+TEST(OpTraceTests, TimingModel) {
+	flash_timing timing;
+	// 15 sectors up to the block boundary, one block, one more sector
+	EXPECT_DOUBLE_EQ(timing.erase_us(0x1000, 0x20000),
+			 timing.op_overhead_us + 16 * timing.erase_4k_us +
+				 timing.erase_64k_us);
+	size_t blocks, sectors;
+	flash_timing::erase_split(0x1000, 0x20000, blocks, sectors);
+	EXPECT_EQ(blocks, 1u);
+	EXPECT_EQ(sectors, 16u);
+	// an unaligned program touches both pages
+	EXPECT_DOUBLE_EQ(timing.program_us(0xff, 2),
+			 timing.op_overhead_us + 2 * timing.program_page_us);
+	EXPECT_DOUBLE_EQ(timing.read_us(25000000),
+			 timing.op_overhead_us + 1000000);
+}
+
+TEST(OpTraceTests, TimingProfile) {
+	std::string path = "/tmp/mtd-util-timing-test";
+	std::ofstream(path) << "page_size 512\n"
+			       "erase_4k_us 30000 # fast part\n";
+	flash_timing timing = flash_timing::load(path);
+	EXPECT_EQ(timing.page_size, 512u);
+	EXPECT_DOUBLE_EQ(timing.erase_4k_us, 30000);
+
+	// a page size that is not a whole positive number
+	for (const char* bad : {"page_size 0.5\n", "page_size 0\n",
+				"page_size -256\n", "erase_64k_us 0\n",
+				"read_mb_s 25 50\n", "program_page_us 7x\n"}) {
+		std::ofstream(path) << bad;
+		EXPECT_THROW(flash_timing::load(path), FileIOError) << bad;
+	}
+	unlink(path.c_str());
+}
+
+TEST(FlashPlanTests, DryRunOnlyPlans) {
+	dry_run<ram_mtd> dev;
+	std::vector<uint8_t> data(0x10000, 0x5a);
+	std::fill(data.begin() + 0x3000, data.begin() + 0x4000, 0xff);
+	dev.erase(0x20000, 0x10000);
+	dev.erase(0x10000, 0x10000);
+	EXPECT_EQ(dev.write_raw(0x10000, data), 0x10000);
+	dev.skip_unsigned(0x40000, 0x1000);
+
+	// nothing reached the device below
+	std::vector<uint8_t> back(0x10, 0);
+	dev.read(0x10000, back.data(), back.size());
+	EXPECT_EQ(back, std::vector<uint8_t>(0x10, 0xff));
+
+	const flash_plan& plan = dev.plan();
+	ASSERT_EQ(plan.erases().size(), 2u);
+	EXPECT_EQ(plan.blank_bytes(), 0x1000u);
+	auto merged = flash_plan::merge(plan.erases());
+	ASSERT_EQ(merged.size(), 1u);
+	EXPECT_EQ(merged[0].addr, 0x10000u);
+	EXPECT_EQ(merged[0].len, 0x20000u);
+
+	flash_timing timing;
+	EXPECT_DOUBLE_EQ(plan.estimate_us(timing),
+			 2 * timing.erase_us(0x10000, 0x10000) +
+				 timing.program_us(0x10000, 0x10000));
+	std::ostringstream report;
+	plan.report(report, timing);
+	EXPECT_THAT(report.str(),
+		    ::testing::HasSubstr("erase   00010000-0002ffff  (128K)"));
+	EXPECT_THAT(report.str(),
+		    ::testing::HasSubstr("erase operations: 2 (128K), as 2 "
+					 "64K block and 0 4K sector erases"));
+	EXPECT_THAT(report.str(),
+		    ::testing::HasSubstr("unsigned blocks skipped: 1 (4K)"));
+}
@@ -0,0 +1,813 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: PFR test utility
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <thread>
+
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "pbc-encoder.h"
+#include "pfr.hpp"
+#include "exceptions.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+/* gpio-sim (CONFIG_GPIO_SIM) stand-in for the board ID lines
+ * the simulated chip is built through configfs and the input
+ * values are driven with the per-line pull attribute in sysfs
+ */
+#define GPIO_SIM_CONFIGFS "/sys/kernel/config/gpio-sim"
+#define GPIO_SIM_SYSFS "/sys/devices/platform/"
+#define GPIO_SIM_NAME "mtd-util-board-id"
+#define BOARD_ID_LINES 6
+
+static bool write_attr(const fs::path& path, const std::string& value)
+{
+	std::ofstream fout(path);
+	if (!fout.is_open())
+		return false;
+	fout << value;
+	fout.close();
+	return !fout.fail();
+}
+
+static std::string read_attr(const fs::path& path)
+{
+	std::string value;
+	std::ifstream fin(path);
+	fin >> value;
+	return value;
+}
+
+class BoardIdGpioSim : public ::testing::Test
+{
+  protected:
+	fs::path sim{fs::path(GPIO_SIM_CONFIGFS) / GPIO_SIM_NAME};
+	fs::path bank{sim / "bank0"};
+	fs::path lines;
+	bool live = false;
+
+	void SetUp() override
+	{
+		std::error_code ec;
+		if (!fs::is_directory(GPIO_SIM_CONFIGFS) ||
+		    access(GPIO_SIM_CONFIGFS, W_OK) != 0)
+			GTEST_SKIP() << "gpio-sim is not available";
+		if (!fs::create_directory(sim, ec) ||
+		    !fs::create_directory(bank, ec) ||
+		    !write_attr(bank / "num_lines", std::to_string(BOARD_ID_LINES)))
+			GTEST_SKIP() << "failed to create gpio-sim chip";
+		for (int i = 0; i < BOARD_ID_LINES; i++) {
+			fs::path line = bank / ("line" + std::to_string(i));
+			fs::create_directory(line, ec);
+			write_attr(line / "name",
+				   "FM_BOARD_SKU_ID" + std::to_string(i));
+		}
+		if (!write_attr(sim / "live", "1"))
+			GTEST_SKIP() << "failed to enable gpio-sim chip";
+		live = true;
+		lines = fs::path(GPIO_SIM_SYSFS) / read_attr(sim / "dev_name") /
+			read_attr(bank / "chip_name");
+	}
+
+	void TearDown() override
+	{
+		std::error_code ec;
+		if (live)
+			write_attr(sim / "live", "0");
+		for (int i = 0; i < BOARD_ID_LINES; i++)
+			fs::remove(bank / ("line" + std::to_string(i)), ec);
+		fs::remove(bank, ec);
+		fs::remove(sim, ec);
+	}
+
+	bool set_board_id(uint8_t id)
+	{
+		for (int i = 0; i < BOARD_ID_LINES; i++) {
+			fs::path pull = lines / ("sim_gpio" + std::to_string(i)) / "pull";
+			if (!write_attr(pull, (id >> i) & 1 ? "pull-up" : "pull-down"))
+				return false;
+		}
+		return true;
+	}
+};
+
+TEST_F(BoardIdGpioSim, ReadsAllLines) {
+	for (uint8_t id : {0x00, 0x2d, 0x12, 0x3f}) {
+		ASSERT_TRUE(set_board_id(id));
+		uint8_t board_id = 0xff;
+		EXPECT_TRUE(getBoardId(board_id));
+		EXPECT_EQ(board_id, id);
+	}
+}
+
+/* mock of the object tree that the entity-manager service returns from
+ * GetManagedObjects, including unrelated records of other property types
+ */
+static ManagedObjectType mock_entity_manager_objects(uint64_t partitions)
+{
+	ManagedObjectType objects;
+	auto& pfr = objects[sdbusplus::message::object_path(
+		"/xyz/openbmc_project/inventory/system/board/Board/PFR")];
+	pfr[pfrConfigInterface] = {
+		{"Name", std::string("PFR")},
+		{"PFMOffset", uint64_t(0x80000)},
+		{"PFMSize", uint64_t(0x20000)},
+		{"PartitionNo", partitions},
+	};
+	for (uint64_t part = 0; part < 2; part++) {
+		pfr[pfrSubPartitionInterface + std::to_string(part)] = {
+			{"Name", "sub " + std::to_string(part)},
+			{"Offset", uint64_t(0x80000 + part * 0x10000)},
+			{"Size", uint64_t(0x1000)},
+		};
+	}
+	auto& fan = objects[sdbusplus::message::object_path(
+		"/xyz/openbmc_project/inventory/system/board/Board/Fan_1")];
+	fan["xyz.openbmc_project.Configuration.AspeedFan"] = {
+		{"Index", uint64_t(0)},
+		{"PowerState", std::string("On")},
+		{"Thresholds", std::vector<double>{10.0, 90.0}},
+		{"Present", true},
+	};
+	return objects;
+}
+
+TEST(PfrLayout, ParsesManagedObjects) {
+	PfrLayout layout;
+	ASSERT_TRUE(parsePfrLayout(mock_entity_manager_objects(2), layout));
+	EXPECT_EQ(layout.pfmOffset, 0x80000u);
+	EXPECT_EQ(layout.pfmSize, 0x20000u);
+	EXPECT_EQ(layout.partitionNum, 2u);
+	ASSERT_EQ(layout.subPartitions.size(), 2u);
+	EXPECT_EQ(layout.subPartitions[1].name, "sub 1");
+	EXPECT_EQ(layout.subPartitions[1].offset, 0x90000u);
+	EXPECT_EQ(layout.subPartitions[1].size, 0x1000u);
+}
+
+TEST(PfrLayout, SubPartitionsStopAtFirstMissing) {
+	PfrLayout layout;
+	ASSERT_TRUE(parsePfrLayout(mock_entity_manager_objects(4), layout));
+	EXPECT_EQ(layout.subPartitions.size(), 2u);
+}
+
+TEST(PfrLayout, NoPfrObject) {
+	auto objects = mock_entity_manager_objects(2);
+	objects.erase(sdbusplus::message::object_path(
+		"/xyz/openbmc_project/inventory/system/board/Board/PFR"));
+	PfrLayout layout;
+	EXPECT_FALSE(parsePfrLayout(objects, layout));
+}
+
+TEST(PfrLayout, CacheFollowsGeneration) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-layout-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	std::string config = dir / "system.json";
+	std::string cache = dir / "cache" / "pfr-layout";
+
+	EXPECT_EQ(pfrConfigGeneration(config), "");
+	ASSERT_TRUE(write_attr(config, "{}"));
+	std::string generation = pfrConfigGeneration(config);
+	ASSERT_NE(generation, "");
+
+	PfrLayout layout, cached;
+	ASSERT_TRUE(parsePfrLayout(mock_entity_manager_objects(2), layout));
+	EXPECT_FALSE(readPfrLayoutCache(cache, generation, cached));
+	writePfrLayoutCache(cache, generation, layout);
+	ASSERT_TRUE(readPfrLayoutCache(cache, generation, cached));
+	EXPECT_EQ(cached.pfmOffset, layout.pfmOffset);
+	EXPECT_EQ(cached.pfmSize, layout.pfmSize);
+	EXPECT_EQ(cached.partitionNum, layout.partitionNum);
+	ASSERT_EQ(cached.subPartitions.size(), 2u);
+	EXPECT_EQ(cached.subPartitions[0].name, "sub 0");
+	EXPECT_EQ(cached.subPartitions[1].offset, 0x90000u);
+
+	// rewriting the configuration invalidates the cache
+	ASSERT_TRUE(write_attr(config, "{\"changed\": 1}"));
+	std::string next = pfrConfigGeneration(config);
+	EXPECT_NE(next, generation);
+	EXPECT_FALSE(readPfrLayoutCache(cache, next, cached));
+	fs::remove_all(dir);
+}
+
+/* write a capsule that only has the outer blk0blk1 and pc_length bytes of
+ * protected content, with extra (positive) or missing (negative) bytes
+ */
+static std::string write_plain_capsule(const fs::path& path, ssize_t extra)
+{
+	std::vector<uint8_t> img(blk0blk1_size + 0x3000, 0x5a);
+	auto sig = reinterpret_cast<b0b1_signature*>(img.data());
+	sig->b0.magic = blk0_magic;
+	sig->b0.pc_type = pfr_pc_type_bmc_update;
+	sig->b0.pc_length = img.size() - blk0blk1_size;
+	img.resize(img.size() + extra, 0xff);
+	std::ofstream fout(path, std::ios::binary);
+	fout.write(reinterpret_cast<const char*>(img.data()), img.size());
+	return path;
+}
+
+/* feed a file through a pipe, like a capsule arriving on stdin */
+static bool authenticate_piped(const std::string& filename, size_t& sunk)
+{
+	int fds[2];
+	if (pipe(fds) < 0)
+		return false;
+	std::thread writer([&]() {
+		std::ifstream fin(filename, std::ios::binary);
+		std::vector<char> chunk(1000);
+		while (fin.read(chunk.data(), chunk.size()) || fin.gcount())
+			if (write(fds[1], chunk.data(), fin.gcount()) < 0)
+				break;
+		close(fds[1]);
+	});
+	sunk = 0;
+	bool ret = pfr_authenticate_stream(fds[0], false,
+		[&sunk](const cbspan& data) { sunk += data.size(); });
+	// drain whatever the authenticator did not need
+	char drain[256];
+	while (read(fds[0], drain, sizeof(drain)) > 0)
+		;
+	writer.join();
+	close(fds[0]);
+	return ret;
+}
+
+TEST(PfrStream, MatchesMappedVerdict) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-stream-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	for (ssize_t extra : {0, 1, -1, -0x2000}) {
+		std::string capsule = write_plain_capsule(dir / "capsule", extra);
+		size_t sunk = 0;
+		EXPECT_EQ(authenticate_piped(capsule, sunk),
+			  pfr_authenticate(capsule, false)) << "extra " << extra;
+		if (!extra)
+			EXPECT_EQ(sunk, fs::file_size(capsule));
+	}
+	fs::remove_all(dir);
+}
+
+TEST(PfrStream, RejectsFvmSignatureBeyondFvm) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-stream-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	// outer signature, fvm signature, a one block fvm and an empty pbc
+	std::vector<uint8_t> img(blk0blk1_size * 2 + fvm_block_size + sizeof(pbc));
+	auto sig = reinterpret_cast<b0b1_signature*>(img.data());
+	sig[0].b0.magic = blk0_magic;
+	sig[0].b0.pc_type = pfr_pc_type_partial_update;
+	sig[0].b0.pc_length = img.size() - blk0blk1_size;
+	sig[1].b0.magic = blk0_magic;
+	sig[1].b0.pc_length = 0x10000;
+	auto fvm_hdr = reinterpret_cast<fvm*>(img.data() + blk0blk1_size * 2);
+	fvm_hdr->magic = fvm_magic;
+	fvm_hdr->length = fvm_block_size;
+	auto pbc_hdr = reinterpret_cast<pbc*>(img.data() + blk0blk1_size * 2 +
+					      fvm_block_size);
+	pbc_hdr->magic = pbc_magic;
+	pbc_hdr->page_size = pfr_blk_size;
+	std::string capsule = dir / "capsule";
+	std::ofstream(capsule, std::ios::binary).write(
+		reinterpret_cast<const char*>(img.data()), img.size());
+	size_t sunk = 0;
+	EXPECT_FALSE(authenticate_piped(capsule, sunk));
+	fs::remove_all(dir);
+}
+
+TEST(PfrAuthenticate, ConcurrentCallsAgree) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-batch-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	std::vector<std::string> capsules = {
+		write_plain_capsule(dir / "good", 0),
+		write_plain_capsule(dir / "short", -1),
+	};
+	std::vector<char> verdicts(64, 0);
+	parallel_for(verdicts.size(), 8, [&](size_t idx) {
+		verdicts[idx] = pfr_authenticate(capsules[idx % 2], false);
+	});
+	for (size_t idx = 0; idx < verdicts.size(); idx++)
+		EXPECT_EQ(verdicts[idx], idx % 2 == 0) << "call " << idx;
+	fs::remove_all(dir);
+}
+
+/* digest of data, fed in odd sized pieces, with the selected backend;
+ * used is set to the backend that did the work
+ */
+static std::vector<uint8_t> hash_pieces(digest_backend backend,
+					const std::vector<uint8_t>& data,
+					digest_backend& used)
+{
+	set_digest_backend(backend);
+	Hash hash(EVP_sha384(), cbspan());
+	used = hash.backend();
+	for (size_t pos = 0; pos < data.size(); pos += 0x1003)
+		hash.update(data.data() + pos,
+			    std::min<size_t>(0x1003, data.size() - pos));
+	std::vector<uint8_t> digest = hash.digest();
+	set_digest_backend(digest_backend::openssl);
+	return digest;
+}
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+
+/* true if the kernel offers sha384 through AF_ALG */
+static bool kernel_has_sha384(void)
+{
+	int tfm = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (tfm < 0)
+		return false;
+	struct sockaddr_alg sa = {};
+	sa.salg_family = AF_ALG;
+	strcpy(reinterpret_cast<char*>(sa.salg_type), "hash");
+	strcpy(reinterpret_cast<char*>(sa.salg_name), "sha384");
+	bool ok = bind(tfm, reinterpret_cast<struct sockaddr*>(&sa),
+		       sizeof(sa)) == 0;
+	close(tfm);
+	return ok;
+}
+
+TEST(Hash, BackendsAgree) {
+	std::vector<uint8_t> data(0x11000);
+	for (size_t i = 0; i < data.size(); i++)
+		data[i] = i * 7;
+
+	Hash reference(EVP_sha384(), cbspan());
+	reference.update(data.data(), data.size());
+	digest_backend used;
+	EXPECT_EQ(hash_pieces(digest_backend::openssl, data, used),
+		  reference.digest());
+	EXPECT_EQ(used, digest_backend::openssl);
+	// without AF_ALG this falls back to OpenSSL and still has to agree
+	bool kernel = kernel_has_sha384();
+	EXPECT_EQ(hash_pieces(digest_backend::kernel, data, used),
+		  reference.digest());
+	EXPECT_EQ(used, kernel ? digest_backend::kernel
+			       : digest_backend::openssl);
+}
+
+static size_t count_files(const fs::path& dir)
+{
+	size_t count = 0;
+	for ([[maybe_unused]] const auto& entry : fs::directory_iterator(dir))
+		count++;
+	return count;
+}
+
+TEST(PfrAuthenticate, CacheFollowsFile) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-auth-cache-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	fs::path cache = dir / "cache";
+	pfr_set_auth_cache(true, cache);
+
+	std::string capsule = write_plain_capsule(dir / "capsule", 0);
+	EXPECT_TRUE(pfr_authenticate(capsule, false));
+	// just written, so it could still change within the same timestamp
+	EXPECT_EQ(count_files(cache), 0u);
+
+	// backdate the write; ctime cannot be set, so wait out the margin
+	// that keeps a change within one timestamp tick from going unnoticed
+	struct timespec times[2] = {{0, UTIME_OMIT}, {0, 0}};
+	clock_gettime(CLOCK_REALTIME, &times[1]);
+	times[1].tv_sec -= 60;
+	ASSERT_EQ(utimensat(AT_FDCWD, capsule.c_str(), times, 0), 0);
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	EXPECT_TRUE(pfr_authenticate(capsule, false));
+	EXPECT_EQ(count_files(cache), 1u);
+	EXPECT_TRUE(pfr_authenticate(capsule, false));
+	// quick checks neither use nor leave records
+	EXPECT_TRUE(pfr_authenticate(capsule, false, true));
+	EXPECT_EQ(count_files(cache), 1u);
+
+	// changing the file in place drops its record
+	write_plain_capsule(capsule, -1);
+	EXPECT_FALSE(pfr_authenticate(capsule, false));
+	EXPECT_EQ(count_files(cache), 0u);
+
+	pfr_set_auth_cache(false);
+	fs::remove_all(dir);
+}
+
+/* a capsule with three PFM regions (the middle one unsigned) and a pbc
+ * over 64 blocks: a copied 64K block, an erase-only 64K block in the
+ * unsigned region, a 64K block with every other page copied, and a 64K
+ * block that is left alone
+ */
+struct pbc_capsule
+{
+	std::vector<uint8_t> data;
+	size_t pfm_offset;
+	size_t pfm_size;
+	size_t pbc_offset;
+
+	const pfm* pfm_hdr() const
+	{
+		return reinterpret_cast<const pfm*>(data.data() + pfm_offset);
+	}
+	const pbc* pbc_hdr() const
+	{
+		return reinterpret_cast<const pbc*>(data.data() + pbc_offset);
+	}
+	const uint8_t* sha384() const
+	{
+		return reinterpret_cast<const b0b1_signature*>(data.data())
+			->b0.sha384;
+	}
+};
+
+template <typename T>
+static void append(std::vector<uint8_t>& buf, const T& thing)
+{
+	auto p = reinterpret_cast<const uint8_t*>(&thing);
+	buf.insert(buf.end(), p, p + sizeof(thing));
+}
+
+static pbc_capsule make_pbc_capsule()
+{
+	std::vector<uint8_t> regions;
+	auto add_region = [&regions](uint32_t start, uint32_t end, bool sign) {
+		spi_region r{};
+		r.type = type_spi_region;
+		r.hash_info = sign ? sha384_present : 0;
+		r.start = start;
+		r.end = end;
+		append(regions, r);
+		if (sign)
+			regions.insert(regions.end(), sha384_size, 0x11);
+	};
+	add_region(0, 0x10000, true);
+	add_region(0x10000, 0x20000, false);
+	add_region(0x20000, 0x40000, true);
+
+	constexpr uint32_t blocks = 64;
+	std::vector<uint8_t> act(blocks / 8), copy(blocks / 8);
+	size_t copied = 0;
+	for (uint32_t blk = 0; blk < 48; blk++) {
+		act[blk / 8] |= 0x80 >> (blk % 8);
+		if (blk < 16 || (blk >= 32 && blk % 2 == 0)) {
+			copy[blk / 8] |= 0x80 >> (blk % 8);
+			copied++;
+		}
+	}
+
+	pbc_capsule c;
+	c.data.resize(blk0blk1_size);
+	auto sig = reinterpret_cast<b0b1_signature*>(c.data.data());
+	sig->b0.magic = blk0_magic;
+	sig->b0.pc_type = pfr_pc_type_bmc_update;
+	std::fill(std::begin(sig->b0.sha384), std::end(sig->b0.sha384), 0x42);
+
+	c.pfm_offset = c.data.size();
+	c.pfm_size = (regions.size() + pfm_block_size - 1) / pfm_block_size *
+		     pfm_block_size;
+	pfm hdr{};
+	hdr.magic = pfm_magic;
+	hdr.length = sizeof(hdr) + regions.size();
+	append(c.data, hdr);
+	c.data.insert(c.data.end(), regions.begin(), regions.end());
+	c.data.resize(c.pfm_offset + sizeof(hdr) + c.pfm_size, 0xff);
+
+	c.pbc_offset = c.data.size();
+	pbc p{};
+	p.magic = pbc_magic;
+	p.version = 2;
+	p.page_size = pfr_blk_size;
+	p.pattern_size = 1;
+	p.pattern = 0xff;
+	p.bitmap_size = blocks;
+	p.payload_length = copied * pfr_blk_size;
+	append(c.data, p);
+	c.data.insert(c.data.end(), act.begin(), act.end());
+	c.data.insert(c.data.end(), copy.begin(), copy.end());
+	for (size_t idx = 0; idx < copied * pfr_blk_size; idx++)
+		c.data.push_back(uint8_t(idx / pfr_blk_size * 13 + idx));
+	return c;
+}
+
+/* ram_mtd with the skip_unsigned that pbc_apply reports to */
+struct ram_device : ram_mtd
+{
+	using ram_mtd::ram_mtd;
+	using ram_mtd::read;
+	int read(uint32_t addr, std::vector<uint8_t>& buf)
+	{
+		return ram_mtd::read(addr, buf.data(), buf.size());
+	}
+	void skip_unsigned(uint32_t, size_t)
+	{
+	}
+};
+
+static std::vector<uint8_t> apply_to_ram(
+	const std::function<void(ram_device&)>& apply)
+{
+	ram_device dev(0x40000);
+	std::vector<uint8_t> old(dev.size(), 0x5a);
+	dev.write_raw(0, old);
+	apply(dev);
+	std::vector<uint8_t> flash(dev.size());
+	dev.read(0, flash.data(), flash.size());
+	return flash;
+}
+
+static std::vector<uint8_t> read_file(const fs::path& path)
+{
+	std::ifstream in(path, std::ios::binary);
+	return std::vector<uint8_t>((std::istreambuf_iterator<char>(in)),
+				    std::istreambuf_iterator<char>());
+}
+
+/* write a plan file for the given runs, made without -r */
+static void save_runs(const fs::path& file, const uint8_t* sha384,
+		      const std::vector<update_plan_erase>& erases,
+		      const std::vector<update_plan_program>& programs)
+{
+	std::vector<uint8_t> runs(erases.size() * sizeof(update_plan_erase) +
+				  programs.size() *
+					  sizeof(update_plan_program));
+	std::memcpy(runs.data(), erases.data(),
+		    erases.size() * sizeof(update_plan_erase));
+	std::memcpy(runs.data() + erases.size() * sizeof(update_plan_erase),
+		    programs.data(),
+		    programs.size() * sizeof(update_plan_program));
+	update_plan_header header{};
+	std::memcpy(header.magic, update_plan_magic, sizeof(header.magic));
+	header.version = update_plan_version;
+	std::copy(sha384, sha384 + sha384_size, header.sha384);
+	header.erase_runs = erases.size();
+	header.program_runs = programs.size();
+	header.hash = fast_hash64(runs.data(), runs.size());
+	std::ofstream out(file, std::ios::binary | std::ios::trunc);
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(runs.data()), runs.size());
+}
+
+TEST(UpdatePlan, MatchesPbcWalk) {
+	pbc_capsule c = make_pbc_capsule();
+	fs::path file = fs::temp_directory_path() / "mtd-util-plan-test";
+	for (bool recovery_reset : {false, true}) {
+		update_plan plan;
+		ASSERT_TRUE(plan.build(c.data, c.pfm_hdr(), c.pfm_size,
+				       c.pbc_hdr(), c.sha384(), recovery_reset));
+		// adjacent erases are joined; programs are joined only where
+		// both flash and payload are contiguous
+		EXPECT_EQ(plan.erases().size(), recovery_reset ? 1u : 2u);
+		EXPECT_EQ(plan.programs().size(), 9u);
+
+		plan.save(file);
+		update_plan loaded = update_plan::load(file);
+		EXPECT_TRUE(loaded.validate(c.data, c.pfm_hdr(), c.pfm_size,
+					    c.pbc_hdr(), c.sha384(),
+					    recovery_reset));
+		EXPECT_FALSE(loaded.validate(c.data, c.pfm_hdr(), c.pfm_size,
+					     c.pbc_hdr(), c.sha384(),
+					     !recovery_reset));
+		std::vector<uint8_t> other(c.sha384(), c.sha384() + sha384_size);
+		other[0] ^= 1;
+		EXPECT_FALSE(loaded.validate(c.data, c.pfm_hdr(), c.pfm_size,
+					     c.pbc_hdr(), other.data(),
+					     recovery_reset));
+
+		// a well formed plan file whose runs are not what the pbc
+		// gives (here, the first program moved to another page)
+		std::vector<uint8_t> bytes = read_file(file);
+		size_t runs = sizeof(update_plan_header);
+		auto first = runs + plan.erases().size() *
+			sizeof(update_plan_erase);
+		bytes[first + 1] ^= 0x10;
+		update_plan_header header;
+		std::memcpy(&header, bytes.data(), sizeof(header));
+		header.hash = fast_hash64(bytes.data() + runs,
+					  bytes.size() - runs);
+		std::memcpy(bytes.data(), &header, sizeof(header));
+		std::ofstream(file, std::ios::binary).write(
+			reinterpret_cast<const char*>(bytes.data()),
+			bytes.size());
+		update_plan moved = update_plan::load(file);
+		EXPECT_FALSE(moved.validate(c.data, c.pfm_hdr(), c.pfm_size,
+					    c.pbc_hdr(), c.sha384(),
+					    recovery_reset));
+		plan.save(file);
+
+		auto walked = apply_to_ram([&](ram_device& dev) {
+			EXPECT_TRUE(pbc_apply(dev, c.pfm_hdr(), c.pfm_size,
+					      c.pbc_hdr(), 0, recovery_reset));
+		});
+		auto planned = apply_to_ram([&](ram_device& dev) {
+			loaded.execute(dev, c.data.data(), 0);
+		});
+		EXPECT_TRUE(walked == planned) << "recovery_reset "
+					       << recovery_reset;
+		// the unsigned block is only erased with -r
+		EXPECT_EQ(planned[0x10000], recovery_reset ? 0xff : 0x5a);
+	}
+
+	// well formed plans that erase or program something else
+	update_plan plain, reset;
+	ASSERT_TRUE(plain.build(c.data, c.pfm_hdr(), c.pfm_size, c.pbc_hdr(),
+				c.sha384(), false));
+	ASSERT_TRUE(reset.build(c.data, c.pfm_hdr(), c.pfm_size, c.pbc_hdr(),
+				c.sha384(), true));
+	auto check = [&](const std::vector<update_plan_erase>& erases,
+			 const std::vector<update_plan_program>& programs) {
+		save_runs(file, c.sha384(), erases, programs);
+		return update_plan::load(file).validate(
+			c.data, c.pfm_hdr(), c.pfm_size, c.pbc_hdr(),
+			c.sha384(), false);
+	};
+	EXPECT_TRUE(check(plain.erases(), plain.programs()));
+	// the unsigned block is erased
+	EXPECT_FALSE(check(reset.erases(), plain.programs()));
+	// an erase is left out
+	std::vector<update_plan_erase> fewer(plain.erases().begin() + 1,
+					     plain.erases().end());
+	EXPECT_FALSE(check(fewer, plain.programs()));
+	// a program reads another payload page
+	std::vector<update_plan_program> shifted = plain.programs();
+	shifted.back().payload_offset += pfr_blk_size;
+	EXPECT_FALSE(check(plain.erases(), shifted));
+	// a program is left out
+	shifted = plain.programs();
+	shifted.pop_back();
+	EXPECT_FALSE(check(plain.erases(), shifted));
+
+	// a truncated file is not a plan
+	fs::resize_file(file, fs::file_size(file) - 1);
+	EXPECT_THROW(update_plan::load(file), FileIOError);
+	fs::remove(file);
+}
+
+/* a PFM that signs everything, so erase-only pages are erased */
+static std::vector<uint8_t> signed_pfm(size_t size)
+{
+	std::vector<uint8_t> buf;
+	pfm hdr{};
+	hdr.magic = pfm_magic;
+	append(buf, hdr);
+	spi_region r{};
+	r.type = type_spi_region;
+	r.hash_info = sha384_present;
+	r.end = size;
+	append(buf, r);
+	buf.resize(sizeof(pfm) + pfm_block_size, 0);
+	return buf;
+}
+
+TEST(PbcEncoder, RoundTripsThroughPbcApply) {
+	// 4 64K blocks: random pages with every third page blank, then a
+	// block for an erase region, then one that is left alone
+	std::vector<uint8_t> image(0x40000, 0xff);
+	for (size_t page = 0; page < 32; page++)
+		if (page % 3)
+			for (size_t idx = 0; idx < pfr_blk_size; idx++)
+				image[page * pfr_blk_size + idx] =
+					uint8_t(page * 7 + idx * 13);
+	std::fill(image.begin() + 0x20000, image.end(), 0x33);
+	std::vector<pbc_region> regions = {{0, 0x20000, true},
+					   {0x20000, 0x30000, false}};
+
+	pbc_stats stats;
+	std::vector<uint8_t> encoded = pbc_encode(image, regions, 4, stats);
+	EXPECT_EQ(stats.pages, 64u);
+	EXPECT_EQ(stats.erased, 48u);
+	EXPECT_EQ(stats.copied, 21u);
+	EXPECT_EQ(stats.blank, 11u);
+	auto hdr = reinterpret_cast<const pbc*>(encoded.data());
+	EXPECT_EQ(hdr->magic, pbc_magic);
+	EXPECT_EQ(encoded.size(),
+		  sizeof(pbc) + 2 * 64 / 8 + stats.copied * pfr_blk_size);
+	// the same threads or not
+	pbc_stats single;
+	EXPECT_TRUE(pbc_encode(image, regions, 1, single) == encoded);
+
+	std::vector<uint8_t> pfm_buf = signed_pfm(image.size());
+	auto flash = apply_to_ram([&](ram_device& dev) {
+		EXPECT_TRUE(pbc_apply(dev,
+				      reinterpret_cast<const pfm*>(pfm_buf.data()),
+				      pfm_block_size, hdr, 0, false));
+	});
+	EXPECT_TRUE(std::equal(image.begin(), image.begin() + 0x20000,
+			       flash.begin()));
+	EXPECT_EQ(flash[0x20000], 0xff);
+	EXPECT_EQ(flash[0x30000], 0x5a);
+
+	std::vector<pbc_region> misaligned = {{0x1000, 0x20000, true}};
+	EXPECT_THROW(pbc_encode(image, misaligned, 1, stats), ImageFormatError);
+	std::vector<pbc_region> overlapping = {{0, 0x20000, true},
+					       {0x10000, 0x30000, false}};
+	EXPECT_THROW(pbc_encode(image, overlapping, 1, stats), ImageFormatError);
+}
+
+TEST(PbcEncoder, DeltaOnlyTouchesChangedBlocks) {
+	std::vector<uint8_t> old_image(0x40000);
+	for (size_t idx = 0; idx < old_image.size(); idx++)
+		old_image[idx] = uint8_t(idx * 7 + idx / pfr_blk_size);
+	std::vector<uint8_t> image = old_image;
+	image[0x12345] ^= 1; // one page of the second block
+	std::fill(image.begin() + 0x30000, image.begin() + 0x31000, 0xff);
+	std::vector<pbc_region> regions = {{0, 0x40000, true}};
+
+	pbc_stats stats;
+	std::vector<uint8_t> delta =
+		pbc_encode_delta(old_image, image, regions, 4, stats);
+	EXPECT_EQ(stats.unchanged, 32u);
+	EXPECT_EQ(stats.erased, 32u);
+	EXPECT_EQ(stats.copied, 31u);
+	EXPECT_EQ(stats.blank, 1u);
+
+	std::vector<uint8_t> pfm_buf = signed_pfm(image.size());
+	auto hdr = reinterpret_cast<const pbc*>(delta.data());
+	ram_device dev(image.size());
+	dev.write_raw(0, old_image);
+	EXPECT_TRUE(pbc_apply(dev, reinterpret_cast<const pfm*>(pfm_buf.data()),
+			      pfm_block_size, hdr, 0, false));
+	std::vector<uint8_t> flash(image.size());
+	dev.read(0, flash.data(), flash.size());
+	EXPECT_TRUE(flash == image);
+
+	// unchanged blocks have neither bit
+	auto act_map = reinterpret_cast<const uint8_t*>(hdr + 1);
+	EXPECT_EQ(act_map[0] | act_map[1] | act_map[4] | act_map[5], 0);
+
+	// it is only applied to flash that holds the old image
+	ram_device base(old_image.size());
+	base.write_raw(0, old_image);
+	EXPECT_TRUE(pbc_delta_base_matches(base, hdr, 0));
+	std::vector<uint8_t> other = old_image;
+	other[0x2000] ^= 1; // an unchanged block
+	ram_device other_dev(other.size());
+	other_dev.write_raw(0, other);
+	EXPECT_FALSE(pbc_delta_base_matches(other_dev, hdr, 0));
+	std::vector<uint8_t> full = pbc_encode(image, regions, 1, stats);
+	EXPECT_TRUE(pbc_delta_base_matches(
+		other_dev, reinterpret_cast<const pbc*>(full.data()), 0));
+
+	std::vector<pbc_region> scattered;
+	for (uint32_t start = 0; start < 0x1a0000; start += 0x20000)
+		scattered.push_back({start, start + 0x10000, true});
+	std::vector<uint8_t> big(0x1a0000, 0xff);
+	EXPECT_THROW(pbc_encode_delta(big, big, scattered, 1, stats),
+		     ImageFormatError);
+
+	std::vector<uint8_t> shorter(old_image.begin(),
+				     old_image.begin() + 0x30000);
+	EXPECT_THROW(pbc_encode_delta(shorter, image, regions, 1, stats),
+		     ImageFormatError);
+}
+
+TEST(PbcEncoder, LoadsRegions) {
+	fs::path dir = fs::temp_directory_path() / "mtd-util-regions-test";
+	fs::remove_all(dir);
+	fs::create_directories(dir);
+	std::string file = dir / "regions";
+	std::ofstream(file) << "# start end [erase]\n"
+			       "0 20000\n"
+			       "\n"
+			       "20000 30000 erase # unsigned\n";
+	std::vector<pbc_region> regions = pbc_load_regions(file);
+	ASSERT_EQ(regions.size(), 2u);
+	EXPECT_EQ(regions[0].end, 0x20000u);
+	EXPECT_TRUE(regions[0].copy);
+	EXPECT_EQ(regions[1].start, 0x20000u);
+	EXPECT_FALSE(regions[1].copy);
+
+	for (const char* bad : {"0 20000 copy\n", "0 20000 erase 30000\n",
+				"0 20000 30000\n", "0\n", "0 2000g\n"}) {
+		std::ofstream(file) << bad;
+		EXPECT_THROW(pbc_load_regions(file), FileIOError) << bad;
+	}
+	fs::remove_all(dir);
+}
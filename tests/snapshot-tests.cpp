@@ -0,0 +1,182 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: flash snapshot test utility
+*/
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "snapshot.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace fs = std::filesystem;
+
+#define TEST_BLOCK 0x1000
+#define TEST_DEV_SIZE (32 * TEST_BLOCK)
+
+/* RAM flash with NOR semantics that records what is done to it; erases
+ * round to erase_unit, like mtd::erase to 64K */
+struct ram_device
+{
+	std::vector<uint8_t> flash = std::vector<uint8_t>(TEST_DEV_SIZE, 0xff);
+	std::vector<std::pair<uint32_t, size_t>> erases;
+	size_t programmed = 0;
+	size_t erase_unit = TEST_BLOCK;
+	bool indexed = false;
+	block_index unused_index;
+
+	int read(uint32_t addr, std::vector<uint8_t>& buf)
+	{
+		std::copy_n(flash.begin() + addr, buf.size(), buf.begin());
+		return buf.size();
+	}
+	void erase(uint32_t addr, size_t len)
+	{
+		len += addr % erase_unit;
+		addr -= addr % erase_unit;
+		len = (len + erase_unit - 1) / erase_unit * erase_unit;
+		std::fill_n(flash.begin() + addr, len, 0xff);
+		erases.emplace_back(addr, len);
+	}
+	int write_raw(uint32_t addr, const cbspan& buf)
+	{
+		for (size_t i = 0; i < buf.size(); i++)
+			flash[addr + i] &= buf[i];
+		programmed += buf.size();
+		return buf.size();
+	}
+	size_t size() const
+	{
+		return flash.size();
+	}
+	size_t erase_size() const
+	{
+		return TEST_BLOCK;
+	}
+	size_t erase_block_size() const
+	{
+		return erase_unit;
+	}
+	const block_index* index() const
+	{
+		return indexed ? &unused_index : nullptr;
+	}
+	/* a device that always reads back */
+	bool block_unchanged(uint32_t addr, const cbspan& buf)
+	{
+		return std::equal(buf.begin(), buf.end(), flash.begin() + addr);
+	}
+	bool block_erased(uint32_t addr, size_t len)
+	{
+		return is_blank(flash.data() + addr, len);
+	}
+};
+
+class Snapshot : public ::testing::Test
+{
+  protected:
+	fs::path path{fs::temp_directory_path() / "mtd-util-snapshot-test"};
+	ram_device dev;
+
+	void SetUp() override
+	{
+		// blocks 3 and 20..21 hold data, with a blank page inside block 3
+		for (size_t i = 0; i < TEST_BLOCK; i++)
+			dev.flash[3 * TEST_BLOCK + i] = i * 7;
+		std::fill_n(dev.flash.begin() + 3 * TEST_BLOCK + 0x400,
+			    snapshot_page_size, 0xff);
+		std::fill_n(dev.flash.begin() + 20 * TEST_BLOCK, 0x1100, 0x5a);
+	}
+	void TearDown() override
+	{
+		fs::remove(path);
+	}
+
+	std::vector<uint8_t> take()
+	{
+		int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		EXPECT_GE(fd, 0);
+		EXPECT_EQ(snapshot_write(dev, fd), 3u);
+		close(fd);
+		std::ifstream fin(path, std::ios::binary);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(fin),
+					    {});
+	}
+};
+
+TEST_F(Snapshot, LeavesOutBlankBlocks) {
+	auto snap = take();
+	snapshot_layout layout(TEST_DEV_SIZE, TEST_BLOCK);
+	EXPECT_EQ(snap.size(), layout.data_offset + 3 * TEST_BLOCK);
+	EXPECT_NE(snapshot_check(dev, snap), nullptr);
+}
+
+TEST_F(Snapshot, RestoresWithCoalescedErases) {
+	auto snap = take();
+	auto expected = dev.flash;
+	std::fill(dev.flash.begin(), dev.flash.end(), 0x00);
+	ASSERT_TRUE(snapshot_restore(dev, snap));
+	EXPECT_TRUE(dev.flash == expected);
+	// one erase for the whole device, no blank page programmed
+	ASSERT_EQ(dev.erases.size(), 1u);
+	EXPECT_EQ(dev.erases[0].second, size_t(TEST_DEV_SIZE));
+	EXPECT_EQ(dev.programmed, TEST_BLOCK - snapshot_page_size + 0x1100);
+}
+
+TEST_F(Snapshot, KeepsOnlyWholeEraseUnits) {
+	auto snap = take();
+	auto expected = dev.flash;
+	dev.indexed = true;
+	dev.erase_unit = 2 * TEST_BLOCK;
+	dev.flash[21 * TEST_BLOCK + 7] = 0;
+	ASSERT_TRUE(snapshot_restore(dev, snap));
+	EXPECT_TRUE(dev.flash == expected);
+	// block 21 changed, so block 20 shares its erase and is written again
+	ASSERT_EQ(dev.erases.size(), 1u);
+	EXPECT_EQ(dev.erases[0], std::make_pair(uint32_t(20 * TEST_BLOCK),
+						size_t(2 * TEST_BLOCK)));
+	EXPECT_EQ(dev.programmed, size_t(0x1100));
+}
+
+TEST_F(Snapshot, RejectsCorruption) {
+	auto snap = take();
+	snapshot_layout layout(TEST_DEV_SIZE, TEST_BLOCK);
+	auto bad = snap;
+	bad[layout.data_offset + 5] ^= 1;
+	EXPECT_EQ(snapshot_check(dev, bad), nullptr);
+	bad = snap;
+	bad[sizeof(snapshot_header)] ^= 1;
+	EXPECT_EQ(snapshot_check(dev, bad), nullptr);
+	bad = snap;
+	bad.pop_back();
+	EXPECT_EQ(snapshot_check(dev, bad), nullptr);
+	// a count that wraps the size check around to the file size
+	bad = snap;
+	auto hdr = reinterpret_cast<snapshot_header*>(bad.data());
+	hdr->stored += (uint64_t(1) << 63) / (TEST_BLOCK / 2);
+	EXPECT_EQ(snapshot_check(dev, bad), nullptr);
+	// nothing was touched
+	EXPECT_FALSE(snapshot_restore(dev, bad));
+	EXPECT_TRUE(dev.erases.empty());
+}
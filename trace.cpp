@@ -0,0 +1,141 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: scoped spans written as a Chrome trace event file
+*/
+
+#include "trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <vector>
+
+#include "debug.h"
+
+struct trace_event
+{
+    const char* cat;
+    const char* name;
+    int64_t begin_ns; // since the start of the trace
+    int64_t dur_ns;
+    pid_t tid;
+    bool has_range;
+    uint64_t addr;
+    uint64_t len;
+};
+
+struct trace_state
+{
+    std::mutex lock;
+    std::string path;
+    std::chrono::steady_clock::time_point start;
+    std::vector<trace_event> events;
+    bool written = false;
+};
+
+/* never destroyed, so spans that end during static destruction still work */
+static trace_state& state(void)
+{
+    static trace_state* s = new trace_state;
+    return *s;
+}
+
+static pid_t thread_id(void)
+{
+    static thread_local pid_t tid = ::syscall(SYS_gettid);
+    return tid;
+}
+
+void trace_start(const std::string& path)
+{
+    trace_state& s = state();
+    {
+        std::lock_guard<std::mutex> lock(s.lock);
+        s.path = path;
+        s.start = std::chrono::steady_clock::now();
+        s.events.reserve(4096);
+    }
+    __trace_enabled = true;
+    std::atexit(trace_write);
+}
+
+/* tracing is requested by the environment, so it starts before main */
+static const bool trace_from_env = [] {
+    const char* path = std::getenv(MTD_UTIL_TRACE_ENV);
+    if (path && *path)
+        trace_start(path);
+    return true;
+}();
+
+void trace_record(const char* cat, const char* name,
+                  std::chrono::steady_clock::time_point begin,
+                  std::chrono::steady_clock::time_point end, bool has_range,
+                  uint64_t addr, uint64_t len)
+{
+    trace_state& s = state();
+    pid_t tid = thread_id();
+    std::lock_guard<std::mutex> lock(s.lock);
+    s.events.push_back(trace_event{
+        cat, name,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(begin - s.start)
+            .count(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin)
+            .count(),
+        tid, has_range, addr, len});
+}
+
+/* trace timestamps are in microseconds; keep the nanoseconds */
+static void write_us(std::ostream& out, int64_t ns)
+{
+    if (ns < 0)
+        ns = 0;
+    out << ns / 1000 << '.' << std::setw(3) << std::setfill('0') << ns % 1000;
+}
+
+void trace_write(void)
+{
+    trace_state& s = state();
+    std::lock_guard<std::mutex> lock(s.lock);
+    if (s.written)
+        return;
+    s.written = true;
+    __trace_enabled = false;
+
+    std::ofstream out(s.path);
+    pid_t pid = ::getpid();
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+        << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+        << ", \"args\": {\"name\": \"mtd-util\"}}";
+    for (const trace_event& e : s.events)
+    {
+        out << ",\n{\"name\": \"" << e.name << "\", \"cat\": \"" << e.cat
+            << "\", \"ph\": \"X\", \"pid\": " << std::dec << pid
+            << ", \"tid\": " << e.tid << ", \"ts\": ";
+        write_us(out, e.begin_ns);
+        out << ", \"dur\": ";
+        write_us(out, e.dur_ns);
+        if (e.has_range)
+            out << ", \"args\": {\"addr\": \"0x" << std::hex << e.addr
+                << std::dec << "\", \"len\": " << e.len << '}';
+        out << '}';
+    }
+    out << "\n]}\n";
+    if (!out.flush())
+        FWERROR("failed to write trace to " << s.path);
+}
@@ -0,0 +1,99 @@
+/*
+// Copyright (c) 2025 Intel Corporation
+//
+// This software and the related documents are Intel copyrighted
+// materials, and your use of them is governed by the express license
+// under which they were provided to you ("License"). Unless the
+// License provides otherwise, you may not use, modify, copy, publish,
+// distribute, disclose or transmit this software or the related
+// documents without Intel's prior written permission.
+//
+// This software and the related documents are provided as is, with no
+// express or implied warranties, other than those that are expressly
+// stated in the License.
+//
+// Abstract: scoped spans written as a Chrome trace event file
+*/
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * When MTD_UTIL_TRACE names a file, every span is kept in memory and the
+ * file is written at exit in the Chrome trace event format, which
+ * chrome://tracing and ui.perfetto.dev open. Otherwise a span costs a
+ * single load.
+ */
+#define MTD_UTIL_TRACE_ENV "MTD_UTIL_TRACE"
+
+inline std::atomic<bool> __trace_enabled{false};
+
+inline bool trace_enabled(void)
+{
+    return __trace_enabled.load(std::memory_order_relaxed);
+}
+
+/* start tracing to path (done at startup from MTD_UTIL_TRACE) */
+void trace_start(const std::string& path);
+/* write out the spans recorded so far; called at exit */
+void trace_write(void);
+
+void trace_record(const char* cat, const char* name,
+                  std::chrono::steady_clock::time_point begin,
+                  std::chrono::steady_clock::time_point end, bool has_range,
+                  uint64_t addr, uint64_t len);
+
+/* records the time from construction to destruction; cat and name must be
+ * string literals (they are kept, not copied, and are not escaped) */
+class trace_span
+{
+  public:
+    trace_span(const trace_span&) = delete;
+    trace_span& operator=(const trace_span&) = delete;
+
+    trace_span(const char* cat, const char* name) :
+        _cat(cat), _name(name), _has_range(false), _addr(0), _len(0),
+        _enabled(trace_enabled())
+    {
+        if (_enabled)
+            _begin = std::chrono::steady_clock::now();
+    }
+    /* a span over a range of flash (or of an image) */
+    trace_span(const char* cat, const char* name, uint64_t addr,
+               uint64_t len) :
+        _cat(cat), _name(name), _has_range(true), _addr(addr), _len(len),
+        _enabled(trace_enabled())
+    {
+        if (_enabled)
+            _begin = std::chrono::steady_clock::now();
+    }
+    ~trace_span()
+    {
+        if (_enabled)
+            trace_record(_cat, _name, _begin,
+                         std::chrono::steady_clock::now(), _has_range, _addr,
+                         _len);
+    }
+
+  private:
+    const char* _cat;
+    const char* _name;
+    bool _has_range;
+    uint64_t _addr;
+    uint64_t _len;
+    bool _enabled;
+    std::chrono::steady_clock::time_point _begin;
+};
+
+#define __TRACE_CONCAT(A, B) A##B
+#define _TRACE_CONCAT(A, B) __TRACE_CONCAT(A, B)
+/* TRACE_SPAN(cat, name[, addr, len]) spans the rest of the scope */
+#define TRACE_SPAN(...)                                                        \
+    trace_span _TRACE_CONCAT(__trace_span_, __LINE__)(__VA_ARGS__)
+
+#endif /* __TRACE_H__ */
@@ -19,9 +19,16 @@
 #define __UTIL_H__
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
 #include <iterator>
+#include <mutex>
+#include <span>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 typedef std::span<const uint8_t> cbspan;
@@ -87,4 +94,200 @@ static inline uint64_t hash(const std::string& str)
     return ret;
 }
 
+/* true if len bytes of data are all 0xff (erased NOR flash); 64 bytes are
+ * checked per step as four 16-byte vectors (NEON or SSE2 through the GCC
+ * vector extension), stopping at the first step that is not blank
+ */
+static inline bool is_blank(const uint8_t* data, size_t len)
+{
+    typedef uint64_t vec __attribute__((vector_size(16)));
+    size_t idx = 0;
+
+    for (; idx + 4 * sizeof(vec) <= len; idx += 4 * sizeof(vec))
+    {
+        vec v[4];
+        std::copy(data + idx, data + idx + sizeof(v),
+                  reinterpret_cast<uint8_t*>(v));
+        vec acc = v[0] & v[1] & v[2] & v[3];
+        if ((acc[0] & acc[1]) != ~0ull)
+        {
+            return false;
+        }
+    }
+
+    uint64_t acc = ~0ull;
+    for (; idx + sizeof(uint64_t) <= len; idx += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::copy(data + idx, data + idx + sizeof(word),
+                  reinterpret_cast<uint8_t*>(&word));
+        acc &= word;
+    }
+    for (; idx < len; idx++)
+    {
+        acc &= 0xffffffffffffff00ull | data[idx];
+    }
+    return acc == ~0ull;
+}
+
+/* fast 64-bit content hash (not cryptographic) used to detect
+ * changed flash blocks; data is consumed a word at a time
+ */
+static inline uint64_t fast_hash64(const uint8_t* data, size_t len)
+{
+    uint64_t ret{basis ^ (len * prime)};
+    size_t idx = 0;
+
+    for (; idx + sizeof(uint64_t) <= len; idx += sizeof(uint64_t))
+    {
+        uint64_t word;
+        std::copy(data + idx, data + idx + sizeof(word),
+                  reinterpret_cast<uint8_t*>(&word));
+        ret = (ret ^ word) * prime;
+        ret ^= ret >> 29;
+    }
+    for (; idx < len; idx++)
+    {
+        ret = (ret ^ data[idx]) * prime;
+    }
+    ret ^= ret >> 32;
+    return ret;
+}
+
+/* number of workers to use for CPU or I/O bound parallel loops */
+static inline size_t default_worker_count(void)
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/* call func(0) .. func(count - 1) on up to workers threads (including
+ * the calling thread); the first exception thrown by func is rethrown
+ * once all workers are done
+ */
+template <typename Func>
+static inline void parallel_for(size_t count, size_t workers, Func&& func)
+{
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto worker = [&]() {
+        for (size_t idx = next++; idx < count; idx = next++)
+        {
+            try
+            {
+                func(idx);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error)
+                {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    workers = std::min(workers, count);
+    for (size_t t = 1; t < workers; t++)
+    {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+/* run produce(idx, buf) for idx = 0 .. count - 1 on a worker thread while
+ * the calling thread runs consume(idx, buf) on the buffers already filled;
+ * depth buffers rotate between the two, so at most depth chunks are in
+ * memory at a time. The first exception thrown by either side stops both
+ * (once the chunks produced before it are consumed) and is rethrown once
+ * the worker is done.
+ */
+template <typename Produce, typename Consume>
+static inline void pipeline(size_t count, size_t depth, Produce&& produce,
+                            Consume&& consume)
+{
+    std::vector<std::vector<uint8_t>> bufs(std::max<size_t>(depth, 1));
+    std::mutex lock;
+    std::condition_variable cond;
+    size_t produced = 0, consumed = 0;
+    bool abort = false;
+    std::exception_ptr error;
+
+    auto fail = [&]() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!error)
+        {
+            error = std::current_exception();
+        }
+        abort = true;
+        cond.notify_all();
+    };
+    std::thread worker([&]() {
+        for (size_t idx = 0; idx < count; idx++)
+        {
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [&]() {
+                    return abort || idx - consumed < bufs.size();
+                });
+                if (abort)
+                {
+                    return;
+                }
+            }
+            try
+            {
+                produce(idx, bufs[idx % bufs.size()]);
+            }
+            catch (...)
+            {
+                fail();
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            produced = idx + 1;
+            cond.notify_all();
+        }
+    });
+    for (size_t idx = 0; idx < count; idx++)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [&]() { return abort || produced > idx; });
+            // after a failed produce, the chunks before it are still consumed
+            if (produced <= idx)
+            {
+                break;
+            }
+        }
+        try
+        {
+            consume(idx, bufs[idx % bufs.size()]);
+        }
+        catch (...)
+        {
+            fail();
+            break;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        consumed = idx + 1;
+        cond.notify_all();
+    }
+    worker.join();
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
 #endif /* __UTIL_H__ */